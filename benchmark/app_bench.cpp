@@ -0,0 +1,402 @@
+#include "../example/example.h"
+#include "../utils/latency.h"
+#include "../utils/perf_counters.h"
+#include "../utils/timer.h"
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Application-shaped workloads, each written once against a pointer policy
+// and run with ref_ptr/obs_ptr and shared_ptr/weak_ptr:
+//   scene_graph - threads traverse a tree whose nodes hold their children by
+//                 strong pointer and their parent by weak pointer.
+//   lru_cache   - threads look up a sharded LRU cache that hands out strong
+//                 pointers and releases evicted values outside its locks.
+//   dag         - worker threads run a layered task DAG; ready tasks are
+//                 passed between threads through a queue of strong pointers.
+// Every run reports items/s and p50/p99/p999 latency of one operation
+// (a traversal, a lookup, or a task's ready-to-start delay), and with
+// REF_PTR_PERF_COUNTERS set hardware events per item.
+
+class RefBase : public CountedAbstractObject {
+public:
+  RefBase(refcnt_type *cnt) : CountedAbstractObject(cnt) {}
+  void foo() override {}
+};
+
+struct SharedBase {
+  virtual ~SharedBase() = default;
+};
+
+struct RefPolicy {
+  using Base = RefBase;
+  template <typename T> using Strong = ref_ptr<T>;
+  template <typename T> using Weak = obs_ptr<T>;
+  template <typename T> static Strong<T> make() {
+    return make_ref_ptr<T, IObject, AllocImpl>(nullptr);
+  }
+};
+
+struct SharedPolicy {
+  using Base = SharedBase;
+  template <typename T> using Strong = std::shared_ptr<T>;
+  template <typename T> using Weak = std::weak_ptr<T>;
+  template <typename T> static Strong<T> make() {
+    return std::make_shared<T>();
+  }
+};
+
+// Base is constructed with the control block for ref_ptr, with nothing for
+// shared_ptr.
+#define POLICY_OBJECT(Name)                                                    \
+  template <typename... Cnt>                                                   \
+  explicit Name(Cnt... cnt) : P::Base(cnt...) {}
+
+// Latencies and hardware events of all iterations of a run.
+struct RunStats {
+  LatencyRecorder latency;
+  PerfCounters perf;
+
+  void report(benchmark::State &st, double items) {
+    st.SetItemsProcessed(int64_t(items));
+    st.counters["p50_ns"] = double(latency.percentile(0.5));
+    st.counters["p99_ns"] = double(latency.percentile(0.99));
+    st.counters["p999_ns"] = double(latency.percentile(0.999));
+    perf.report(st, items);
+  }
+};
+
+// Runs fn(thread_index, recorder) on `threads` threads and returns the wall
+// time of the whole run.
+template <typename F> double run_threads(int threads, RunStats &stats, F &&fn) {
+  std::vector<LatencyRecorder> recorders(threads);
+  std::vector<std::thread> workers;
+  stats.perf.start();
+  Timer t;
+  for (int i = 0; i < threads; i++)
+    workers.emplace_back([&, i] { fn(i, recorders[i]); });
+  for (auto &w : workers)
+    w.join();
+  const auto elapsed = t.elapse_s();
+  stats.perf.stop();
+  for (auto &r : recorders)
+    stats.latency.merge(r);
+  return elapsed;
+}
+
+template <typename P> struct SceneNode : P::Base {
+  POLICY_OBJECT(SceneNode)
+  using Strong = typename P::template Strong<SceneNode>;
+  using Weak = typename P::template Weak<SceneNode>;
+  std::vector<Strong> children;
+  Weak parent;
+  float local{1};
+  float world{0};
+};
+
+template <typename P> void BM_SceneGraph(benchmark::State &st) {
+  using Node = SceneNode<P>;
+  using Strong = typename Node::Strong;
+  constexpr int FANOUT = 4;
+  constexpr int DEPTH = 6;
+  constexpr int FRAMES = 100;
+  const int threads = int(st.range(0));
+
+  size_t nodes = 1;
+  auto root = P::template make<Node>();
+  std::vector<Strong> level{root};
+  for (int d = 1; d < DEPTH; d++) {
+    std::vector<Strong> next;
+    for (auto &parent : level) {
+      for (int i = 0; i < FANOUT; i++) {
+        auto child = P::template make<Node>();
+        child->parent = typename Node::Weak(parent);
+        child->world = parent->world + child->local;
+        parent->children.push_back(child);
+        next.push_back(std::move(child));
+        nodes++;
+      }
+    }
+    level = std::move(next);
+  }
+  level.clear();
+
+  RunStats stats;
+  for (auto _ : st) {
+    st.SetIterationTime(run_threads(threads, stats, [&](int, auto &rec) {
+      std::vector<Strong> stack;
+      float sum = 0;
+      for (int f = 0; f < FRAMES; f++) {
+        const auto start = LatencyRecorder::now();
+        stack.push_back(root);
+        while (!stack.empty()) {
+          auto node = std::move(stack.back());
+          stack.pop_back();
+          if (auto parent = node->parent.lock())
+            sum += parent->world + node->local;
+          for (const auto &child : node->children)
+            stack.push_back(child);
+        }
+        rec.record(start, LatencyRecorder::now());
+      }
+      benchmark::DoNotOptimize(sum);
+    }));
+  }
+  stats.report(st, double(st.iterations()) * threads * FRAMES * nodes);
+}
+
+template <typename P> struct CacheValue : P::Base {
+  POLICY_OBJECT(CacheValue)
+  uint64_t key{0};
+  char payload[64]{};
+};
+
+template <typename P> class LruCache {
+public:
+  using Value = CacheValue<P>;
+  using Strong = typename P::template Strong<Value>;
+
+  explicit LruCache(size_t capacity) : _capacity(capacity / SHARDS) {}
+
+  Strong get(uint64_t key) {
+    auto &s = _shards[key % SHARDS];
+    Strong evicted; // released after the lock
+    {
+      std::lock_guard<std::mutex> lk(s.mtx);
+      if (auto it = s.index.find(key); it != s.index.end()) {
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        return it->second->second;
+      }
+    }
+    auto value = P::template make<Value>();
+    value->key = key;
+    std::lock_guard<std::mutex> lk(s.mtx);
+    if (auto it = s.index.find(key); it != s.index.end())
+      return it->second->second;
+    s.lru.emplace_front(key, value);
+    s.index[key] = s.lru.begin();
+    if (s.lru.size() > _capacity) {
+      evicted = std::move(s.lru.back().second);
+      s.index.erase(s.lru.back().first);
+      s.lru.pop_back();
+    }
+    return value;
+  }
+
+private:
+  static constexpr size_t SHARDS = 16;
+  struct Shard {
+    std::mutex mtx;
+    std::list<std::pair<uint64_t, Strong>> lru;
+    std::unordered_map<uint64_t, typename decltype(lru)::iterator> index;
+  };
+  size_t _capacity;
+  Shard _shards[SHARDS];
+};
+
+template <typename P> void BM_LruCache(benchmark::State &st) {
+  constexpr size_t KEYS = 100000;
+  constexpr size_t CAPACITY = 10000;
+  constexpr int OPS = 100000;
+  const int threads = int(st.range(0));
+
+  // Skewed keys: a small hot set plus a long tail of misses.
+  std::vector<std::vector<uint64_t>> keys(threads);
+  std::mt19937_64 rng(42);
+  std::uniform_real_distribution<double> u(0, 1);
+  for (auto &k : keys) {
+    k.reserve(OPS);
+    for (int i = 0; i < OPS; i++) {
+      const auto x = u(rng);
+      k.push_back(uint64_t(x * x * x * KEYS));
+    }
+  }
+
+  LruCache<P> cache(CAPACITY);
+  RunStats stats;
+  for (auto _ : st) {
+    st.SetIterationTime(run_threads(threads, stats, [&](int i, auto &rec) {
+      uint64_t sum = 0;
+      for (auto key : keys[i]) {
+        const auto start = LatencyRecorder::now();
+        auto value = cache.get(key);
+        sum += value->key;
+        value = nullptr;
+        rec.record(start, LatencyRecorder::now());
+      }
+      benchmark::DoNotOptimize(sum);
+    }));
+  }
+  stats.report(st, double(st.iterations()) * threads * OPS);
+}
+
+template <typename P> struct DagTask : P::Base {
+  POLICY_OBJECT(DagTask)
+  using Strong = typename P::template Strong<DagTask>;
+  std::vector<Strong> successors;
+  int indegree{0};
+  std::atomic<int> pending{0};
+  LatencyRecorder::clock::time_point ready;
+};
+
+template <typename P> class DagScheduler {
+public:
+  using Task = DagTask<P>;
+  using Strong = typename Task::Strong;
+
+  DagScheduler(int workers, const std::vector<Strong> &tasks)
+      : _tasks(tasks), _recorders(workers) {
+    for (int i = 0; i < workers; i++)
+      _workers.emplace_back([this, i] { work(_recorders[i]); });
+  }
+
+  ~DagScheduler() {
+    {
+      std::lock_guard<std::mutex> lk(_mtx);
+      _stop = true;
+    }
+    _cond.notify_all();
+    for (auto &w : _workers)
+      w.join();
+  }
+
+  // Runs the whole DAG once and returns its wall time.
+  double run() {
+    Timer t;
+    _done = 0;
+    std::vector<Strong> roots;
+    for (auto &task : _tasks) {
+      task->pending = task->indegree;
+      if (task->indegree == 0)
+        roots.push_back(task);
+    }
+    for (auto &task : roots)
+      push(std::move(task));
+    std::unique_lock<std::mutex> lk(_done_mtx);
+    _done_cond.wait(lk, [this] { return _done == _tasks.size(); });
+    return t.elapse_s();
+  }
+
+  LatencyRecorder latency() const {
+    LatencyRecorder all;
+    for (auto &r : _recorders)
+      all.merge(r);
+    return all;
+  }
+
+private:
+  void push(Strong task) {
+    task->ready = LatencyRecorder::now();
+    {
+      std::lock_guard<std::mutex> lk(_mtx);
+      _queue.push_back(std::move(task));
+    }
+    _cond.notify_one();
+  }
+
+  void work(LatencyRecorder &rec) {
+    for (;;) {
+      Strong task;
+      {
+        std::unique_lock<std::mutex> lk(_mtx);
+        _cond.wait(lk, [this] { return _stop || !_queue.empty(); });
+        if (_stop)
+          return;
+        task = std::move(_queue.front());
+        _queue.pop_front();
+      }
+      rec.record(task->ready, LatencyRecorder::now());
+      uint64_t x = uint64_t(task.get());
+      for (int i = 0; i < 200; i++)
+        x = x * 6364136223846793005ull + 1442695040888963407ull;
+      benchmark::DoNotOptimize(x);
+      for (const auto &next : task->successors) {
+        if (--next->pending == 0)
+          push(next);
+      }
+      task = nullptr;
+      if (++_done == _tasks.size()) {
+        std::lock_guard<std::mutex> lk(_done_mtx);
+        _done_cond.notify_one();
+      }
+    }
+  }
+
+  const std::vector<Strong> &_tasks;
+  std::vector<LatencyRecorder> _recorders;
+  std::vector<std::thread> _workers;
+  std::mutex _mtx;
+  std::condition_variable _cond;
+  std::deque<Strong> _queue;
+  bool _stop{false};
+  std::atomic<size_t> _done{0};
+  std::mutex _done_mtx;
+  std::condition_variable _done_cond;
+};
+
+template <typename P> void BM_Dag(benchmark::State &st) {
+  using Task = DagTask<P>;
+  constexpr int LAYERS = 32;
+  constexpr int WIDTH = 64;
+  constexpr int EDGES = 3;
+  const int workers = int(st.range(0));
+
+  std::vector<typename Task::Strong> tasks;
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> pick(0, WIDTH - 1);
+  for (int l = 0; l < LAYERS; l++) {
+    for (int w = 0; w < WIDTH; w++)
+      tasks.push_back(P::template make<Task>());
+    if (l == 0)
+      continue;
+    for (int w = 0; w < WIDTH; w++) {
+      auto &from = tasks[(l - 1) * WIDTH + w];
+      for (int e = 0; e < EDGES; e++) {
+        auto &to = tasks[l * WIDTH + pick(rng)];
+        from->successors.push_back(to);
+        to->indegree++;
+      }
+    }
+  }
+
+  // Opened before the scheduler starts its workers so that they are counted.
+  RunStats stats;
+  {
+    DagScheduler<P> scheduler(workers, tasks);
+    for (auto _ : st) {
+      stats.perf.start();
+      st.SetIterationTime(scheduler.run());
+      stats.perf.stop();
+    }
+    stats.latency = scheduler.latency();
+  }
+  stats.report(st, double(st.iterations()) * tasks.size());
+}
+
+#define APP_BENCHMARK(name, label)                                             \
+  BENCHMARK_TEMPLATE(name, RefPolicy)                                          \
+      ->Name(label "/ref_ptr")                                                 \
+      ->UseManualTime()                                                        \
+      ->RangeMultiplier(2)                                                     \
+      ->Range(1, 8);                                                           \
+  BENCHMARK_TEMPLATE(name, SharedPolicy)                                       \
+      ->Name(label "/shared_ptr")                                              \
+      ->UseManualTime()                                                        \
+      ->RangeMultiplier(2)                                                     \
+      ->Range(1, 8)
+
+APP_BENCHMARK(BM_SceneGraph, "scene_graph");
+APP_BENCHMARK(BM_LruCache, "lru_cache");
+APP_BENCHMARK(BM_Dag, "dag");
+
+BENCHMARK_MAIN();
@@ -0,0 +1,105 @@
+#include "../example/example.h"
+#include "../include/ref_ptr_batch.h"
+#include "../utils/perf_counters.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+// Out-of-cache arrays of range(0) obs_ptr to objects allocated in a
+// shuffled order, so that neighbouring elements point to unrelated memory;
+// one object in eight has expired. The lock cases fill an array of
+// ref_ptr, the others read a field of every live object:
+//   lock/loop       - obs_ptr::lock() one element after another
+//   lock/lock_all   - lock_all()
+//   live/loop       - lock, read and drop one element after another
+//   live/batch      - for_each_live()
+// Reported:
+//   time/element and the hardware events per element, with
+//   REF_PTR_PERF_COUNTERS set
+
+class Item : public CountedAbstractObject {
+public:
+  Item(refcnt_type *cnt, int64_t value)
+      : CountedAbstractObject(cnt), value(value) {}
+  void foo() override {}
+  int64_t value;
+};
+
+enum class Case { LOCK_LOOP, LOCK_ALL, LIVE_LOOP, LIVE_BATCH };
+
+struct Items {
+  std::vector<ref_ptr<Item>> refs; // owners of the live objects
+  std::vector<obs_ptr<Item>> obs;
+
+  explicit Items(size_t n) {
+    std::vector<ref_ptr<Item>> made;
+    made.reserve(n);
+    for (size_t i = 0; i < n; i++)
+      made.push_back(make_ref<Item>(int64_t(i)));
+    std::shuffle(made.begin(), made.end(), std::mt19937_64(42));
+    refs.reserve(n);
+    obs.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+      obs.emplace_back(made[i]);
+      refs.push_back(i % 8 == 7 ? nullptr : std::move(made[i]));
+    }
+  }
+};
+
+static void BM_Batch(benchmark::State &st, Case c) {
+  const auto n = size_t(st.range(0));
+  Items items(n);
+  std::vector<ref_ptr<Item>> locked(n);
+
+  PerfCounters perf;
+  for (auto _ : st) {
+    st.PauseTiming();
+    locked.assign(n, nullptr);
+    st.ResumeTiming();
+    perf.start();
+    int64_t sum = 0;
+    switch (c) {
+    case Case::LOCK_LOOP:
+      for (size_t i = 0; i < n; i++) {
+        locked[i] = items.obs[i].lock();
+        sum += bool(locked[i]);
+      }
+      break;
+    case Case::LOCK_ALL:
+      sum = int64_t(lock_all(std::span(items.obs), locked.data()));
+      break;
+    case Case::LIVE_LOOP:
+      for (auto &o : items.obs) {
+        if (auto p = o.lock())
+          sum += p->value;
+      }
+      break;
+    case Case::LIVE_BATCH:
+      for_each_live(std::span(items.obs), [&](Item &i) { sum += i.value; });
+      break;
+    }
+    benchmark::DoNotOptimize(sum);
+    perf.stop();
+  }
+  const double elements = double(st.iterations()) * double(n);
+  perf.report(st, elements);
+  st.counters["time/element"] = benchmark::Counter(
+      elements, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+
+#define BATCH_BENCHMARK(c, label)                                              \
+  BENCHMARK_CAPTURE(BM_Batch, c, Case::c)                                      \
+      ->Name(label)                                                            \
+      ->Unit(benchmark::kMillisecond)                                          \
+      ->RangeMultiplier(8)                                                     \
+      ->Range(1 << 16, 1 << 22)
+
+BATCH_BENCHMARK(LOCK_LOOP, "lock/loop");
+BATCH_BENCHMARK(LOCK_ALL, "lock/lock_all");
+BATCH_BENCHMARK(LIVE_LOOP, "live/loop");
+BATCH_BENCHMARK(LIVE_BATCH, "live/batch");
+
+BENCHMARK_MAIN();
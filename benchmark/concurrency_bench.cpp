@@ -1,4 +1,5 @@
 #include "../example/example.h"
+#include "../utils/perf_counters.h"
 #include "../utils/task.h"
 #include "../utils/thread_pool.h"
 #include "../utils/timer.h"
@@ -21,6 +22,8 @@ using SharedPtr = std::shared_ptr<A>;
 using WeakPtr = std::weak_ptr<A>;
 
 struct TaskOps {
+  // Opened before the pool starts its threads so that they are counted.
+  PerfCounters perf;
   thread_pool pool{MAX_TASK_NUM};
   std::vector<std::vector<int>> tasks_ops{TASK_NUM};
   TaskOps() {
@@ -45,7 +48,9 @@ template <typename StrongPtrType, typename WeakPtrType>
 void BM_Concurrency(benchmark::State &st, StrongPtrType ptr) {
   auto data = init();
   const auto task_num = st.range(0);
+  data->perf.reset();
   for (auto _ : st) {
+    data->perf.start();
     Timer t;
     for (auto task_id = 0; task_id < task_num; task_id++) {
       data->pool.append_task(
@@ -53,17 +58,22 @@ void BM_Concurrency(benchmark::State &st, StrongPtrType ptr) {
     }
     data->pool.wait();
     st.SetIterationTime(t.elapse_s());
+    data->perf.stop();
   }
+  data->perf.report(st, double(st.iterations()) * task_num * OPS_NUM);
 }
 
-BENCHMARK_TEMPLATE2_CAPTURE(BM_Concurrency, RefPtr, ObsPtr, ref_ptr,
-                            make_ref<DerivedObject>())
+// BENCHMARK_TEMPLATE2_CAPTURE needs google benchmark 1.8; instantiating
+// first lets BENCHMARK_CAPTURE register the same with older releases.
+constexpr auto BM_RefPtr = &BM_Concurrency<RefPtr, ObsPtr>;
+constexpr auto BM_SharedPtr = &BM_Concurrency<SharedPtr, WeakPtr>;
+
+BENCHMARK_CAPTURE(BM_RefPtr, ref_ptr, make_ref<DerivedObject>())
     ->Name("ref_ptr")
     ->UseManualTime()
     ->DenseRange(1, 20);
 
-BENCHMARK_TEMPLATE2_CAPTURE(BM_Concurrency, SharedPtr, WeakPtr, shared_ptr,
-                            make_shared<A>())
+BENCHMARK_CAPTURE(BM_SharedPtr, shared_ptr, make_shared<A>())
     ->Name("shared_ptr")
     ->UseManualTime()
     ->DenseRange(1, 20);
@@ -0,0 +1,250 @@
+#include "../example/example.h"
+#include "../include/ref_ptr_deferred.h"
+#include "../utils/affinity.h"
+#include "../utils/perf_counters.h"
+#include "../utils/timer.h"
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <barrier>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Contention matrix for the reference counts. Each case is named
+//   <pattern>/layout:<padded|packed>/affinity:<...>/objects:<k>/mix:<...>
+//   /threads:<n>
+// pattern  shared  - all threads work on the same k objects
+//          pairs   - every two threads share k objects
+//          private - each thread has its own k objects; objects of different
+//                    threads are allocated back to back, so packed control
+//                    blocks of different threads share cache lines
+//          handoff - thread pairs, one copies objects into a ring and the
+//                    other takes them out and drops them (mix:handoff)
+// layout   padded  - RefCntImpl<IObject> (counters on separate cache lines)
+//          packed  - RefCntImpl<IObject, 1>
+// affinity see utils/affinity.h; skipped when the machine lacks it
+// mix      copy (ref/deref), lock (obs_ptr::lock/drop), weak (obs_ptr
+//          create/drop), mixed (2 copy : 1 lock : 1 weak), deferred
+//          (deferred_ref_ptr copy/drop in a deferred_epoch), deferred_inc
+//          (the same in a deferred_epoch(true))
+// Reported: ns/op per thread and sizeof the control block; with
+// REF_PTR_PERF_COUNTERS set also hardware events per op summed over the
+// threads (hitm/op is the cache line transfer rate). The deferred mixes
+// also report atomics/op, the counter updates left per copy/drop.
+
+constexpr int OPS = 200000;
+
+template <size_t Align>
+class MatrixObject
+    : public RefCountedObject<IObject, RefCntImpl<IObject, Align>> {
+public:
+  using base = RefCountedObject<IObject, RefCntImpl<IObject, Align>>;
+  MatrixObject(typename base::refcnt_type *cnt) : base(cnt) {}
+  void foo() override {}
+};
+
+// Objects come from a bump arena so that consecutive control blocks, which
+// are allocated with new, end up next to each other on the heap.
+struct ArenaAlloc {
+  std::vector<char> buf = std::vector<char>(1 << 20);
+  size_t used = 0;
+  void *alloc(size_t size) {
+    auto p = buf.data() + used;
+    used += (size + 15) / 16 * 16;
+    return p;
+  }
+  void dealloc(void *) {}
+};
+
+enum class Pattern { SHARED, PAIRS, PRIVATE, HANDOFF };
+enum class Mix { COPY, LOCK, WEAK, MIXED, DEFERRED, DEFERRED_INC };
+
+const char *pattern_name(Pattern p) {
+  const char *names[] = {"shared", "pairs", "private", "handoff"};
+  return names[int(p)];
+}
+
+const char *mix_name(Mix m) {
+  const char *names[] = {"copy",  "lock",     "weak",
+                         "mixed", "deferred", "deferred_inc"};
+  return names[int(m)];
+}
+
+template <typename Strong, typename Weak>
+void apply(Mix mix, int i, const Strong &obj, const Weak &obs) {
+  if (mix == Mix::MIXED)
+    mix = (i & 3) < 2 ? Mix::COPY : (i & 3) == 2 ? Mix::LOCK : Mix::WEAK;
+  switch (mix) {
+  case Mix::COPY: {
+    Strong copy(obj);
+    benchmark::DoNotOptimize(copy);
+  } break;
+  case Mix::LOCK: {
+    auto locked = obs.lock();
+    benchmark::DoNotOptimize(locked);
+  } break;
+  default: {
+    Weak weak(obj);
+    benchmark::DoNotOptimize(weak);
+  } break;
+  }
+}
+
+// Single-producer/single-consumer ring of strong pointers.
+template <typename Strong> struct Ring {
+  static constexpr size_t SIZE = 256;
+  Strong slots[SIZE];
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+
+  void push(Strong p) {
+    const auto h = head.load(std::memory_order_relaxed);
+    while (h - tail.load(std::memory_order_acquire) == SIZE)
+      std::this_thread::yield();
+    slots[h % SIZE] = std::move(p);
+    head.store(h + 1, std::memory_order_release);
+  }
+
+  Strong pop() {
+    const auto t = tail.load(std::memory_order_relaxed);
+    while (head.load(std::memory_order_acquire) == t)
+      std::this_thread::yield();
+    auto p = std::move(slots[t % SIZE]);
+    tail.store(t + 1, std::memory_order_release);
+    return p;
+  }
+};
+
+template <size_t Align>
+void BM_Contention(benchmark::State &st, Pattern pattern, Affinity affinity,
+                   int objects, Mix mix, int threads) {
+  using Object = MatrixObject<Align>;
+  using Strong = ref_ptr<Object>;
+  using Weak = obs_ptr<Object>;
+
+  const auto placement = place_threads(affinity, threads);
+  if (!placement) {
+    st.SkipWithError("placement not available on this machine");
+    return;
+  }
+
+  // groups[g][j]: object j of sharing group g
+  const int degree = pattern == Pattern::SHARED    ? threads
+                     : pattern == Pattern::PRIVATE ? 1
+                                                   : 2;
+  const int groups = threads / degree;
+  ArenaAlloc arena;
+  std::vector<std::vector<Strong>> objs(groups);
+  std::vector<std::vector<Weak>> obs(groups);
+  for (int j = 0; j < objects; j++) {
+    for (int g = 0; g < groups; g++) {
+      objs[g].push_back(make_ref_ptr<Object, IObject, ArenaAlloc,
+                                     RefCntImpl<IObject, Align>>(&arena));
+      obs[g].emplace_back(objs[g].back());
+    }
+  }
+  std::vector<Ring<Strong>> rings(pattern == Pattern::HANDOFF ? groups : 0);
+  const bool deferred = mix == Mix::DEFERRED || mix == Mix::DEFERRED_INC;
+  std::atomic<size_t> atomics{0};
+
+  PerfCounters perf;
+  double elapsed = 0;
+  for (auto _ : st) {
+    std::barrier start(threads + 1);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+      workers.emplace_back([&, t] {
+        pin_thread((*placement)[t]);
+        const auto g = t / degree;
+        const auto &mine = objs[g];
+        const auto &weak = obs[g];
+        start.arrive_and_wait();
+        if (deferred) {
+          // The epoch's reference of its own to each object.
+          deferred_epoch epoch(mix == Mix::DEFERRED_INC);
+          auto &counts = deferred_counts::local();
+          std::vector<deferred_ref_ptr<Object>> held;
+          for (const auto &p : mine)
+            held.emplace_back(p);
+          const auto before = counts.atomics();
+          for (int i = 0; i < OPS; i++) {
+            deferred_ref_ptr<Object> copy(held[i % objects]);
+            benchmark::DoNotOptimize(copy);
+          }
+          held.clear();
+          counts.flush();
+          atomics += counts.atomics() - before;
+        } else if (pattern != Pattern::HANDOFF) {
+          for (int i = 0; i < OPS; i++)
+            apply(mix, i, mine[i % objects], weak[i % objects]);
+        } else if (t % 2 == 0) {
+          for (int i = 0; i < OPS; i++)
+            rings[g].push(mine[i % objects]);
+        } else {
+          for (int i = 0; i < OPS; i++)
+            rings[g].pop();
+        }
+      });
+    }
+    perf.start();
+    start.arrive_and_wait();
+    Timer timer;
+    for (auto &w : workers)
+      w.join();
+    elapsed += timer.elapse_s();
+    perf.stop();
+    st.SetIterationTime(timer.elapse_s());
+  }
+  perf.report(st, double(st.iterations()) * OPS * threads);
+  st.counters["ns/op"] = elapsed * 1e9 / (double(st.iterations()) * OPS);
+  st.counters["sizeof_control"] = double(sizeof(RefCntImpl<IObject, Align>));
+  if (deferred)
+    st.counters["atomics/op"] =
+        double(atomics) / (double(st.iterations()) * OPS * threads);
+}
+
+int main(int argc, char **argv) {
+  const Affinity pinned[] = {Affinity::SAME_CPU, Affinity::SMT, Affinity::CORE,
+                             Affinity::CROSS_SOCKET};
+  for (auto pattern :
+       {Pattern::SHARED, Pattern::PAIRS, Pattern::PRIVATE, Pattern::HANDOFF}) {
+    for (bool packed : {false, true}) {
+      for (int objects : {1, 16}) {
+        for (auto mix : {Mix::COPY, Mix::LOCK, Mix::WEAK, Mix::MIXED,
+                         Mix::DEFERRED, Mix::DEFERRED_INC}) {
+          if (pattern == Pattern::HANDOFF && mix != Mix::COPY)
+            continue;
+          std::vector<std::pair<Affinity, int>> placements = {
+              {Affinity::NONE, 2}, {Affinity::NONE, 4}};
+          for (auto a : pinned)
+            placements.emplace_back(a, 2);
+          for (auto [affinity, threads] : placements) {
+            const auto name =
+                std::string(pattern_name(pattern)) +
+                "/layout:" + (packed ? "packed" : "padded") +
+                "/affinity:" + affinity_name(affinity) +
+                "/objects:" + std::to_string(objects) +
+                "/mix:" +
+                (pattern == Pattern::HANDOFF ? "handoff" : mix_name(mix)) +
+                "/threads:" + std::to_string(threads);
+            constexpr auto PADDED = hardware_destructive_interference_size;
+            auto fn = packed ? BM_Contention<1> : BM_Contention<PADDED>;
+            benchmark::RegisterBenchmark(name.c_str(), fn, pattern, affinity,
+                                         objects, mix, threads)
+                ->UseManualTime()
+                ->Iterations(5);
+          }
+        }
+      }
+    }
+  }
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
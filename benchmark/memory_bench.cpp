@@ -0,0 +1,350 @@
+#include "../example/example.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+// Memory footprint of N live objects created through make_ref_ptr, or as the
+// elements of one make_ref_ptr_array, next to
+// std::make_shared/std::allocate_shared. Every run creates N objects with a
+// given payload, optionally keeps one observer for `weak`% of them, then
+// reports:
+//   rss/obj        - resident set growth per object (includes the pointer
+//                    and observer vectors the application keeps)
+//   heap/obj       - bytes in use by malloc per object (glibc only)
+//   allocs/obj     - allocations per object
+//   sizeof_object  - sizeof the managed object (payload + ref counter base)
+//   sizeof_control - bytes of the separate control block, 0 for make_shared
+//                    and for array elements, which share one
+// ref_ptr_packed uses the packed control block layout, RefCntImpl<I, 1>;
+// ref_ptr_strong the block without weak references, StrongRefCntImpl<I>;
+// alloc:pool a size-class pool that relies on sized deallocation.
+//   sizeof_strong  - sizeof(ref_ptr)/sizeof(shared_ptr)
+//   sizeof_weak    - sizeof(obs_ptr)/sizeof(weak_ptr)
+//
+// Usage: memory_bench [--objects=N[,N...]] [google benchmark flags]
+//   e.g. --objects=1000000,10000000,100000000 --benchmark_out=m.json
+//        --benchmark_out_format=json
+
+template <size_t N, typename RefCntType = RefCntImpl<IObject>>
+class RefPayload : public RefCountedObject<IObject, RefCntType> {
+public:
+  RefPayload(RefCntType *cnt) : RefCountedObject<IObject, RefCntType>(cnt) {}
+  void foo() override {}
+  char data[N];
+};
+
+template <size_t N> struct SharedPayload {
+  virtual void foo() {}
+  virtual ~SharedPayload() = default;
+  char data[N];
+};
+
+// Stateless malloc/free allocator, usable both as an AllocatorType for
+// vm_make and as a std allocator for allocate_shared.
+template <typename T = char> struct MallocAlloc {
+  using value_type = T;
+  MallocAlloc() = default;
+  template <typename U> MallocAlloc(const MallocAlloc<U> &) {}
+  void *alloc(size_t size) { return std::malloc(size); }
+  void dealloc(void *ptr) { std::free(ptr); }
+  T *allocate(size_t n) { return static_cast<T *>(std::malloc(n * sizeof(T))); }
+  void deallocate(T *p, size_t) { std::free(p); }
+  template <typename U> bool operator==(const MallocAlloc<U> &) const {
+    return true;
+  }
+};
+
+// Size-class pool: allocations are carved out of 1 MiB chunks without a
+// header and freed onto a per-class list, which needs the size passed to
+// dealloc. Control blocks come from the pool too.
+class PoolAlloc {
+public:
+  static constexpr size_t GRANULE = 16;
+  static constexpr size_t CHUNK = size_t(1) << 20;
+
+  void *alloc(size_t size) { return alloc_block(size, GRANULE); }
+  void dealloc(void *) {} // constructor threw: leak rather than guess
+  void dealloc(void *ptr, size_t size) {
+    auto &head = _free[size_class(size)];
+    *static_cast<void **>(ptr) = head;
+    head = ptr;
+  }
+  void *alloc_block(size_t size, size_t align) {
+    auto &head = _free[size_class(size)];
+    if (head && align <= GRANULE) {
+      void *p = head;
+      head = *static_cast<void **>(p);
+      return p;
+    }
+    const size_t bytes = size_class(size) * GRANULE;
+    _top = (_top + align - 1) / align * align;
+    if (!_chunk || _top + bytes > CHUNK) {
+      _chunk = static_cast<uint8_t *>(std::malloc(CHUNK));
+      _top = 0;
+    }
+    void *p = _chunk + _top;
+    _top += bytes;
+    return p;
+  }
+  void dealloc_block(void *ptr, size_t size) { dealloc(ptr, size); }
+
+private:
+  static size_t size_class(size_t size) {
+    return (size + GRANULE - 1) / GRANULE;
+  }
+
+  std::vector<void *> _free = std::vector<void *>(CHUNK / GRANULE);
+  uint8_t *_chunk{nullptr};
+  size_t _top{0};
+};
+
+static size_t g_allocs = 0;
+
+void *operator new(size_t size) {
+  g_allocs++;
+  if (auto p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void *operator new[](size_t size) { return ::operator new(size); }
+void *operator new(size_t size, std::align_val_t al) {
+  g_allocs++;
+  const auto align = static_cast<size_t>(al);
+  if (auto p = std::aligned_alloc(align, (size + align - 1) / align * align))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+struct MemoryStats {
+  size_t rss{0};
+  size_t heap{0};
+  size_t allocs{0};
+
+  static MemoryStats now() {
+    MemoryStats s;
+#if defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+#if defined(__linux__)
+    std::ifstream statm("/proc/self/statm");
+    size_t size = 0, resident = 0;
+    statm >> size >> resident;
+    s.rss = resident * sysconf(_SC_PAGESIZE);
+#endif
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    s.heap = mallinfo2().uordblks;
+#endif
+    s.allocs = g_allocs;
+    return s;
+  }
+};
+
+template <typename Strong, typename Weak, typename Make>
+void run(benchmark::State &st, size_t n, int weak_percent, Make make,
+         size_t sizeof_object, size_t sizeof_control) {
+  for (auto _ : st) {
+    const auto observed = n * weak_percent / 100;
+    std::vector<Strong> objects;
+    std::vector<Weak> observers;
+    const auto before = MemoryStats::now();
+    objects.reserve(n);
+    observers.reserve(observed);
+    for (size_t i = 0; i < n; i++)
+      objects.push_back(make());
+    for (size_t i = 0; i < observed; i++)
+      observers.emplace_back(objects[i]);
+    const auto after = MemoryStats::now();
+
+    // Signed: pages or heap freed by the previous run can be returned while
+    // this one measures, so a figure may drop.
+    const auto growth = [](size_t to, size_t from) {
+      return double(int64_t(to) - int64_t(from));
+    };
+    const double count = double(n);
+    st.counters["rss/obj"] = growth(after.rss, before.rss) / count;
+    st.counters["heap/obj"] = growth(after.heap, before.heap) / count;
+    st.counters["allocs/obj"] = double(after.allocs - before.allocs) / count;
+    st.counters["sizeof_object"] = double(sizeof_object);
+    st.counters["sizeof_control"] = double(sizeof_control);
+    st.counters["sizeof_strong"] = double(sizeof(Strong));
+    st.counters["sizeof_weak"] = double(sizeof(Weak));
+    st.counters["objects"] = count;
+  }
+}
+
+template <size_t Payload>
+void register_payload(const std::vector<size_t> &counts) {
+  using RefObject = RefPayload<Payload>;
+  using PackedCnt = RefCntImpl<IObject, 1>;
+  using PackedObject = RefPayload<Payload, PackedCnt>;
+  using StrongCnt = StrongRefCntImpl<IObject>;
+  using StrongObject = RefPayload<Payload, StrongCnt>;
+  using SharedObject = SharedPayload<Payload>;
+  const auto add = [](const std::string &name, auto fn) {
+    benchmark::RegisterBenchmark(name.c_str(), fn)
+        ->Iterations(1)
+        ->Unit(benchmark::kMillisecond);
+  };
+
+  for (auto n : counts) {
+    for (int weak : {0, 50, 100}) {
+      const auto suffix = "/payload:" + std::to_string(Payload) +
+                          "/weak:" + std::to_string(weak) +
+                          "/objects:" + std::to_string(n);
+      add(
+          "ref_ptr/alloc:new" + suffix,
+          [=](benchmark::State &st) {
+            run<ref_ptr<RefObject>, obs_ptr<RefObject>>(
+                st, n, weak,
+                [] {
+                  return make_ref_ptr<RefObject, IObject, AllocImpl>(nullptr);
+                },
+                sizeof(RefObject), sizeof(RefCntImpl<IObject>));
+          });
+      add(
+          "ref_ptr/alloc:malloc" + suffix,
+          [=](benchmark::State &st) {
+            static MallocAlloc<> alloc;
+            run<ref_ptr<RefObject>, obs_ptr<RefObject>>(
+                st, n, weak,
+                [] {
+                  return make_ref_ptr<RefObject, IObject, MallocAlloc<>>(
+                      &alloc);
+                },
+                sizeof(RefObject), sizeof(RefCntImpl<IObject>));
+          });
+      if (weak == 0)
+        add("ref_ptr_strong/alloc:new" + suffix, [=](benchmark::State &st) {
+          run<ref_ptr<StrongObject>, ref_ptr<StrongObject>>(
+              st, n, weak,
+              [] {
+                return make_ref_ptr<StrongObject, IObject, AllocImpl,
+                                    StrongCnt>(nullptr);
+              },
+              sizeof(StrongObject), sizeof(StrongCnt));
+        });
+      add(
+          "ref_ptr/alloc:pool" + suffix,
+          [=](benchmark::State &st) {
+            static PoolAlloc pool;
+            run<ref_ptr<RefObject>, obs_ptr<RefObject>>(
+                st, n, weak,
+                [] {
+                  return make_ref_ptr<RefObject, IObject, PoolAlloc>(&pool);
+                },
+                sizeof(RefObject),
+                RefCntImpl<IObject>::block_size<PoolAlloc>());
+          });
+      add(
+          "ref_ptr_packed/alloc:malloc" + suffix,
+          [=](benchmark::State &st) {
+            static MallocAlloc<> alloc;
+            run<ref_ptr<PackedObject>, obs_ptr<PackedObject>>(
+                st, n, weak,
+                [] {
+                  return make_ref_ptr<PackedObject, IObject, MallocAlloc<>,
+                                      PackedCnt>(&alloc);
+                },
+                sizeof(PackedObject),
+                PackedCnt::block_size<MallocAlloc<>>());
+          });
+      add(
+          "ref_ptr_packed/alloc:pool" + suffix,
+          [=](benchmark::State &st) {
+            static PoolAlloc pool;
+            run<ref_ptr<PackedObject>, obs_ptr<PackedObject>>(
+                st, n, weak,
+                [] {
+                  return make_ref_ptr<PackedObject, IObject, PoolAlloc,
+                                      PackedCnt>(&pool);
+                },
+                sizeof(PackedObject), PackedCnt::block_size<PoolAlloc>());
+          });
+      add(
+          "ref_ptr/alloc:array" + suffix,
+          [=](benchmark::State &st) {
+            ref_array<RefObject> arr;
+            size_t next = 0;
+            run<ref_ptr<RefObject>, obs_ptr<RefObject>>(
+                st, n, weak,
+                [&] {
+                  if (next == arr.size()) {
+                    arr = make_ref_ptr_array<RefObject, IObject, AllocImpl>(
+                        nullptr, n);
+                    next = 0;
+                  }
+                  return arr.element(next++);
+                },
+                sizeof(RefObject), 0);
+          });
+      add(
+          "shared_ptr/alloc:new" + suffix,
+          [=](benchmark::State &st) {
+            run<std::shared_ptr<SharedObject>, std::weak_ptr<SharedObject>>(
+                st, n, weak, [] { return std::make_shared<SharedObject>(); },
+                sizeof(SharedObject), 0);
+          });
+      add(
+          "shared_ptr/alloc:malloc" + suffix,
+          [=](benchmark::State &st) {
+            run<std::shared_ptr<SharedObject>, std::weak_ptr<SharedObject>>(
+                st, n, weak,
+                [] {
+                  return std::allocate_shared<SharedObject>(
+                      MallocAlloc<SharedObject>());
+                },
+                sizeof(SharedObject), 0);
+          });
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  std::vector<size_t> counts = {1000000, 10000000};
+  std::vector<char *> args;
+  for (int i = 0; i < argc; i++) {
+    if (std::strncmp(argv[i], "--objects=", 10) == 0) {
+      counts.clear();
+      for (char *p = argv[i] + 10; *p;) {
+        counts.push_back(std::strtoull(p, &p, 10));
+        if (*p == ',')
+          p++;
+      }
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+
+  register_payload<8>(counts);
+  register_payload<64>(counts);
+  register_payload<256>(counts);
+
+  int n = int(args.size());
+  benchmark::Initialize(&n, args.data());
+  if (benchmark::ReportUnrecognizedArguments(n, args.data()))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
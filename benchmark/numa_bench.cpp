@@ -0,0 +1,140 @@
+#include "../example/example.h"
+#include "../include/ref_ptr_numa.h"
+#include "../utils/affinity.h"
+#include "../utils/perf_counters.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Objects made by a thread on one NUMA node and then used by a thread on
+// another: the user chases range(0) nodes linked by ref_ptr in random order,
+// copying each next pointer (a ref/deref on its control block). Nodes come
+// from
+//   local/new        - new, made by the user thread (baseline)
+//   remote/new       - new, made by the creator thread: first touch puts
+//                      them on the creator's node
+//   remote/numa      - numa_allocator(), the creating thread's node
+//   placed/numa      - numa_allocator(user node), made by the creator
+// Reported:
+//   time/node        - traversal time per node
+//   local_nodes      - fraction of objects on the user's node
+//   cycles/op and the other hardware events per node, with
+//   REF_PTR_PERF_COUNTERS set
+//
+// Needs CPUs on two NUMA nodes and reports the cases as skipped otherwise.
+// Single-node machines can fake a topology: boot with numa=fake=2 (or a VM
+// with two -numa nodes), then restrict with numactl, e.g.
+//   numactl --cpunodebind=0,1 --membind=0,1 ./numa_bench
+
+enum class Case { LOCAL_NEW, REMOTE_NEW, REMOTE_NUMA, PLACED_NUMA };
+
+class Node : public CountedAbstractObject {
+public:
+  Node(refcnt_type *cnt, int64_t value)
+      : CountedAbstractObject(cnt), value(value) {}
+  void foo() override {}
+  ref_ptr<Node> next;
+  int64_t value;
+};
+
+static int node_of_cpu(int cpu) {
+  for (const auto &c : cpu_topology()) {
+    if (c.cpu == cpu)
+      return c.node;
+  }
+  return 0;
+}
+
+static std::vector<ref_ptr<Node>> build(Case c, size_t n, int user_node) {
+  std::vector<ref_ptr<Node>> nodes;
+  nodes.reserve(n);
+  if (c == Case::LOCAL_NEW || c == Case::REMOTE_NEW) {
+    for (size_t i = 0; i < n; i++)
+      nodes.push_back(make_ref<Node>(int64_t(i)));
+  } else {
+    // The allocator may go away first: blocks and objects are freed through
+    // numa_allocator::free_type.
+    numa_allocator alloc(c == Case::PLACED_NUMA ? user_node : -1);
+    for (size_t i = 0; i < n; i++)
+      nodes.push_back(make_ref_ptr<Node, IObject, numa_allocator>(
+          &alloc, int64_t(i)));
+  }
+  return nodes;
+}
+
+static void BM_Numa(benchmark::State &st, Case c) {
+  const auto placement = place_threads(Affinity::CROSS_NODE, 2);
+  if (!placement) {
+    st.SkipWithError("needs CPUs on two NUMA nodes");
+    return;
+  }
+  const int creator = (*placement)[0], user = (*placement)[1];
+  const int user_node = node_of_cpu(user);
+  const auto n = size_t(st.range(0));
+
+  cpu_set_t saved;
+  sched_getaffinity(0, sizeof(saved), &saved);
+  pin_thread(user);
+
+  std::vector<ref_ptr<Node>> nodes;
+  if (c == Case::LOCAL_NEW) {
+    nodes = build(c, n, user_node);
+  } else {
+    std::thread([&] {
+      pin_thread(creator);
+      nodes = build(c, n, user_node);
+    }).join();
+  }
+
+  std::vector<size_t> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), std::mt19937_64(42));
+  for (size_t i = 0; i + 1 < n; i++)
+    nodes[order[i]]->next = nodes[order[i + 1]];
+  const auto head = nodes[order[0]];
+
+  size_t local = 0;
+  for (size_t i = 0; i < n; i += 64)
+    local += numa_node_of(nodes[i].obj) == user_node;
+
+  PerfCounters perf;
+  perf.start();
+  for (auto _ : st) {
+    int64_t sum = 0;
+    for (auto p = head; p; p = p->next)
+      sum += p->value;
+    benchmark::DoNotOptimize(sum);
+  }
+  perf.stop();
+
+  const double visited = double(st.iterations()) * double(n);
+  perf.report(st, visited);
+  st.counters["time/node"] = benchmark::Counter(
+      visited, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+  st.counters["local_nodes"] = double(local) / double((n + 63) / 64);
+  st.SetItemsProcessed(int64_t(visited));
+
+  // Unlink first: dropping the head would free the chain recursively.
+  for (auto &node : nodes)
+    node->next = nullptr;
+  sched_setaffinity(0, sizeof(saved), &saved);
+}
+
+#define NUMA_BENCHMARK(c, label)                                               \
+  BENCHMARK_CAPTURE(BM_Numa, c, Case::c)                                       \
+      ->Name(label)                                                            \
+      ->Unit(benchmark::kMillisecond)                                          \
+      ->RangeMultiplier(8)                                                     \
+      ->Range(1 << 16, 1 << 22)
+
+NUMA_BENCHMARK(LOCAL_NEW, "local/new");
+NUMA_BENCHMARK(REMOTE_NEW, "remote/new");
+NUMA_BENCHMARK(REMOTE_NUMA, "remote/numa");
+NUMA_BENCHMARK(PLACED_NUMA, "placed/numa");
+
+BENCHMARK_MAIN();
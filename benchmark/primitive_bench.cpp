@@ -0,0 +1,562 @@
+#include "../example/example.h"
+#include "../include/ref_ptr_once.h"
+#include "../include/ref_ptr_shared.h"
+#include "../utils/perf_counters.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Single-threaded cost of every ref_ptr/obs_ptr primitive, side by side with
+// shared_ptr/weak_ptr and a raw pointer baseline, of the strong primitives
+// of ref_ptr without weak support (ref_ptr_strong) and of lookups of a lazily
+// built instance (BM_Lazy). Each iteration applies the operation to BATCH
+// slots; setup and cleanup run with the timer paused.
+// Reported counters:
+//   time/op   - wall time per operation
+//   allocs/op - heap allocations per operation
+//   <event>/op, ipc - hardware counters, with REF_PTR_PERF_COUNTERS set
+
+static bool g_count_allocs = false;
+static size_t g_allocs = 0;
+
+void *operator new(size_t size) {
+  g_allocs += g_count_allocs;
+  if (auto p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void *operator new[](size_t size) { return ::operator new(size); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+
+// RefCntImpl is over-aligned and goes through these.
+void *operator new(size_t size, std::align_val_t al) {
+  g_allocs += g_count_allocs;
+  const auto align = static_cast<size_t>(al);
+  if (auto p = std::aligned_alloc(align, (size + align - 1) / align * align))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+constexpr size_t BATCH = 1024;
+
+struct SharedBase {
+  virtual void foo() = 0;
+  virtual ~SharedBase() = default;
+};
+
+struct SharedDerived : SharedBase {
+  void foo() override {}
+};
+
+struct RefPolicy {
+  using Strong = ref_ptr<DerivedObject>;
+  using BaseStrong = ref_ptr<CountedAbstractObject>;
+  using Weak = obs_ptr<DerivedObject>;
+  static Strong make() { return make_ref<DerivedObject>(); }
+  static Weak observe(const Strong &p) { return Weak(p); }
+  static Strong lock(const Weak &w) { return w.lock(); }
+  static bool expired(const Weak &w) { return w.expired(); }
+  static void drop(Strong &p) { p.reset(); }
+  static void destroy(Strong &p) { p.reset(); }
+  static Strong downcast(const BaseStrong &p) {
+    return static_ref_cast<DerivedObject>(p);
+  }
+  static Strong downcast(BaseStrong &&p) {
+    return static_ref_cast<DerivedObject>(std::move(p));
+  }
+};
+
+struct SharedPolicy {
+  using Strong = std::shared_ptr<SharedDerived>;
+  using BaseStrong = std::shared_ptr<SharedBase>;
+  using Weak = std::weak_ptr<SharedDerived>;
+  static Strong make() { return std::make_shared<SharedDerived>(); }
+  static Weak observe(const Strong &p) { return Weak(p); }
+  static Strong lock(const Weak &w) { return w.lock(); }
+  static bool expired(const Weak &w) { return w.expired(); }
+  static void drop(Strong &p) { p.reset(); }
+  static void destroy(Strong &p) { p.reset(); }
+  static Strong downcast(const BaseStrong &p) {
+    return std::static_pointer_cast<SharedDerived>(p);
+  }
+  static Strong downcast(BaseStrong &&p) {
+    return std::static_pointer_cast<SharedDerived>(std::move(p));
+  }
+};
+
+// Without weak references (StrongRefCntImpl): the last deref is one
+// decrement and one call that destroys the object and frees the block.
+class StrongObject
+    : public RefCountedObject<IObject, StrongRefCntImpl<IObject>> {
+public:
+  StrongObject(refcnt_type *cnt) : RefCountedObject(cnt) {}
+  void foo() override {}
+};
+
+struct StrongPolicy {
+  using Strong = ref_ptr<StrongObject>;
+  static Strong make() {
+    return make_ref_ptr<StrongObject, IObject, AllocImpl,
+                        StrongRefCntImpl<IObject>>(nullptr);
+  }
+  static void drop(Strong &p) { p.reset(); }
+  static void destroy(Strong &p) { p.reset(); }
+};
+
+// No ownership at all: copies are pointer copies, destroy is a delete.
+struct RawPolicy {
+  using Strong = SharedDerived *;
+  using BaseStrong = SharedBase *;
+  using Weak = SharedDerived *;
+  static Strong make() { return new SharedDerived(); }
+  static Weak observe(const Strong &p) { return p; }
+  static Strong lock(const Weak &w) { return w; }
+  static bool expired(const Weak &w) { return w == nullptr; }
+  static void drop(Strong &p) { p = nullptr; }
+  static void destroy(Strong &p) {
+    delete p;
+    p = nullptr;
+  }
+  static Strong downcast(BaseStrong p) { return static_cast<Strong>(p); }
+};
+
+// Counts allocations and hardware events only while the timer runs. The
+// timer is running when each iteration starts, so every pause() must be
+// followed by a resume().
+struct Measure {
+  benchmark::State &st;
+  PerfCounters perf;
+
+  explicit Measure(benchmark::State &st) : st(st) {
+    g_allocs = 0;
+    g_count_allocs = true;
+    perf.start();
+  }
+
+  void pause() {
+    perf.stop();
+    g_count_allocs = false;
+    st.PauseTiming();
+  }
+
+  void resume() {
+    st.ResumeTiming();
+    g_count_allocs = true;
+    perf.start();
+  }
+
+  ~Measure() {
+    perf.stop();
+    g_count_allocs = false;
+    const double ops = double(st.iterations()) * BATCH;
+    perf.report(st, ops);
+    st.counters["time/op"] = benchmark::Counter(
+        ops, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+    st.counters["allocs/op"] = benchmark::Counter(g_allocs / ops);
+  }
+};
+
+template <typename P> void BM_Make(benchmark::State &st) {
+  std::vector<typename P::Strong> v(BATCH);
+  Measure m(st);
+  for (auto _ : st) {
+    for (auto &p : v)
+      p = P::make();
+    m.pause();
+    for (auto &p : v)
+      P::destroy(p);
+    m.resume();
+  }
+}
+
+template <typename P> void BM_Destroy(benchmark::State &st) {
+  std::vector<typename P::Strong> v(BATCH);
+  Measure m(st);
+  for (auto _ : st) {
+    m.pause();
+    for (auto &p : v)
+      p = P::make();
+    m.resume();
+    for (auto &p : v)
+      P::destroy(p);
+  }
+}
+
+template <typename P> void BM_Copy(benchmark::State &st) {
+  auto src = P::make();
+  std::vector<typename P::Strong> v(BATCH);
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      for (auto &p : v)
+        p = src;
+      benchmark::ClobberMemory();
+      m.pause();
+      for (auto &p : v)
+        P::drop(p);
+      m.resume();
+    }
+  }
+  P::destroy(src);
+}
+
+template <typename P> void BM_Move(benchmark::State &st) {
+  auto src = P::make();
+  std::vector<typename P::Strong> from(BATCH), to(BATCH);
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      m.pause();
+      for (auto &p : from)
+        p = src;
+      for (auto &p : to)
+        P::drop(p);
+      m.resume();
+      for (size_t i = 0; i < BATCH; i++)
+        to[i] = std::move(from[i]);
+      benchmark::ClobberMemory();
+    }
+  }
+  for (auto &p : to)
+    P::drop(p);
+  P::destroy(src);
+}
+
+// Releases a reference that is not the last one.
+template <typename P> void BM_Reset(benchmark::State &st) {
+  auto src = P::make();
+  std::vector<typename P::Strong> v(BATCH);
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      m.pause();
+      for (auto &p : v)
+        p = src;
+      m.resume();
+      for (auto &p : v)
+        P::drop(p);
+      benchmark::ClobberMemory();
+    }
+  }
+  P::destroy(src);
+}
+
+template <typename P> void BM_ObsCreate(benchmark::State &st) {
+  auto src = P::make();
+  std::vector<typename P::Weak> v(BATCH);
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      for (auto &w : v)
+        w = P::observe(src);
+      benchmark::ClobberMemory();
+      m.pause();
+      for (auto &w : v)
+        w = typename P::Weak();
+      m.resume();
+    }
+  }
+  P::destroy(src);
+}
+
+template <typename P> void BM_ObsCopy(benchmark::State &st) {
+  auto src = P::make();
+  auto obs = P::observe(src);
+  std::vector<typename P::Weak> v(BATCH);
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      for (auto &w : v)
+        w = typename P::Weak(obs);
+      benchmark::ClobberMemory();
+      m.pause();
+      for (auto &w : v)
+        w = typename P::Weak();
+      m.resume();
+    }
+  }
+  obs = typename P::Weak();
+  P::destroy(src);
+}
+
+template <typename P> void BM_ObsLock(benchmark::State &st) {
+  auto src = P::make();
+  auto obs = P::observe(src);
+  std::vector<typename P::Strong> v(BATCH);
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      for (auto &p : v)
+        p = P::lock(obs);
+      benchmark::ClobberMemory();
+      m.pause();
+      for (auto &p : v)
+        P::drop(p);
+      m.resume();
+    }
+  }
+  obs = typename P::Weak();
+  P::destroy(src);
+}
+
+template <typename P> void BM_ObsExpired(benchmark::State &st) {
+  auto src = P::make();
+  auto obs = P::observe(src);
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      for (size_t i = 0; i < BATCH; i++) {
+        benchmark::DoNotOptimize(obs);
+        benchmark::DoNotOptimize(P::expired(obs));
+      }
+    }
+  }
+  obs = typename P::Weak();
+  P::destroy(src);
+}
+
+template <typename P> void BM_ConvertCopy(benchmark::State &st) {
+  auto src = P::make();
+  std::vector<typename P::BaseStrong> v(BATCH);
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      for (auto &p : v)
+        p = src;
+      benchmark::ClobberMemory();
+      m.pause();
+      for (auto &p : v)
+        p = nullptr;
+      m.resume();
+    }
+  }
+  P::destroy(src);
+}
+
+template <typename P> void BM_ConvertMove(benchmark::State &st) {
+  auto src = P::make();
+  std::vector<typename P::Strong> from(BATCH);
+  std::vector<typename P::BaseStrong> to(BATCH);
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      m.pause();
+      for (auto &p : from)
+        p = src;
+      for (auto &p : to)
+        p = nullptr;
+      m.resume();
+      for (size_t i = 0; i < BATCH; i++)
+        to[i] = std::move(from[i]);
+      benchmark::ClobberMemory();
+    }
+  }
+  for (auto &p : to)
+    p = nullptr;
+  P::destroy(src);
+}
+
+// Downcasts from the base pointer type, of a copy and of an rvalue.
+template <typename P> void BM_DowncastCopy(benchmark::State &st) {
+  typename P::BaseStrong src = P::make();
+  std::vector<typename P::Strong> v(BATCH);
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      for (auto &p : v)
+        p = P::downcast(src);
+      benchmark::ClobberMemory();
+      m.pause();
+      for (auto &p : v)
+        p = nullptr;
+      m.resume();
+    }
+  }
+  auto last = P::downcast(std::move(src));
+  P::destroy(last);
+}
+
+template <typename P> void BM_DowncastMove(benchmark::State &st) {
+  auto src = P::make();
+  std::vector<typename P::BaseStrong> from(BATCH);
+  std::vector<typename P::Strong> to(BATCH);
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      m.pause();
+      for (auto &p : from)
+        p = src;
+      for (auto &p : to)
+        p = nullptr;
+      m.resume();
+      for (size_t i = 0; i < BATCH; i++)
+        to[i] = P::downcast(std::move(from[i]));
+      benchmark::ClobberMemory();
+    }
+  }
+  for (auto &p : to)
+    p = nullptr;
+  P::destroy(src);
+}
+
+#define PRIMITIVE_BENCHMARK(name)                                              \
+  BENCHMARK_TEMPLATE(name, RefPolicy)->Name(#name "/ref_ptr");                 \
+  BENCHMARK_TEMPLATE(name, SharedPolicy)->Name(#name "/shared_ptr");           \
+  BENCHMARK_TEMPLATE(name, RawPolicy)->Name(#name "/raw")
+
+PRIMITIVE_BENCHMARK(BM_Make);
+PRIMITIVE_BENCHMARK(BM_Destroy);
+PRIMITIVE_BENCHMARK(BM_Copy);
+PRIMITIVE_BENCHMARK(BM_Move);
+PRIMITIVE_BENCHMARK(BM_Reset);
+PRIMITIVE_BENCHMARK(BM_ObsCreate);
+PRIMITIVE_BENCHMARK(BM_ObsCopy);
+PRIMITIVE_BENCHMARK(BM_ObsLock);
+PRIMITIVE_BENCHMARK(BM_ObsExpired);
+PRIMITIVE_BENCHMARK(BM_ConvertCopy);
+PRIMITIVE_BENCHMARK(BM_ConvertMove);
+PRIMITIVE_BENCHMARK(BM_DowncastCopy);
+PRIMITIVE_BENCHMARK(BM_DowncastMove);
+
+BENCHMARK_TEMPLATE(BM_Make, StrongPolicy)->Name("BM_Make/ref_ptr_strong");
+BENCHMARK_TEMPLATE(BM_Destroy, StrongPolicy)->Name("BM_Destroy/ref_ptr_strong");
+BENCHMARK_TEMPLATE(BM_Copy, StrongPolicy)->Name("BM_Copy/ref_ptr_strong");
+BENCHMARK_TEMPLATE(BM_Reset, StrongPolicy)->Name("BM_Reset/ref_ptr_strong");
+
+// Crossing into std::shared_ptr APIs: a ref_ptr<DerivedObject> handed out
+// BATCH times as shared_ptr, and the shared_ptrs handed back.
+//   capture - shared_ptr with a no-op deleter capturing a ref_ptr copy
+//   to_shared - to_shared_ptr(): one control block, the ref moved in
+//   to_shared_cached - to_shared_ptr() on an enable_shared_from_ref object
+//                      while a shared_ptr to it is alive
+//   from_shared - from_shared_ptr() on a to_shared_ptr() result
+
+class CachedDerivedObject : public DerivedObject,
+                            public enable_shared_from_ref<CachedDerivedObject> {
+public:
+  using DerivedObject::DerivedObject;
+};
+
+struct CaptureInterop {
+  using Object = DerivedObject;
+  static std::shared_ptr<DerivedObject> to(const ref_ptr<Object> &p) {
+    return std::shared_ptr<DerivedObject>(p.get(),
+                                          [keep = p](DerivedObject *) {});
+  }
+};
+
+struct ToSharedInterop {
+  using Object = DerivedObject;
+  static std::shared_ptr<DerivedObject> to(const ref_ptr<Object> &p) {
+    return to_shared_ptr(p);
+  }
+};
+
+struct CachedInterop {
+  using Object = CachedDerivedObject;
+  static std::shared_ptr<DerivedObject> to(const ref_ptr<Object> &p) {
+    return to_shared_ptr(p);
+  }
+};
+
+template <typename I> void BM_ToShared(benchmark::State &st) {
+  auto src = make_ref<typename I::Object>();
+  // Keeps the cached control block of CachedInterop alive.
+  const auto pinned = I::to(src);
+  std::vector<std::shared_ptr<DerivedObject>> v(BATCH);
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      for (auto &p : v)
+        p = I::to(src);
+      benchmark::ClobberMemory();
+      m.pause();
+      for (auto &p : v)
+        p = nullptr;
+      m.resume();
+    }
+  }
+}
+
+void BM_FromShared(benchmark::State &st) {
+  const auto src = to_shared_ptr(make_ref<DerivedObject>());
+  std::vector<ref_ptr<DerivedObject>> v(BATCH);
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      for (auto &p : v)
+        p = from_shared_ptr(src);
+      benchmark::ClobberMemory();
+      m.pause();
+      for (auto &p : v)
+        p = nullptr;
+      m.resume();
+    }
+  }
+}
+
+BENCHMARK_TEMPLATE(BM_ToShared, CaptureInterop)->Name("BM_Interop/capture");
+BENCHMARK_TEMPLATE(BM_ToShared, ToSharedInterop)->Name("BM_Interop/to_shared");
+BENCHMARK_TEMPLATE(BM_ToShared, CachedInterop)
+    ->Name("BM_Interop/to_shared_cached");
+BENCHMARK(BM_FromShared)->Name("BM_Interop/from_shared");
+
+// Lookups of a lazily built shared instance, once built:
+//   call_once - std::call_once, then a ref_ptr copy of the instance
+//   once_ref  - once_ref::get(), a borrowed reference
+//   share     - once_ref::share(), a counted ref_ptr
+
+struct CallOnceLazy {
+  std::once_flag flag;
+  ref_ptr<DerivedObject> obj;
+  ref_ptr<DerivedObject> get() {
+    std::call_once(flag, [this] { obj = make_ref<DerivedObject>(); });
+    return obj;
+  }
+};
+
+struct OnceRefLazy {
+  once_ref<DerivedObject> once;
+  DerivedObject *get() {
+    return &once.get([] { return make_ref<DerivedObject>(); });
+  }
+};
+
+struct OnceRefShareLazy {
+  once_ref<DerivedObject> once;
+  ref_ptr<DerivedObject> get() {
+    return once.share([] { return make_ref<DerivedObject>(); });
+  }
+};
+
+template <typename L> void BM_Lazy(benchmark::State &st) {
+  L lazy;
+  lazy.get();
+  {
+    Measure m(st);
+    for (auto _ : st) {
+      for (size_t i = 0; i < BATCH; i++) {
+        auto p = lazy.get();
+        benchmark::DoNotOptimize(p);
+      }
+    }
+  }
+}
+
+BENCHMARK_TEMPLATE(BM_Lazy, CallOnceLazy)->Name("BM_Lazy/call_once");
+BENCHMARK_TEMPLATE(BM_Lazy, OnceRefLazy)->Name("BM_Lazy/once_ref");
+BENCHMARK_TEMPLATE(BM_Lazy, OnceRefShareLazy)->Name("BM_Lazy/share");
+
+BENCHMARK_MAIN();
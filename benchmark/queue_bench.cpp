@@ -0,0 +1,140 @@
+#include "../example/example.h"
+#include "../include/ref_ptr_queue.h"
+#include "../utils/perf_counters.h"
+#include "../utils/thread_pool.h"
+#include "../utils/timer.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Passing ref_ptrs between pipeline stages. range(0) producer and as many
+// consumer tasks run on thread_pool; every producer sends MESSAGES copies of
+// a handful of shared pointers and the consumers drop them.
+//   mutex_copy     - std::queue<ref_ptr> + mutex, push(p) / front() + pop():
+//                    a lock and an extra ref/deref pair per message
+//   mutex_move     - the same with std::move in and out
+//   lockfree       - ref_ptr_queue try_push/try_pop
+//   lockfree_batch - ref_ptr_queue bulk operations, BATCH at a time
+// Reported: items/s over all messages.
+
+constexpr int MESSAGES = 1 << 17;
+constexpr int OBJECTS = 8;
+constexpr size_t BATCH = 32;
+constexpr size_t CAPACITY = 1024;
+
+using Message = ref_ptr<DerivedObject>;
+
+template <bool Move> struct MutexQueue {
+  std::mutex mut;
+  std::queue<Message> queue;
+
+  size_t push(Message *msgs, size_t) {
+    std::lock_guard<std::mutex> lk(mut);
+    if constexpr (Move)
+      queue.push(std::move(msgs[0]));
+    else
+      queue.push(msgs[0]);
+    return 1;
+  }
+
+  size_t pop(Message *out, size_t) {
+    std::lock_guard<std::mutex> lk(mut);
+    if (queue.empty())
+      return 0;
+    if constexpr (Move)
+      out[0] = std::move(queue.front());
+    else
+      out[0] = queue.front();
+    queue.pop();
+    return 1;
+  }
+};
+
+template <bool Batch> struct LockFreeQueue {
+  ref_ptr_queue<DerivedObject> queue{CAPACITY};
+
+  size_t push(Message *msgs, size_t n) {
+    if constexpr (Batch)
+      return queue.try_push_bulk(msgs, n);
+    else
+      return queue.try_push(std::move(msgs[0])) ? 1 : 0;
+  }
+
+  size_t pop(Message *out, size_t n) {
+    if constexpr (Batch)
+      return queue.try_pop_bulk(out, n);
+    else
+      return queue.try_pop(out[0]) ? 1 : 0;
+  }
+};
+
+template <typename Q> void produce(Q &q, const std::vector<Message> &objs) {
+  Message batch[BATCH];
+  for (int i = 0; i < MESSAGES; i += int(BATCH)) {
+    for (size_t j = 0; j < BATCH; j++)
+      batch[j] = objs[(i + j) % OBJECTS];
+    for (size_t sent = 0; sent < BATCH;) {
+      const auto n = q.push(batch + sent, BATCH - sent);
+      sent += n;
+      if (n == 0)
+        std::this_thread::yield();
+    }
+  }
+}
+
+template <typename Q> void consume(Q &q) {
+  Message batch[BATCH];
+  for (int received = 0; received < MESSAGES;) {
+    const auto n = q.pop(batch, std::min<size_t>(BATCH, MESSAGES - received));
+    for (size_t j = 0; j < n; j++)
+      batch[j] = nullptr;
+    received += int(n);
+    if (n == 0)
+      std::this_thread::yield();
+  }
+}
+
+template <typename Q> void BM_Queue(benchmark::State &st) {
+  const int pairs = int(st.range(0));
+  std::vector<Message> objs;
+  for (int i = 0; i < OBJECTS; i++)
+    objs.push_back(make_ref<DerivedObject>());
+
+  // Opened before the pool starts its workers so that they are counted.
+  PerfCounters perf;
+  thread_pool pool(pairs * 2);
+  for (auto _ : st) {
+    Q q;
+    perf.start();
+    Timer t;
+    for (int i = 0; i < pairs; i++) {
+      pool.append_task([&] { produce(q, objs); });
+      pool.append_task([&] { consume(q); });
+    }
+    pool.wait();
+    st.SetIterationTime(t.elapse_s());
+    perf.stop();
+  }
+  const double items = double(st.iterations()) * pairs * MESSAGES;
+  st.SetItemsProcessed(int64_t(items));
+  perf.report(st, items);
+}
+
+#define QUEUE_BENCHMARK(queue, label)                                          \
+  BENCHMARK_TEMPLATE(BM_Queue, queue)                                          \
+      ->Name(label)                                                            \
+      ->UseManualTime()                                                        \
+      ->RangeMultiplier(2)                                                     \
+      ->Range(1, 4)
+
+QUEUE_BENCHMARK(MutexQueue<false>, "mutex_copy");
+QUEUE_BENCHMARK(MutexQueue<true>, "mutex_move");
+QUEUE_BENCHMARK(LockFreeQueue<false>, "lockfree");
+QUEUE_BENCHMARK(LockFreeQueue<true>, "lockfree_batch");
+
+BENCHMARK_MAIN();
@@ -0,0 +1,83 @@
+#include "../example/example.h"
+#include "../include/ref_ptr_parallel.h"
+#include "../utils/perf_counters.h"
+#include "../utils/thread_pool.h"
+#include "../utils/timer.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+// Teardown of a vector of range(0) uniquely owned objects, shuffled so that
+// consecutive elements point to unrelated memory, as in a cache evicting
+// its entries. Released by
+//   clear      - std::vector::clear, one deref() after another
+//   prefetch   - parallel_release below the grain: the calling thread only,
+//                with objects and control blocks prefetched ahead
+//   parallel   - parallel_release over a thread_pool of range(1) threads
+// Reported:
+//   time/object - release time per object
+//   destroyed   - objects reported destroyed per run (parallel_release)
+
+enum class Release { CLEAR, PREFETCH, PARALLEL };
+
+static std::vector<ref_ptr<DerivedObject>> build(size_t n) {
+  std::vector<ref_ptr<DerivedObject>> objs;
+  objs.reserve(n);
+  for (size_t i = 0; i < n; i++)
+    objs.push_back(make_ref<DerivedObject>());
+  std::shuffle(objs.begin(), objs.end(), std::mt19937_64(42));
+  return objs;
+}
+
+static void BM_Release(benchmark::State &st, Release how) {
+  const auto n = size_t(st.range(0));
+  const auto threads = size_t(st.range(1));
+  thread_pool pool(threads);
+  size_t destroyed = 0;
+  PerfCounters perf;
+  for (auto _ : st) {
+    auto objs = build(n);
+    perf.start();
+    Timer t;
+    switch (how) {
+    case Release::CLEAR:
+      objs.clear();
+      break;
+    case Release::PREFETCH:
+      destroyed = parallel_release(objs, pool, n);
+      break;
+    case Release::PARALLEL:
+      destroyed = parallel_release(objs, pool);
+      break;
+    }
+    st.SetIterationTime(t.elapse_s());
+    perf.stop();
+  }
+  const double released = double(st.iterations()) * double(n);
+  perf.report(st, released);
+  st.counters["time/object"] = benchmark::Counter(
+      released, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+  if (how != Release::CLEAR)
+    st.counters["destroyed"] = double(destroyed);
+}
+
+BENCHMARK_CAPTURE(BM_Release, clear, Release::CLEAR)
+    ->Name("clear")
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond)
+    ->ArgsProduct({{1 << 20, 1 << 22}, {1}});
+BENCHMARK_CAPTURE(BM_Release, prefetch, Release::PREFETCH)
+    ->Name("prefetch")
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond)
+    ->ArgsProduct({{1 << 20, 1 << 22}, {1}});
+BENCHMARK_CAPTURE(BM_Release, parallel, Release::PARALLEL)
+    ->Name("parallel")
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond)
+    ->ArgsProduct({{1 << 20, 1 << 22}, {1, 2, 4, 8}});
+
+BENCHMARK_MAIN();
@@ -0,0 +1,106 @@
+#include "../example/example.h"
+#include "../include/ref_ptr_slab.h"
+#include "../utils/perf_counters.h"
+#include "../utils/timer.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <numeric>
+#include <random>
+#include <vector>
+
+// Pointer chasing over range(0) nodes linked by ref_ptr, each step copying
+// the next pointer (a ref/deref on its control block). Nodes come from
+//   new    - make_ref_ptr without an allocator: new for the object and the
+//            control block
+//   malloc - objects from malloc, control blocks from new
+//   slab   - objects and control blocks from slab_allocator
+// and are linked in creation order (sequential) or in a random order
+// (shuffled), which touches a different page at nearly every step.
+// Reported:
+//   time/node       - traversal time per node
+//   build_time/node - allocation and construction time per node
+//   dtlb_misses/op and the other hardware events per node, with
+//   REF_PTR_PERF_COUNTERS set
+
+struct MallocAlloc {
+  void *alloc(size_t size) { return std::malloc(size); }
+  void dealloc(void *ptr) { std::free(ptr); }
+};
+
+class Node : public CountedAbstractObject {
+public:
+  Node(refcnt_type *cnt, int64_t value)
+      : CountedAbstractObject(cnt), value(value) {}
+  void foo() override {}
+  ref_ptr<Node> next;
+  int64_t value;
+};
+
+template <typename Alloc> Alloc *allocator() {
+  if constexpr (std::is_same_v<Alloc, AllocImpl>) {
+    return nullptr;
+  } else {
+    static Alloc alloc;
+    return &alloc;
+  }
+}
+
+template <typename Alloc, bool Shuffled>
+void BM_Traverse(benchmark::State &st) {
+  const auto n = size_t(st.range(0));
+  std::vector<ref_ptr<Node>> nodes;
+  nodes.reserve(n);
+  Timer build;
+  for (size_t i = 0; i < n; i++)
+    nodes.push_back(make_ref_ptr<Node, IObject, Alloc>(allocator<Alloc>(),
+                                                       int64_t(i)));
+  const double build_s = build.elapse_s();
+
+  std::vector<size_t> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  if (Shuffled)
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(42));
+  for (size_t i = 0; i + 1 < n; i++)
+    nodes[order[i]]->next = nodes[order[i + 1]];
+  const auto head = nodes[order[0]];
+
+  PerfCounters perf;
+  perf.start();
+  for (auto _ : st) {
+    int64_t sum = 0;
+    for (auto p = head; p; p = p->next)
+      sum += p->value;
+    benchmark::DoNotOptimize(sum);
+  }
+  perf.stop();
+
+  const double visited = double(st.iterations()) * double(n);
+  perf.report(st, visited);
+  st.counters["time/node"] = benchmark::Counter(
+      visited, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+  st.counters["build_time/node"] = build_s * 1e9 / double(n);
+  st.SetItemsProcessed(int64_t(visited));
+
+  // Unlink first: dropping the head would free the chain recursively.
+  for (auto &node : nodes)
+    node->next = nullptr;
+}
+
+#define SLAB_BENCHMARK(alloc, shuffled, label)                                 \
+  BENCHMARK_TEMPLATE(BM_Traverse, alloc, shuffled)                             \
+      ->Name(label)                                                            \
+      ->Unit(benchmark::kMillisecond)                                          \
+      ->RangeMultiplier(8)                                                     \
+      ->Range(1 << 16, 1 << 22)
+
+SLAB_BENCHMARK(AllocImpl, false, "sequential/new");
+SLAB_BENCHMARK(MallocAlloc, false, "sequential/malloc");
+SLAB_BENCHMARK(slab_allocator, false, "sequential/slab");
+SLAB_BENCHMARK(AllocImpl, true, "shuffled/new");
+SLAB_BENCHMARK(MallocAlloc, true, "shuffled/malloc");
+SLAB_BENCHMARK(slab_allocator, true, "shuffled/slab");
+
+BENCHMARK_MAIN();
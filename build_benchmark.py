@@ -83,6 +83,33 @@ def show_plot(filenames):
     plt.show()
 
 
+def show_memory_plot(filename):
+    import matplotlib.pyplot as plt
+    import json
+    with open(filename) as f:
+        bench = json.load(f)["benchmarks"]
+
+    # one line per configuration, objects on the x-axis
+    res = {}
+    for item in bench:
+        parts = [p for p in item["name"].split('/')
+                 if not p.startswith('objects:') and not p.startswith('iterations:')]
+        res.setdefault('/'.join(parts), []).append(
+            (item['objects'], item['rss/obj']))
+
+    for key, value in sorted(res.items()):
+        value.sort()
+        linestyle = '-' if key.startswith('ref_ptr') else ':'
+        plt.plot([v[0] for v in value], [v[1] for v in value], marker='+',
+                 linestyle=linestyle, label=key)
+
+    plt.xscale('log')
+    plt.xlabel('live objects')
+    plt.ylabel('RSS bytes per object (lower is better)')
+    plt.legend(fontsize='small')
+    plt.show()
+
+
 def all_result(path):
     import os
     json_files = []
@@ -103,8 +130,21 @@ if __name__ == '__main__':
         if sys.argv[1] == 'summary':
             show_plot(all_result('bench_result'))
             exit(0)
+        elif sys.argv[1] == 'memory':
+            os.system('cmake -S . -B build -DCMAKE_BUILD_TYPE=Release -DREF_PTR_BUILD_BENCHMARK=ON')
+            os.system('cmake --build build --config Release --target memory_bench')
+            output_filename = os.path.join(
+                'bench_result', '{}_memory.json'.format(platform.system()))
+            param = "--benchmark_out={} --benchmark_out_format=json".format(
+                output_filename)
+            if os.name == 'nt':
+                os.system('build\\Release\\memory_bench.exe {}'.format(param))
+            else:
+                os.system('build/memory_bench {}'.format(param))
+            show_memory_plot(output_filename)
+            exit(0)
         else:
-            print("Invalid argument: summary|show")
+            print("Invalid argument: summary|memory")
             exit(1)
 
     # cmake config and build
@@ -30,14 +30,62 @@ public:
   void foo() override { std::cout << "Foo\n"; }
 };
 
-// Optional: define helper function for allocating the object
+// Optional: define helper function for allocating the object. With more
+// than one constructor argument the allocation site is this file; the
+// overloads for none or one take their caller's location last, so that the
+// site names the caller.
 template <typename T, typename... Args> inline T *make_ptr(Args &&...args) {
   return vm_make<T, IObject, AllocImpl>(nullptr, std::forward<Args>(args)...);
 }
 
+template <typename T>
+inline T *make_ptr(std::source_location loc = std::source_location::current()) {
+  return vm_make<T, IObject, AllocImpl>(AllocSite<AllocImpl>(nullptr, loc));
+}
+
+template <typename T, typename Arg>
+inline T *make_ptr(Arg &&arg,
+                   std::source_location loc = std::source_location::current()) {
+  return vm_make<T, IObject, AllocImpl>(AllocSite<AllocImpl>(nullptr, loc),
+                                        std::forward<Arg>(arg));
+}
+
 template <typename T, typename... Args>
 inline ref_ptr<T> make_ref(Args &&...args) {
   return ref_ptr<T>(make_ptr<T>(std::forward<Args>(args)...));
 }
 
+template <typename T>
+inline ref_ptr<T>
+make_ref(std::source_location loc = std::source_location::current()) {
+  return ref_ptr<T>(make_ptr<T>(loc));
+}
+
+template <typename T, typename Arg>
+inline ref_ptr<T>
+make_ref(Arg &&arg,
+         std::source_location loc = std::source_location::current()) {
+  return ref_ptr<T>(make_ptr<T>(std::forward<Arg>(arg), loc));
+}
+
+// The element count of make_ref_array(), converted from the caller's
+// argument so that it records the caller's location ahead of the
+// constructor arguments.
+struct ArrayCount {
+  size_t n;
+  std::source_location loc;
+
+  ArrayCount(size_t n,
+             std::source_location loc = std::source_location::current())
+      : n(n), loc(loc) {}
+};
+
+template <typename T, typename... Args>
+inline ref_array<T> make_ref_array(ArrayCount count, const Args &...args) {
+  return ref_array<T>(vm_make_array<T, IObject, AllocImpl>(
+                          AllocSite<AllocImpl>(nullptr, count.loc), count.n,
+                          args...),
+                      count.n);
+}
+
 inline void example_test() { auto a = make_ptr<DerivedObject>(); }
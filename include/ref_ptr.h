@@ -1,12 +1,19 @@
 #pragma once
 #include <atomic>
 #include <cassert>
+#include <concepts>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <mutex>
 #include <new>
 #include <type_traits>
+#include <typeinfo>
+#include <utility>
 
-#define USE_VIRTUAL_GETTER
+#include "ref_ptr_alloc_site.h"
+#include "ref_ptr_contention.h"
+#include "ref_ptr_sdt.h"
 
 // #ifdef __cpp_lib_hardware_interference_size
 // using std::hardware_constructive_interference_size;
@@ -20,12 +27,22 @@
 constexpr std::size_t hardware_constructive_interference_size = 64;
 constexpr std::size_t hardware_destructive_interference_size = 64;
 
+template <typename T> inline const char *ref_type_name() {
+#if defined(__cpp_rtti) || defined(__GXX_RTTI)
+  return typeid(T).name();
+#else
+  return "";
+#endif
+}
+
 template <typename Interface> class IRefCnt {
 public:
   using object_type = Interface;
   using size_type = int;
 
   virtual size_type ref() = 0;
+  // Increments the strong count unless it already dropped to zero.
+  virtual bool try_ref() = 0;
   virtual size_type deref() = 0;
   virtual size_type ref_count() const = 0;
   virtual size_type weak_ref() = 0;
@@ -37,6 +54,81 @@ public:
 
 class IAlloc {};
 
+// An allocator that also places the control blocks of the objects it
+// allocates; vm_make() uses it for both and the block is returned through
+// dealloc_block() when the last reference of any kind goes away.
+template <typename AllocatorType>
+concept BlockAllocator = requires(AllocatorType &a, size_t n, void *p) {
+  { a.alloc_block(n, n) } -> std::convertible_to<void *>;
+} && (requires(AllocatorType &a, void *p) { a.dealloc_block(p); } ||
+      requires(AllocatorType &a, size_t n, void *p) { a.dealloc_block(p, n); });
+
+// An allocator whose instances are interchangeable, so control blocks do not
+// keep a pointer to the one that allocated.
+template <typename AllocatorType>
+concept StatelessAllocator = std::is_empty_v<AllocatorType> &&
+                             std::is_default_constructible_v<AllocatorType>;
+
+// Frees the memory of an AllocatorType allocator. An allocator whose frees
+// need no instance names a stateless AllocatorType::free_type that does
+// them; control blocks then free through that and its objects may outlive
+// the allocator.
+template <typename AllocatorType> struct allocator_free {
+  using type = AllocatorType;
+};
+template <typename AllocatorType>
+  requires requires { typename AllocatorType::free_type; }
+struct allocator_free<AllocatorType> {
+  using type = typename AllocatorType::free_type;
+  static_assert(StatelessAllocator<type>);
+};
+template <typename AllocatorType>
+using allocator_free_t = typename allocator_free<AllocatorType>::type;
+
+// What frees the memory of alloc, null when alloc is.
+template <typename AllocatorType>
+inline allocator_free_t<AllocatorType> *free_of(AllocatorType *alloc) {
+  if constexpr (std::is_same_v<allocator_free_t<AllocatorType>,
+                               AllocatorType>) {
+    return alloc;
+  } else {
+    static allocator_free_t<AllocatorType> free;
+    return alloc ? &free : nullptr;
+  }
+}
+
+// Frees size bytes at p, passing the size to allocators that also define
+// dealloc(p, size) (a pool then needs no per-allocation header or lookup).
+template <typename AllocatorType>
+inline void dealloc_sized(AllocatorType *alloc, void *p, size_t size) {
+  if constexpr (requires { alloc->dealloc(p, size); })
+    alloc->dealloc(p, size);
+  else
+    alloc->dealloc(p);
+}
+
+template <typename AllocatorType>
+inline void dealloc_block_sized(AllocatorType *alloc, void *p, size_t size) {
+  if constexpr (requires { alloc->dealloc_block(p, size); })
+    alloc->dealloc_block(p, size);
+  else
+    alloc->dealloc_block(p);
+}
+
+// Counts the watched objects that were destroyed, see
+// RefCntImpl::watch_expiry(). Reference counted because a control block may
+// report to it after its owner is gone.
+struct ExpirySink {
+  std::atomic<size_t> expired{0};
+  std::atomic<size_t> refs{1};
+
+  void retain() { refs.fetch_add(1, std::memory_order_relaxed); }
+  void release() {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      delete this;
+  }
+};
+
 class SpinLock {
 private:
   std::atomic<bool> _lock{false};
@@ -72,159 +164,420 @@ public:
   void unlock() {}
 };
 
-template <typename Interface>
-class RefCntImpl final : public IRefCnt<Interface> {
-  enum class EObjectState : uint8_t { UNINITIALIZED, ALIVE, DESTROYED };
-  class ObjectWrapperBase {
-  public:
-    using object_fptr_t = void *(*)(ObjectWrapperBase *);
+// Storage of vm_make_array(): the element count, padded to the element
+// alignment, followed by the elements.
+template <typename ObjectType> struct RefArrayStorage {
+  static_assert(alignof(ObjectType) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+  static constexpr size_t HEADER = (sizeof(size_t) + alignof(ObjectType) - 1) /
+                                   alignof(ObjectType) * alignof(ObjectType);
+
+  template <typename AllocatorType>
+  static ObjectType *allocate(AllocatorType *alloc, size_t n) {
+    const size_t bytes = HEADER + n * sizeof(ObjectType);
+    auto p = static_cast<uint8_t *>(alloc ? alloc->alloc(bytes)
+                                          : new uint8_t[bytes]);
+    *reinterpret_cast<size_t *>(p) = n;
+    return reinterpret_cast<ObjectType *>(p + HEADER);
+  }
 
-    virtual void destroy() const = 0;
+  template <typename AllocatorType>
+  static void deallocate(AllocatorType *alloc, ObjectType *first) {
+    auto p = reinterpret_cast<uint8_t *>(first) - HEADER;
+    if (alloc)
+      dealloc_sized(alloc, p, HEADER + size(first) * sizeof(ObjectType));
+    else
+      delete[] p;
+  }
 
-#ifdef USE_VIRTUAL_GETTER
-    virtual Interface *object() = 0;
-#else
-    object_fptr_t fptr_object;
-#endif
-  }; // This is used to eliminate the template parameter
-
-  template <typename ObjectType, typename Allocator>
-  class ObjectWrapper final : public ObjectWrapperBase {
-  public:
-    using object_type = ObjectType;
-    ObjectWrapper(ObjectType *obj, Allocator *allocator)
-        : _obj(obj), _alloc(allocator) {}
-    void destroy() const override final {
-      if (_alloc) {
-        _obj->~ObjectType();
-        _alloc->dealloc(_obj);
-      } else {
-        delete _obj;
-      }
-    }
+  static size_t size(const ObjectType *first) {
+    return *reinterpret_cast<const size_t *>(
+        reinterpret_cast<const uint8_t *>(first) - HEADER);
+  }
 
-#ifdef USE_VIRTUAL_GETTER
-    ObjectType *object() override final { return _obj; }
-#endif
+  template <typename AllocatorType>
+  static void destroy(AllocatorType *alloc, ObjectType *first) {
+    for (size_t i = size(first); i-- > 0;)
+      first[i].~ObjectType();
+    deallocate(alloc, first);
+  }
+};
 
-    ObjectType *const _obj = nullptr;
-    Allocator *const _alloc = nullptr;
+// Align places the strong count, the weak count and the object state on
+// separate cache lines; 1 packs them at their natural alignment. Weak = false
+// leaves out weak references, see StrongRefCntImpl. Expiry keeps the slot of
+// watch_expiry(); by default only where it fits in the padding of the weak
+// count's line, as a packed block would grow by a pointer.
+template <typename Interface,
+          size_t Align = hardware_destructive_interference_size,
+          bool Weak = true,
+          bool Expiry = Weak && (Align > alignof(void *))>
+class RefCntImpl final : public IRefCnt<Interface> {
+  static_assert(Weak || !Expiry, "expiry is watched through a weak reference");
+
+  enum class EObjectState : uint8_t { UNINITIALIZED, ALIVE, DESTROYED };
 
-  private:
+  // What the manager of a block does: destroy the object, free the block,
+  // both, or name the object type for the profiler.
+  enum class Op { DESTROY, RELEASE, DISPOSE, TYPE_NAME };
+  using manager_type = const void *(*)(RefCntImpl *block, Op op);
+
+  // The allocator pointer is kept only for allocators whose frees need
+  // their state (see allocator_free). In the
+  // padded layout it takes padding in front of _object_state; in the packed
+  // one it trails the block, which is then block_size() bytes.
+  static constexpr bool INLINE_ALLOCATOR = Align > alignof(void *);
+  struct NoAllocator {};
+  using allocator_slot =
+      std::conditional_t<INLINE_ALLOCATOR, void *, NoAllocator>;
+
+  template <typename AllocatorType>
+  static constexpr bool stores_allocator =
+      !StatelessAllocator<allocator_free_t<AllocatorType>> &&
+      !INLINE_ALLOCATOR;
+
+  // Stands in for the members left out, taking no space.
+  template <int> struct NoWeak {
+    template <typename... Args> constexpr NoWeak(Args &&...) {}
   };
+  template <typename T, int I>
+  using weak_member = std::conditional_t<Weak, T, NoWeak<I>>;
 
 public:
-  template <typename WrapperType>
-  static typename WrapperType::object_type *f_object(WrapperType *ctx) {
-    return (typename WrapperType::object_type *)ctx->_obj;
-  };
+  static constexpr bool WEAK = Weak;
+  static constexpr bool EXPIRY = Expiry;
+
+  // Bytes of a block for the objects of an AllocatorType allocator.
+  template <typename AllocatorType> static constexpr size_t block_size() {
+    return sizeof(RefCntImpl) +
+           (stores_allocator<AllocatorType> ? sizeof(void *) : 0);
+  }
+
+  // A block for the objects of alloc, from alloc when it places blocks.
+  template <typename AllocatorType>
+  static RefCntImpl *make_block(AllocatorType *alloc) {
+    constexpr size_t size = block_size<AllocatorType>();
+    constexpr auto align = std::align_val_t(alignof(RefCntImpl));
+    if (alloc) {
+      if constexpr (BlockAllocator<AllocatorType>)
+        return new (alloc->alloc_block(size, alignof(RefCntImpl)))
+            RefCntImpl();
+      else if constexpr (size > sizeof(RefCntImpl))
+        return new (::operator new(size, align)) RefCntImpl();
+    }
+    return new RefCntImpl();
+  }
+
+  // free is free_of() the allocator that made the block.
+  template <typename AllocatorType>
+  static void free_block(allocator_free_t<AllocatorType> *free,
+                         RefCntImpl *block) {
+    constexpr size_t size = block_size<AllocatorType>();
+    constexpr auto align = std::align_val_t(alignof(RefCntImpl));
+    if (free) {
+      if constexpr (BlockAllocator<AllocatorType>) {
+        block->~RefCntImpl();
+        dealloc_block_sized(free, block, size);
+        return;
+      } else if constexpr (size > sizeof(RefCntImpl)) {
+        block->~RefCntImpl();
+        ::operator delete(block, size, align);
+        return;
+      }
+    }
+    delete block;
+  }
 
   using base_type = IRefCnt<Interface>;
   using size_type = typename IRefCnt<Interface>::size_type;
-  template <typename ManagedObjectType, typename AllocatorType>
+  // Sampled objects get a manager that unregisters them from the
+  // AllocSiteRegistry when destroyed.
+  template <bool Sampled = false, typename ManagedObjectType,
+            typename AllocatorType>
   void init(AllocatorType *allocator, ManagedObjectType *obj) {
+    install<ManagedObjectType, AllocatorType, false, Sampled>(allocator, obj);
+  }
 
-    using wrapper_type = ObjectWrapper<ManagedObjectType, AllocatorType>;
-    new (_object_buf) wrapper_type(obj, allocator);
-    _object_state = EObjectState::ALIVE;
-
-#ifndef USE_VIRTUAL_GETTER
-    auto objWrapper = reinterpret_cast<ObjectWrapperBase *>(_object_buf);
-    // replace virtual function by function pointer
-    objWrapper->fptr_object =
-        typename ObjectWrapperBase::object_fptr_t(f_object<wrapper_type>);
-#endif
+  // The block manages the array of vm_make_array() starting at first.
+  template <bool Sampled = false, typename ManagedObjectType,
+            typename AllocatorType>
+  void init_array(AllocatorType *allocator, ManagedObjectType *first) {
+    install<ManagedObjectType, AllocatorType, true, Sampled>(allocator,
+                                                             first);
   }
 
-  template <typename ManagedObjectType, typename AllocatorType>
-  RefCntImpl(AllocatorType *allocator, ManagedObjectType *obj) {
+private:
+  template <typename ObjectType, typename AllocatorType, bool Array,
+            bool Sampled>
+  void install(AllocatorType *allocator, ObjectType *obj) {
+    _obj = obj;
+    if (allocator) {
+      _manage = manage<ObjectType, AllocatorType, Array, Sampled, true>;
+      if constexpr (!StatelessAllocator<allocator_free_t<AllocatorType>>)
+        allocator_ptr() = allocator;
+    } else {
+      _manage = manage<ObjectType, AllocatorType, Array, Sampled, false>;
+    }
+    if constexpr (Weak)
+      _object_state = EObjectState::ALIVE;
+  }
 
-    using wrapper_type = ObjectWrapper<ManagedObjectType, AllocatorType>;
-    new (_object_buf) wrapper_type(obj, allocator);
-    _object_state = EObjectState::ALIVE;
+  void *&allocator_ptr() {
+    if constexpr (INLINE_ALLOCATOR)
+      return _allocator;
+    else
+      return *reinterpret_cast<void **>(this + 1);
+  }
 
-#ifndef USE_VIRTUAL_GETTER
-    auto objWrapper = reinterpret_cast<ObjectWrapperBase *>(_object_buf);
-    // replace virtual function by function pointer
-    objWrapper->fptr_object =
-        typename ObjectWrapperBase::object_fptr_t(f_object<wrapper_type>);
+  // One instantiation per object type, allocator and way of allocating; the
+  // block keeps a pointer to it instead of a vtable'd wrapper.
+  template <typename ObjectType, typename AllocatorType, bool Array,
+            bool Sampled, bool Allocated>
+  static const void *manage(RefCntImpl *block, Op op) {
+    using Free = allocator_free_t<AllocatorType>;
+    [[maybe_unused]] std::conditional_t<StatelessAllocator<Free>, Free,
+                                        NoAllocator>
+        stateless;
+    Free *alloc = nullptr;
+    if constexpr (Allocated && StatelessAllocator<Free>)
+      alloc = &stateless;
+    else if constexpr (Allocated)
+      alloc = static_cast<AllocatorType *>(block->allocator_ptr());
+
+    switch (op) {
+    case Op::DESTROY:
+    case Op::DISPOSE: {
+      auto obj = static_cast<ObjectType *>(block->_obj);
+      REF_PTR_PROBE2(destroy, obj, ref_type_name<ObjectType>());
+#ifdef REF_PTR_ALLOC_SAMPLING
+      if constexpr (Sampled)
+        AllocSiteRegistry::instance().remove(obj);
 #endif
+      if constexpr (Array) {
+        RefArrayStorage<ObjectType>::destroy(alloc, obj);
+      } else if constexpr (Allocated) {
+        obj->~ObjectType();
+        dealloc_sized(alloc, obj, sizeof(ObjectType));
+      } else {
+        // What `delete obj` does, without the warning about deleting a
+        // polymorphic type with a non-virtual destructor: the type is exact.
+        obj->~ObjectType();
+        if constexpr (requires { ObjectType::operator delete(obj); })
+          ObjectType::operator delete(obj);
+        else
+          ::operator delete(obj);
+      }
+      if (op == Op::DESTROY)
+        return nullptr;
+      [[fallthrough]];
+    }
+    case Op::RELEASE:
+      free_block<AllocatorType>(alloc, block);
+      return nullptr;
+    case Op::TYPE_NAME:
+      return ref_type_name<ObjectType>();
+    }
+    return nullptr;
+  }
+
+public:
+  RefCntImpl() = default;
+
+  // Sets the counts of a block whose references were made without ref() and
+  // weak_ref(), e.g. by a snapshot loader. Before the block is shared.
+  void preset(size_type strong, size_type weak) {
+    _cnt.store(strong, std::memory_order_relaxed);
+    if constexpr (Weak)
+      _weak_cnt.store(weak + (strong > 0 ? 1 : 0), std::memory_order_relaxed);
+    else
+      assert(weak == 0);
   }
 
-  size_type ref() override final { return _cnt++; }
+  size_type ref() override final { return REF_PTR_PROFILE_RMW(REF, _cnt++); }
+
+  bool try_ref() override final {
+    return REF_PTR_PROFILE_RMW(LOCK, increment_if_nonzero()) != 0;
+  }
 
   size_type deref() override final {
-    auto cnt = --_cnt;
-    if (cnt == 0) {
-      // 1. delete managed object
+    auto cnt = REF_PTR_PROFILE_RMW(DEREF, --_cnt);
+    if (cnt == 0)
+      on_zero();
+    return cnt;
+  }
 
-      std::unique_lock<Lock> lk(_mtx);
-      auto objWrapper = reinterpret_cast<ObjectWrapperBase *>(_object_buf);
-      _object_state = EObjectState::DESTROYED;
-      auto deleteSelf = _weak_cnt.load() == 0;
-      lk.unlock();
-      objWrapper->destroy();
-      if (deleteSelf)
-        destroy();
-    }
+  // n references at once, for deferred counting (ref_ptr_deferred.h).
+  size_type add_ref(size_type n) {
+    return REF_PTR_PROFILE_RMW(REF, _cnt.fetch_add(n) + n);
+  }
+  size_type release(size_type n) {
+    auto cnt = REF_PTR_PROFILE_RMW(DEREF, _cnt.fetch_sub(n) - n);
+    if (cnt == 0)
+      on_zero();
     return cnt;
   }
+
   size_type ref_count() const override final { return _cnt; }
-  size_type weak_ref() override final { return ++_weak_cnt; }
+
+  // Unreachable without weak support: obs_ptr does not compile then.
+  size_type weak_ref() override final {
+    if constexpr (!Weak) {
+      assert(!"weak reference to a StrongRefCntImpl object");
+      return 0;
+    } else {
+      return REF_PTR_PROFILE_RMW(WEAK_REF, ++_weak_cnt) - strong_share();
+    }
+  }
   size_type weak_deref() override final {
-    auto cnt = --_weak_cnt;
-    std::unique_lock<Lock> lk(_mtx);
-    if (cnt == 0 && _object_state == EObjectState::DESTROYED) {
-      lk.unlock();
-      destroy();
+    if constexpr (!Weak) {
+      assert(!"weak reference to a StrongRefCntImpl object");
+      return 0;
+    } else {
+      auto cnt = REF_PTR_PROFILE_RMW(WEAK_DEREF, --_weak_cnt);
+      if (cnt == 0) {
+        destroy();
+        return 0;
+      }
+      return cnt - strong_share();
     }
-    return cnt;
   }
-  size_type weak_ref_count() const override final { return _weak_cnt; }
+  size_type weak_ref_count() const override final {
+    if constexpr (!Weak)
+      return 0;
+    else
+      return _weak_cnt - strong_share();
+  }
+
+  // True when the caller's strong reference is the only strong one. Weak
+  // references may still exist and lock the object later. The acquire load
+  // pairs with the release in other owners' deref(): their last accesses to
+  // the object happen before the caller's writes.
+  bool unique() const { return _cnt.load(std::memory_order_acquire) == 1; }
+
+  // Lets one holder of a weak reference learn about the destruction of the
+  // object: the sink's `expired` is incremented once and the sink released.
+  // Fails when another sink watches already. The watcher must call
+  // unwatch_expiry() before dropping its weak reference; when that fails the
+  // object was destroyed and the sink released.
+  bool watch_expiry(ExpirySink *sink) {
+    static_assert(Expiry, "the block has no expiry watcher");
+    ExpirySink *expected = nullptr;
+    return _expiry.compare_exchange_strong(expected, sink,
+                                           std::memory_order_acq_rel);
+  }
+  bool unwatch_expiry(ExpirySink *sink) {
+    static_assert(Expiry, "the block has no expiry watcher");
+    return _expiry.compare_exchange_strong(sink, nullptr,
+                                           std::memory_order_acq_rel);
+  }
 
   typename IRefCnt<Interface>::object_type *object() override final {
-    if (_object_state != EObjectState::ALIVE)
-      return nullptr;
-    std::unique_lock<Lock> lk(_mtx);
-    auto cnt = ++_cnt;
-    if (_object_state == EObjectState::ALIVE && cnt > 1) {
-      lk.unlock();
-      const auto objectWrapper =
-          reinterpret_cast<ObjectWrapperBase *>(_object_buf);
-#ifdef USE_VIRTUAL_GETTER
-      return objectWrapper->object();
-#else
-      return (typename IRefCnt<Interface>::object_type
-                  *)(objectWrapper->fptr_object(objectWrapper));
-#endif
+    if constexpr (Weak) {
+      if (_object_state != EObjectState::ALIVE) {
+        REF_PTR_PROBE1(lock_fail, this);
+        return nullptr;
+      }
     }
-    --_cnt;
+    // Increment-if-nonzero: a count that reached zero never comes back.
+    auto cnt = REF_PTR_PROFILE_RMW(LOCK, increment_if_nonzero());
+    if (cnt > 0)
+      return _obj;
+    REF_PTR_PROBE1(lock_fail, this);
     return nullptr;
   }
 
+  // The object object() locks, without locking it; null before init.
+  const Interface *owned_object() const { return _obj; }
+
+  // Prefetches the lines object() touches, for batch locks
+  // (ref_ptr_batch.h).
+  void prefetch_lock() const {
+    __builtin_prefetch(&_cnt, 1);
+    __builtin_prefetch(&_obj, 0);
+    if constexpr (Weak)
+      __builtin_prefetch(&_object_state, 0);
+  }
+
+#ifdef REF_PTR_CONTENTION_PROFILING
+  const void *profiled_object() const { return _obj; }
+  const char *profiled_type_name() const {
+    return static_cast<const char *>(
+        _manage(const_cast<RefCntImpl *>(this), Op::TYPE_NAME));
+  }
+#endif
+
 private:
-  void destroy() {
-    delete this;
+  // The strong references hold one weak reference together until the object
+  // is destroyed; whoever drops the weak count to zero frees the block.
+  size_type strong_share() const { return _cnt > 0 ? 1 : 0; }
+
+  // The last strong reference is gone.
+  void on_zero() {
+    if constexpr (!Weak) {
+      // No weak references can be left.
+      REF_PTR_PROBE2(zero, this, size_type(0));
+      destroy(Op::DISPOSE);
+    } else {
+      // 1. delete managed object
+      _object_state = EObjectState::DESTROYED;
+      const auto weakCnt = _weak_cnt.load() - 1;
+      REF_PTR_PROBE2(zero, this, weakCnt);
+      _manage(this, Op::DESTROY);
+      // A watcher holds a weak reference, so there is none when weakCnt is 0.
+      if constexpr (Expiry) {
+        if (weakCnt) {
+          if (auto sink =
+                  _expiry.exchange(nullptr, std::memory_order_acq_rel)) {
+            sink->expired.fetch_add(1, std::memory_order_relaxed);
+            sink->release();
+          }
+        }
+      }
+      // 2. drop the weak reference the strong ones held together
+      if (--_weak_cnt == 0)
+        destroy();
+    }
+  }
+
+  size_type increment_if_nonzero() {
+    auto cnt = _cnt.load(std::memory_order_relaxed);
+    do {
+      if (cnt <= 0)
+        return 0;
+    } while (!_cnt.compare_exchange_weak(cnt, cnt + 1,
+                                         std::memory_order_acquire,
+                                         std::memory_order_relaxed));
+    return cnt + 1;
+  }
+
+  // Frees the block; DISPOSE destroys the object first.
+  void destroy(Op op = Op::RELEASE) {
+    REF_PTR_PROBE1(release, this);
+#ifdef REF_PTR_CONTENTION_PROFILING
+    ContentionProfiler::instance().forget(this);
+#endif
+    _manage(this, op);
     static_assert(sizeof(std::atomic_int) == sizeof(int));
   }
 
   // std::atomic_size_t _cnt = {1};
   // std::atomic_size_t _weak_cnt = {0};
 
-  alignas(hardware_destructive_interference_size)
-      std::atomic<typename base_type::size_type> _cnt = {1};
-  alignas(hardware_destructive_interference_size)
-      std::atomic<typename base_type::size_type> _weak_cnt = {0};
+  using counter_type = std::atomic<typename base_type::size_type>;
+  using state_type = std::atomic<EObjectState>;
+  alignas(Align) alignas(counter_type) counter_type _cnt = {1};
+  [[no_unique_address]] alignas(Weak ? Align : 1) alignas(counter_type)
+      weak_member<counter_type, 0> _weak_cnt = {1};
 
-  static size_t constexpr BUFSIZE =
-      sizeof(ObjectWrapper<Interface, IAlloc>) / sizeof(size_t);
-  ;
-  size_t _object_buf[BUFSIZE];
+  manager_type _manage{nullptr};
+  Interface *_obj{nullptr};
+  [[no_unique_address]] std::conditional_t<Expiry, std::atomic<ExpirySink *>,
+                                           NoWeak<1>> _expiry{nullptr};
 
   using Lock = EmptyLock;
-  Lock _mtx;
-  alignas(hardware_destructive_interference_size)
-      std::atomic<EObjectState> _object_state;
+  [[no_unique_address]] Lock _mtx;
+  [[no_unique_address]] allocator_slot _allocator;
+  [[no_unique_address]] alignas(Weak ? Align : 1) alignas(state_type)
+      weak_member<state_type, 2> _object_state;
 
   // EObjectState _object_state{EObjectState::UNINITIALIZED};
 
@@ -234,6 +587,14 @@ private:
   // using Lock = SpinLock;
 };
 
+// A control block without weak references. The weak count, the object state
+// and the expiry watcher are left out, the last deref() destroys the object
+// and frees the block through one call, and naming obs_ptr<T> for an object
+// using it does not compile.
+template <typename Interface,
+          size_t Align = hardware_destructive_interference_size>
+using StrongRefCntImpl = RefCntImpl<Interface, Align, false>;
+
 template <typename T, typename RefCntType = RefCntImpl<T>>
 class RefCountedObject : public T {
 public:
@@ -252,8 +613,14 @@ public:
   size_type ref() { return this->_ref_cnt->ref(); };
   size_type deref() { return this->_ref_cnt->deref(); }
   size_type ref_count() const { return this->_ref_cnt->ref_count(); }
-  size_type weak_ref() { return this->_ref_cnt->weak_ref(); }
-  size_type weak_deref() { return this->_ref_cnt->weak_deref(); }
+  size_type weak_ref() {
+    static_assert(RefCntType::WEAK, "weak references are disabled");
+    return this->_ref_cnt->weak_ref();
+  }
+  size_type weak_deref() {
+    static_assert(RefCntType::WEAK, "weak references are disabled");
+    return this->_ref_cnt->weak_deref();
+  }
   size_type weak_ref_count() const { return this->_ref_cnt->weak_ref_count(); }
 
   refcnt_type *cnt() const { return _ref_cnt; }
@@ -424,7 +791,60 @@ inline bool operator!=(const T *lhs, const ref_ptr<T> &rhs) {
   return !(lhs == rhs);
 } // T* != ref_ptr
 
+// Casts. A cast of an lvalue takes one reference; a cast of an rvalue hands
+// the reference over and leaves the count alone. dynamic_ref_cast leaves an
+// rvalue it cannot convert untouched.
+template <typename T, typename U>
+inline ref_ptr<T> static_ref_cast(const ref_ptr<U> &r) noexcept {
+  auto obj = static_cast<T *>(r.get());
+  if (obj)
+    obj->cnt()->ref();
+  return ref_ptr<T>(obj);
+}
+
+template <typename T, typename U>
+inline ref_ptr<T> static_ref_cast(ref_ptr<U> &&r) noexcept {
+  auto obj = static_cast<T *>(r.obj);
+  r.obj = nullptr;
+  return ref_ptr<T>(obj);
+}
+
+template <typename T, typename U>
+inline ref_ptr<T> dynamic_ref_cast(const ref_ptr<U> &r) noexcept {
+  auto obj = dynamic_cast<T *>(r.get());
+  if (obj)
+    obj->cnt()->ref();
+  return ref_ptr<T>(obj);
+}
+
+template <typename T, typename U>
+inline ref_ptr<T> dynamic_ref_cast(ref_ptr<U> &&r) noexcept {
+  auto obj = dynamic_cast<T *>(r.obj);
+  if (obj)
+    r.obj = nullptr;
+  return ref_ptr<T>(obj);
+}
+
+template <typename T, typename U>
+inline ref_ptr<T> const_ref_cast(const ref_ptr<U> &r) noexcept {
+  auto obj = const_cast<T *>(r.get());
+  if (obj)
+    obj->cnt()->ref();
+  return ref_ptr<T>(obj);
+}
+
+template <typename T, typename U>
+inline ref_ptr<T> const_ref_cast(ref_ptr<U> &&r) noexcept {
+  auto obj = const_cast<T *>(r.obj);
+  r.obj = nullptr;
+  return ref_ptr<T>(obj);
+}
+
 template <typename T> class obs_ptr {
+  static_assert(T::refcnt_type::WEAK,
+                "obs_ptr to an object whose control block has no weak "
+                "references (StrongRefCntImpl)");
+
 public:
   typename T::refcnt_type *cnt{nullptr};
   using element_type = T;
@@ -434,6 +854,7 @@ public:
   template <typename U> obs_ptr(const ref_ptr<U> &ref) noexcept {
     if (ref.obj) {
       cnt = ref.obj->cnt();
+      check_owned(ref.obj);
       cnt->weak_ref();
     }
   }
@@ -441,6 +862,7 @@ public:
   template <typename U> obs_ptr(U *ptr) noexcept {
     if (ptr) {
       cnt = ptr->cnt();
+      check_owned(ptr);
       cnt->weak_ref();
     }
   }
@@ -506,6 +928,24 @@ public:
   }
 
   ~obs_ptr() { reset(); }
+
+private:
+  // lock() returns the object the block owns, so only that one can be
+  // observed: not an element of a vm_make_array() array but the first. An
+  // observer of another element would lock a different object, so its
+  // construction aborts in every build.
+  template <typename U> void check_owned(U *ptr) const noexcept {
+    using object_type = typename T::refcnt_type::object_type;
+    auto owned = cnt->owned_object();
+    if (owned && owned != static_cast<const object_type *>(ptr)) {
+      std::fprintf(stderr,
+                   "obs_ptr: %p is not the object its block owns (%p), "
+                   "only the first element of an array can be observed\n",
+                   static_cast<const void *>(ptr),
+                   static_cast<const void *>(owned));
+      std::abort();
+    }
+  }
 };
 
 template <typename T>
@@ -516,22 +956,246 @@ ref_ptr<T>::ref_ptr(const obs_ptr<U> &r) {
 
 template <typename ObjectType, typename Interface, typename AllocatorType,
           typename RefCounterType = RefCntImpl<Interface>, typename... Args>
-inline ObjectType *vm_make(AllocatorType *alloc, Args &&...args) {
-  auto refcnt = new RefCounterType();
+inline ObjectType *vm_make(AllocSite<AllocatorType> site, Args &&...args) {
+  auto alloc = site.alloc;
+  auto refcnt = RefCounterType::make_block(alloc);
   ObjectType *obj = nullptr;
   if (alloc) {
-    obj = new (*alloc, 0, 0, 0) ObjectType(refcnt, std::forward<Args>(args)...);
+    obj = new (*alloc, ref_type_name<ObjectType>(), site.loc.file_name(),
+               site.loc.line()) ObjectType(refcnt, std::forward<Args>(args)...);
   } else {
     obj = new ObjectType(refcnt, std::forward<Args>(args)...);
   }
-  refcnt->init(alloc, obj);
+#ifdef REF_PTR_ALLOC_SAMPLING
+  if (AllocSiteRegistry::should_sample()) {
+    AllocSiteRegistry::instance().add(
+        obj, site.loc, ref_type_name<ObjectType>(),
+        sizeof(ObjectType) + sizeof(RefCounterType));
+    refcnt->template init<true>(alloc, obj);
+  } else
+#endif
+    refcnt->init(alloc, obj);
+  REF_PTR_PROBE3(make, obj, refcnt, ref_type_name<ObjectType>());
   return obj;
 }
 
+// A plain allocator pointer without constructor arguments, the allocator
+// type given or deduced; the location is the caller's.
+template <typename ObjectType, typename Interface, typename AllocatorType,
+          typename RefCounterType = RefCntImpl<Interface>>
+inline ObjectType *
+vm_make(AllocatorType *alloc,
+        std::source_location loc = std::source_location::current()) {
+  return vm_make<ObjectType, Interface, AllocatorType, RefCounterType>(
+      AllocSite<AllocatorType>(alloc, loc));
+}
+
+// A plain allocator pointer with constructor arguments, the allocator type
+// deduced from it. The caller's location cannot follow the arguments, so
+// the site recorded is this function; name the allocator type or pass
+// AllocSite(&alloc) to record the caller. With the type named, the
+// AllocSite overload is taken, as AllocPointer is then no pointer.
+template <typename ObjectType, typename Interface, typename AllocPointer,
+          typename RefCounterType = RefCntImpl<Interface>, typename... Args>
+  requires std::is_pointer_v<AllocPointer>
+inline ObjectType *vm_make(AllocPointer alloc, Args &&...args) {
+  using AllocatorType = std::remove_pointer_t<AllocPointer>;
+  return vm_make<ObjectType, Interface, AllocatorType, RefCounterType>(
+      AllocSite<AllocatorType>(alloc), std::forward<Args>(args)...);
+}
+
 template <typename ObjectType, typename Interface, typename AllocatorType,
           typename RefCounterType = RefCntImpl<Interface>, typename... Args>
-inline ref_ptr<ObjectType> make_ref_ptr(AllocatorType *alloc, Args &&...args) {
+inline ref_ptr<ObjectType> make_ref_ptr(AllocSite<AllocatorType> site,
+                                        Args &&...args) {
+  return ref_ptr<ObjectType>(
+      vm_make<ObjectType, Interface, AllocatorType, RefCounterType>(
+          site, std::forward<Args>(args)...));
+}
+
+template <typename ObjectType, typename Interface, typename AllocatorType,
+          typename RefCounterType = RefCntImpl<Interface>>
+inline ref_ptr<ObjectType>
+make_ref_ptr(AllocatorType *alloc,
+             std::source_location loc = std::source_location::current()) {
   return ref_ptr<ObjectType>(
       vm_make<ObjectType, Interface, AllocatorType, RefCounterType>(
+          AllocSite<AllocatorType>(alloc, loc)));
+}
+
+template <typename ObjectType, typename Interface, typename AllocPointer,
+          typename RefCounterType = RefCntImpl<Interface>, typename... Args>
+  requires std::is_pointer_v<AllocPointer>
+inline ref_ptr<ObjectType> make_ref_ptr(AllocPointer alloc, Args &&...args) {
+  return ref_ptr<ObjectType>(
+      vm_make<ObjectType, Interface, AllocPointer, RefCounterType>(
           alloc, std::forward<Args>(args)...));
 }
+
+// Makes n objects in one allocation under one control block and returns the
+// first with one reference for the whole array. Every element is constructed
+// as ObjectType(refcnt, args...) and its cnt() is the shared block, so a
+// ref_ptr to any element keeps all of them alive. An obs_ptr observes the
+// array through its first element only; making one from any other element
+// aborts, as it would lock to the first.
+template <typename ObjectType, typename Interface, typename AllocatorType,
+          typename RefCounterType = RefCntImpl<Interface>, typename... Args>
+inline ObjectType *vm_make_array(AllocSite<AllocatorType> site, size_t n,
+                                 const Args &...args) {
+  if (n == 0)
+    return nullptr;
+  using storage = RefArrayStorage<ObjectType>;
+  auto alloc = site.alloc;
+  auto refcnt = RefCounterType::make_block(alloc);
+  ObjectType *first = storage::allocate(alloc, n);
+  size_t i = 0;
+  try {
+    for (; i < n; i++)
+      ::new (first + i) ObjectType(refcnt, args...);
+  } catch (...) {
+    while (i-- > 0)
+      first[i].~ObjectType();
+    storage::deallocate(alloc, first);
+    RefCounterType::template free_block<AllocatorType>(free_of(alloc),
+                                                       refcnt);
+    throw;
+  }
+#ifdef REF_PTR_ALLOC_SAMPLING
+  if (AllocSiteRegistry::should_sample()) {
+    const size_t bytes = storage::HEADER + n * sizeof(ObjectType);
+    AllocSiteRegistry::instance().add(first, site.loc,
+                                      ref_type_name<ObjectType>(),
+                                      bytes + sizeof(RefCounterType));
+    refcnt->template init_array<true>(alloc, first);
+  } else
+#endif
+    refcnt->init_array(alloc, first);
+  REF_PTR_PROBE3(make, first, refcnt, ref_type_name<ObjectType>());
+  return first;
+}
+
+// Owns a reference to a vm_make_array() array and indexes its elements.
+template <typename T> class ref_array {
+public:
+  ref_array() noexcept = default;
+
+  // Adopts the reference vm_make_array() returned with first.
+  ref_array(T *first, size_t n) noexcept : _first(first), _size(n) {}
+
+  size_t size() const noexcept { return _size; }
+  bool empty() const noexcept { return _size == 0; }
+
+  T *data() const noexcept { return _first.get(); }
+  T *begin() const noexcept { return data(); }
+  T *end() const noexcept { return data() + _size; }
+  T &operator[](size_t i) const noexcept { return data()[i]; }
+
+  // Element i, sharing the array's reference count.
+  ref_ptr<T> element(size_t i) const noexcept {
+    assert(i < _size);
+    T *obj = data() + i;
+    obj->cnt()->ref();
+    return ref_ptr<T>(obj);
+  }
+
+  void reset() noexcept {
+    _first.reset();
+    _size = 0;
+  }
+
+private:
+  ref_ptr<T> _first;
+  size_t _size{0};
+};
+
+// Owns a reference to an object while pointing at a part of it, e.g. a
+// member: ref_alias(std::move(node), &node->name) keeps node alive as long
+// as the alias. The part needs no count of its own, and building the alias
+// from an rvalue ref_ptr or alias leaves the count alone. An alias of a null
+// owner is null whatever part it was given, so it never points without
+// owning.
+template <typename T, typename RefCntType> class ref_alias {
+public:
+  using element_type = T;
+
+  ref_alias() noexcept = default;
+  ref_alias(std::nullptr_t) noexcept {}
+
+  template <typename U>
+  ref_alias(ref_ptr<U> &&owner, T *ptr) noexcept
+      : _cnt(owner ? owner->cnt() : nullptr), _ptr(_cnt ? ptr : nullptr) {
+    owner.obj = nullptr;
+  }
+  template <typename U>
+  ref_alias(const ref_ptr<U> &owner, T *ptr) noexcept
+      : _cnt(owner ? owner->cnt() : nullptr), _ptr(_cnt ? ptr : nullptr) {
+    if (_cnt)
+      _cnt->ref();
+  }
+
+  // Another part of the object r owns.
+  template <typename U>
+  ref_alias(ref_alias<U, RefCntType> &&r, T *ptr) noexcept
+      : _cnt(r._cnt), _ptr(_cnt ? ptr : nullptr) {
+    r._cnt = nullptr;
+    r._ptr = nullptr;
+  }
+  template <typename U>
+  ref_alias(const ref_alias<U, RefCntType> &r, T *ptr) noexcept
+      : _cnt(r._cnt), _ptr(_cnt ? ptr : nullptr) {
+    if (_cnt)
+      _cnt->ref();
+  }
+
+  ref_alias(const ref_alias &r) noexcept : ref_alias(r, r._ptr) {}
+  ref_alias(ref_alias &&r) noexcept : _cnt(r._cnt), _ptr(r._ptr) {
+    r._cnt = nullptr;
+    r._ptr = nullptr;
+  }
+
+  ref_alias &operator=(ref_alias r) noexcept {
+    std::swap(_cnt, r._cnt);
+    std::swap(_ptr, r._ptr);
+    return *this;
+  }
+
+  ~ref_alias() { reset(); }
+
+  void reset() noexcept {
+    if (_cnt)
+      _cnt->deref();
+    _cnt = nullptr;
+    _ptr = nullptr;
+  }
+
+  explicit operator bool() const noexcept {
+    return _cnt != nullptr && _ptr != nullptr;
+  }
+  T *get() const noexcept { return _ptr; }
+  T *operator->() const noexcept { return _ptr; }
+  T &operator*() const noexcept { return *_ptr; }
+
+  long use_count() const noexcept { return _cnt ? _cnt->ref_count() : 0; }
+
+private:
+  template <typename, typename> friend class ref_alias;
+
+  RefCntType *_cnt{nullptr};
+  T *_ptr{nullptr};
+};
+
+template <typename U, typename T>
+ref_alias(ref_ptr<U> &&, T *) -> ref_alias<T, typename U::refcnt_type>;
+template <typename U, typename T>
+ref_alias(const ref_ptr<U> &, T *) -> ref_alias<T, typename U::refcnt_type>;
+
+template <typename ObjectType, typename Interface, typename AllocatorType,
+          typename RefCounterType = RefCntImpl<Interface>, typename... Args>
+inline ref_array<ObjectType> make_ref_ptr_array(AllocSite<AllocatorType> site,
+                                                size_t n,
+                                                const Args &...args) {
+  return ref_array<ObjectType>(
+      vm_make_array<ObjectType, Interface, AllocatorType, RefCounterType>(
+          site, n, args...),
+      n);
+}
@@ -0,0 +1,190 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <source_location>
+
+// Allocator argument of vm_make/make_ref_ptr. It converts implicitly from an
+// allocator pointer (or nullptr) and records the caller's source location on
+// the way, which is forwarded to RefCountedObject::operator new and, when
+// REF_PTR_ALLOC_SAMPLING is defined, to the sampled live-object registry.
+template <typename AllocatorType> struct AllocSite {
+  AllocatorType *alloc{nullptr};
+  std::source_location loc;
+
+  AllocSite(AllocatorType *alloc,
+            std::source_location loc = std::source_location::current()) noexcept
+      : alloc(alloc), loc(loc) {}
+};
+
+#ifdef REF_PTR_ALLOC_SAMPLING
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Sampled registry of live objects keyed by allocation site.
+//
+// One allocation in `sample_rate()` is recorded, every record stands for
+// `sample_rate()` objects, so the reported counts and bytes are estimates
+// whose cost is one thread-local decrement per unsampled make. Sampled objects
+// are removed from the registry by their control block when destroyed.
+class AllocSiteRegistry {
+public:
+  // Age buckets: <1ms, <10ms, <100ms, <1s, <10s, <100s, <1000s, >=1000s
+  static constexpr int AGE_BUCKETS = 8;
+
+  struct SiteStats {
+    std::string file;
+    uint32_t line{0};
+    std::string function;
+    const char *type_name{nullptr};
+    size_t live_count{0};
+    size_t live_bytes{0};
+    size_t age_histogram[AGE_BUCKETS]{};
+  };
+
+  static AllocSiteRegistry &instance() {
+    static AllocSiteRegistry registry;
+    return registry;
+  }
+
+  // 0 disables sampling, 1 tracks every allocation.
+  static void set_sample_rate(uint32_t rate) {
+    rate_().store(rate, std::memory_order_relaxed);
+  }
+
+  static uint32_t sample_rate() {
+    return rate_().load(std::memory_order_relaxed);
+  }
+
+  static bool should_sample() {
+    thread_local uint32_t countdown = 0;
+    if (countdown > 1) {
+      --countdown;
+      return false;
+    }
+    countdown = sample_rate();
+    return countdown != 0;
+  }
+
+  void add(const void *obj, const std::source_location &loc,
+           const char *type_name, size_t bytes) {
+    Key key{loc.file_name(), loc.line(), loc.column(), type_name};
+    const auto birth = clock::now();
+    std::lock_guard<std::mutex> lk(_mtx);
+    auto site = _sites.try_emplace(std::move(key), loc.function_name()).first;
+    _live[obj] = Record{&*site, bytes, sample_rate(), birth};
+  }
+
+  void remove(const void *obj) {
+    std::lock_guard<std::mutex> lk(_mtx);
+    _live.erase(obj);
+  }
+
+  // "file:line" of a sampled live object, empty if it was not sampled.
+  std::string find(const void *obj) const {
+    std::lock_guard<std::mutex> lk(_mtx);
+    auto it = _live.find(obj);
+    if (it == _live.end())
+      return {};
+    const auto &key = it->second.site->first;
+    return key.file + ":" + std::to_string(key.line);
+  }
+
+  // Estimated live objects per site, largest retained bytes first.
+  std::vector<SiteStats> snapshot() const {
+    const auto now = clock::now();
+    std::lock_guard<std::mutex> lk(_mtx);
+    std::unordered_map<const void *, SiteStats> stats;
+    for (const auto &[obj, record] : _live) {
+      auto &s = stats[record.site];
+      if (s.type_name == nullptr) {
+        s.file = record.site->first.file;
+        s.line = record.site->first.line;
+        s.function = record.site->second;
+        s.type_name = record.site->first.type_name;
+      }
+      s.live_count += record.weight;
+      s.live_bytes += size_t(record.weight) * record.bytes;
+      s.age_histogram[age_bucket(now - record.birth)] += record.weight;
+    }
+    std::vector<SiteStats> result;
+    result.reserve(stats.size());
+    for (auto &[site, s] : stats)
+      result.push_back(std::move(s));
+    std::sort(result.begin(), result.end(),
+              [](const SiteStats &a, const SiteStats &b) {
+                return a.live_bytes > b.live_bytes;
+              });
+    return result;
+  }
+
+  void report(std::ostream &os) const {
+    static const char *const bucket_names[AGE_BUCKETS] = {
+        "<1ms", "<10ms", "<100ms", "<1s", "<10s", "<100s", "<1000s", ">=1000s"};
+    os << "ref_ptr live objects (1 in " << sample_rate() << " sampled)\n";
+    for (const auto &s : snapshot()) {
+      os << s.file << ":" << s.line << " " << s.type_name << "\n"
+         << "  live: " << s.live_count << " objects, " << s.live_bytes
+         << " bytes\n  age:";
+      for (int i = 0; i < AGE_BUCKETS; i++) {
+        if (s.age_histogram[i])
+          os << " " << bucket_names[i] << "=" << s.age_histogram[i];
+      }
+      os << "\n";
+    }
+  }
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  struct Key {
+    std::string file;
+    uint32_t line;
+    uint32_t column;
+    const char *type_name;
+    bool operator==(const Key &) const = default;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &k) const {
+      return std::hash<std::string_view>()(k.file) ^
+             (size_t(k.line) << 20 | k.column) ^
+             std::hash<const void *>()(k.type_name);
+    }
+  };
+
+  using Sites = std::unordered_map<Key, std::string, KeyHash>;
+
+  struct Record {
+    const Sites::value_type *site;
+    size_t bytes;
+    uint32_t weight;
+    clock::time_point birth;
+  };
+
+  static std::atomic<uint32_t> &rate_() {
+    static std::atomic<uint32_t> rate{0};
+    return rate;
+  }
+
+  static int age_bucket(clock::duration age) {
+    using std::chrono::milliseconds;
+    auto ms = std::chrono::duration_cast<milliseconds>(age).count();
+    int bucket = 0;
+    for (long long limit = 1; bucket < AGE_BUCKETS - 1 && ms >= limit;
+         limit *= 10)
+      bucket++;
+    return bucket;
+  }
+
+  mutable std::mutex _mtx;
+  Sites _sites;
+  std::unordered_map<const void *, Record> _live;
+};
+#endif
@@ -0,0 +1,95 @@
+#pragma once
+
+// Batch traversal and locking of arrays of obs_ptr.
+//
+// Locking an obs_ptr reads its control block, whose count, object pointer
+// and object state sit on separate cache lines in the padded layout, and a
+// visit then reads the object: cold, a chain of misses per element. The
+// locked increment also keeps the CPU from running ahead into the next
+// element. The helpers below prefetch the lines of the control block
+// BATCH_PREFETCH_DISTANCE elements ahead. for_each_live also locks that far
+// ahead of the visit and prefetches each object as it is locked.
+//
+//   std::vector<ref_ptr<Node>> locked(watchers.size());
+//   size_t live = lock_all(std::span(watchers), locked.data());
+//   for_each_live(std::span(watchers), [](Node &n) { n.update(); });
+//
+// Control blocks other than RefCntImpl only have their first line
+// prefetched. Arrays of ref_ptr get no helper: with no count to touch, the
+// CPU's own lookahead already overlaps the object misses of a plain loop.
+
+#include <cstddef>
+#include <span>
+
+#include "ref_ptr.h"
+
+constexpr size_t BATCH_PREFETCH_DISTANCE = 16;
+
+namespace batch_detail {
+template <typename RefCntType> void prefetch_block(const RefCntType *cnt) {
+  if constexpr (requires { cnt->prefetch_lock(); })
+    cnt->prefetch_lock();
+  else
+    __builtin_prefetch(cnt, 1);
+}
+} // namespace batch_detail
+
+// Locks every obs[i] into out[i], null for the expired ones; out must hold
+// obs.size() pointers. Returns the number of live objects.
+template <typename T>
+size_t lock_all(std::span<const obs_ptr<T>> obs, ref_ptr<T> *out) {
+  constexpr size_t D = BATCH_PREFETCH_DISTANCE;
+  const size_t n = obs.size();
+  for (size_t i = 0; i < n && i < D; i++) {
+    if (obs[i].cnt)
+      batch_detail::prefetch_block(obs[i].cnt);
+  }
+  size_t live = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (i + D < n && obs[i + D].cnt)
+      batch_detail::prefetch_block(obs[i + D].cnt);
+    out[i] = obs[i].lock();
+    live += bool(out[i]);
+  }
+  return live;
+}
+template <typename T>
+size_t lock_all(std::span<obs_ptr<T>> obs, ref_ptr<T> *out) {
+  return lock_all(std::span<const obs_ptr<T>>(obs), out);
+}
+
+// Calls f(T &) for every object still alive, holding a reference during the
+// call. Returns the number of calls.
+template <typename T, typename F>
+size_t for_each_live(std::span<const obs_ptr<T>> obs, F &&f) {
+  constexpr size_t D = BATCH_PREFETCH_DISTANCE;
+  const size_t n = obs.size();
+  for (size_t i = 0; i < n && i < D; i++) {
+    if (obs[i].cnt)
+      batch_detail::prefetch_block(obs[i].cnt);
+  }
+  // Element i is locked and its object prefetched at step i, visited at
+  // step i + D.
+  ref_ptr<T> ring[D];
+  size_t live = 0;
+  for (size_t i = 0; i < n + D; i++) {
+    auto &slot = ring[i % D];
+    if (slot) {
+      live++;
+      f(*slot);
+      slot.reset();
+    }
+    if (i >= n)
+      continue;
+    if (i + D < n && obs[i + D].cnt)
+      batch_detail::prefetch_block(obs[i + D].cnt);
+    slot = obs[i].lock();
+    if (slot)
+      __builtin_prefetch(slot.get(), 0);
+  }
+  return live;
+}
+template <typename T, typename F>
+size_t for_each_live(std::span<obs_ptr<T>> obs, F &&f) {
+  return for_each_live(std::span<const obs_ptr<T>>(obs), std::forward<F>(f));
+}
@@ -0,0 +1,302 @@
+#pragma once
+
+// Contention profiler for RefCntImpl.
+//
+// With REF_PTR_CONTENTION_PROFILING defined, one counter RMW in
+// `sample_rate()` per thread is timed with the time stamp counter and charged
+// to its control block. The reads are fenced so that the RMW cannot move
+// out of the timed window; the fences cost a few tens of ticks, which are
+// measured once and subtracted from every sample. The hottest blocks are
+// kept in a fixed-size space-saving table, so memory stays bounded no matter
+// how many objects are touched. `report()` prints them with their type,
+// allocation site (when REF_PTR_ALLOC_SAMPLING sampled the object) and a
+// suggested fix.
+
+#ifdef REF_PTR_CONTENTION_PROFILING
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+class ContentionProfiler {
+public:
+  enum EOp : uint8_t { REF, DEREF, WEAK_REF, WEAK_DEREF, LOCK, OP_COUNT };
+
+  static constexpr size_t TABLE_SIZE = 512;
+
+  struct BlockStats {
+    const void *block{nullptr};
+    const void *object{nullptr};
+    const char *type_name{nullptr};
+    std::string site; // "file:line", empty when the object was not sampled
+    bool alive{true};
+    uint64_t samples{0};
+    uint64_t ops[OP_COUNT]{};
+    uint64_t total_ticks{0};
+    uint64_t max_ticks{0};
+    uint64_t thread_mask{0}; // one bit per hashed thread id
+
+    uint64_t avg_ticks() const { return samples ? total_ticks / samples : 0; }
+    int threads() const { return std::popcount(thread_mask); }
+
+    // Heuristic, an uncontended RMW costs a few tens of ticks while a cache
+    // line transfer costs hundreds:
+    //  - few threads: copy/drop pairs on a hot path, pass borrowed references.
+    //  - many threads, balanced ref/deref: long-lived shared object whose
+    //    count never gets near zero, make it immortal.
+    //  - many threads, unbalanced: many long-lived owners, shard the counter.
+    const char *recommendation(uint64_t contended_ticks = 100) const {
+      if (avg_ticks() < contended_ticks)
+        return "-";
+      if (threads() < 4)
+        return "borrow";
+      const auto refs = ops[REF] + ops[LOCK];
+      const auto derefs = ops[DEREF];
+      const auto diff = refs > derefs ? refs - derefs : derefs - refs;
+      return diff * 8 <= refs + derefs ? "immortal" : "shard";
+    }
+  };
+
+  static ContentionProfiler &instance() {
+    static ContentionProfiler profiler;
+    return profiler;
+  }
+
+  // 0 disables sampling, 1 times every operation.
+  static void set_sample_rate(uint32_t rate) {
+    rate_().store(rate, std::memory_order_relaxed);
+  }
+
+  static uint32_t sample_rate() {
+    return rate_().load(std::memory_order_relaxed);
+  }
+
+  // Time stamps around a timed operation. The lfence before rdtsc waits for
+  // earlier instructions and the one after keeps the operation from starting
+  // early; rdtscp waits for the operation and the last lfence keeps later
+  // instructions out.
+  static uint64_t ticks_begin() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_lfence();
+    const uint64_t t = __rdtsc();
+    _mm_lfence();
+    return t;
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+  }
+
+  static uint64_t ticks_end() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int aux;
+    const uint64_t t = __rdtscp(&aux);
+    _mm_lfence();
+    return t;
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+  }
+
+  // Ticks of an empty ticks_begin()/ticks_end() pair, the least of a few.
+  static uint64_t overhead() {
+    static const uint64_t least = [] {
+      uint64_t least = UINT64_MAX;
+      for (int i = 0; i < 64; i++) {
+        const auto t0 = ticks_begin();
+        const auto t1 = ticks_end();
+        least = std::min(least, t1 - t0);
+      }
+      return least;
+    }();
+    return least;
+  }
+
+  // Runs the RMW `f` on `block`, timing it when this call is sampled.
+  template <typename BlockType, typename F>
+  static auto measure(BlockType *block, EOp op, F &&f) {
+    thread_local uint32_t countdown = 0;
+    if (countdown > 1) {
+      --countdown;
+      return f();
+    }
+    countdown = sample_rate();
+    if (countdown == 0)
+      return f();
+    // Read while the caller still holds its reference: once the RMW has run,
+    // another thread may drop the last one and free the block.
+    auto &profiler = instance();
+    if (!profiler._used.load(std::memory_order_relaxed))
+      profiler._used.store(true, std::memory_order_release);
+    const Sample sample{block, block->profiled_object(),
+                        block->profiled_type_name(),
+                        profiler._forgets.load(std::memory_order_acquire)};
+    const auto bias = overhead();
+    const auto t0 = ticks_begin();
+    auto result = f();
+    const auto t1 = ticks_end();
+    profiler.record(sample, op, t1 - t0 > bias ? t1 - t0 - bias : 0);
+    return result;
+  }
+
+  // Called when a control block is freed so that its address can be reused.
+  void forget(const void *block) {
+    if (!_used.load(std::memory_order_acquire))
+      return;
+    std::lock_guard<std::mutex> lk(_mtx);
+    _forgets.fetch_add(1, std::memory_order_release);
+    if (auto slot = find(block)) {
+      slot->stats.alive = false;
+      slot->key = nullptr;
+    }
+  }
+
+  // Hottest control blocks by total ticks spent in their RMWs.
+  std::vector<BlockStats> top(size_t k) const {
+    std::vector<BlockStats> result;
+    {
+      std::lock_guard<std::mutex> lk(_mtx);
+      for (const auto &slot : _slots) {
+        if (slot.stats.samples)
+          result.push_back(slot.stats);
+      }
+    }
+    std::sort(result.begin(), result.end(),
+              [](const BlockStats &a, const BlockStats &b) {
+                return a.total_ticks > b.total_ticks;
+              });
+    if (result.size() > k)
+      result.resize(k);
+    return result;
+  }
+
+  void report(std::ostream &os, size_t k = 20) const {
+    os << "ref_ptr hottest control blocks (1 in " << sample_rate()
+       << " ops sampled)\n";
+    for (const auto &s : top(k)) {
+      os << s.block << " " << (s.type_name ? s.type_name : "?")
+         << (s.alive ? "" : " (destroyed)");
+      if (!s.site.empty())
+        os << " @ " << s.site;
+      os << "\n  samples: " << s.samples << " ref/deref/weak_ref/weak_deref/"
+         << "lock: " << s.ops[REF] << "/" << s.ops[DEREF] << "/"
+         << s.ops[WEAK_REF] << "/" << s.ops[WEAK_DEREF] << "/" << s.ops[LOCK]
+         << "\n  ticks avg/max: " << s.avg_ticks() << "/" << s.max_ticks
+         << " threads: " << s.threads()
+         << " suggest: " << s.recommendation() << "\n";
+    }
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lk(_mtx);
+    for (auto &slot : _slots)
+      slot = Slot{};
+  }
+
+private:
+  struct Slot {
+    const void *key{nullptr};
+    BlockStats stats;
+  };
+
+  // What record() needs of a block, taken before its RMW.
+  struct Sample {
+    const void *block;
+    const void *object;
+    const char *type_name;
+    uint64_t forgets; // _forgets when the sample started
+  };
+
+  static std::atomic<uint32_t> &rate_() {
+    static std::atomic<uint32_t> rate{0};
+    return rate;
+  }
+
+  static size_t hash(const void *block) {
+    return (reinterpret_cast<uintptr_t>(block) >> 6) * 0x9E3779B97F4A7C15ull >>
+           (64 - std::bit_width(TABLE_SIZE - 1));
+  }
+
+  Slot *find(const void *block) {
+    for (size_t i = 0, h = hash(block); i < TABLE_SIZE; i++) {
+      auto &slot = _slots[(h + i) % TABLE_SIZE];
+      if (slot.key == block)
+        return &slot;
+      if (slot.key == nullptr && slot.stats.samples == 0)
+        return nullptr;
+    }
+    return nullptr;
+  }
+
+  void record(const Sample &sample, EOp op, uint64_t elapsed) {
+    thread_local const uint64_t thread_bit =
+        1ull << (std::hash<std::thread::id>()(std::this_thread::get_id()) % 64);
+    std::lock_guard<std::mutex> lk(_mtx);
+    auto slot = find(sample.block);
+    if (!slot) {
+      // A block freed since the sample started may have been forgotten
+      // already; inserting it again would leave a dead key in the table.
+      if (_forgets.load(std::memory_order_relaxed) != sample.forgets)
+        return;
+      slot = insert(sample);
+    }
+    auto &s = slot->stats;
+    s.samples++;
+    s.ops[op]++;
+    s.total_ticks += elapsed;
+    s.max_ticks = std::max(s.max_ticks, elapsed);
+    s.thread_mask |= thread_bit;
+  }
+
+  // Space-saving: when the table is full the coldest entry is replaced and
+  // its counts are inherited, so that a newly hot block can still rise.
+  Slot *insert(const Sample &sample) {
+    Slot *victim = nullptr;
+    for (size_t i = 0, h = hash(sample.block); i < TABLE_SIZE; i++) {
+      auto &slot = _slots[(h + i) % TABLE_SIZE];
+      if (slot.key == nullptr) {
+        victim = &slot;
+        break;
+      }
+      if (!victim || slot.stats.samples < victim->stats.samples)
+        victim = &slot;
+    }
+    BlockStats stats;
+    stats.samples = victim->key ? victim->stats.samples : 0;
+    stats.total_ticks = victim->key ? victim->stats.total_ticks : 0;
+    stats.block = sample.block;
+    stats.object = sample.object;
+    stats.type_name = sample.type_name;
+#ifdef REF_PTR_ALLOC_SAMPLING
+    stats.site = AllocSiteRegistry::instance().find(stats.object);
+#endif
+    victim->key = sample.block;
+    victim->stats = std::move(stats);
+    return victim;
+  }
+
+  mutable std::mutex _mtx;
+  // Set before the first sample's RMW and read with acquire by forget(),
+  // which then sees it whenever the freeing deref() came after that RMW.
+  std::atomic<bool> _used{false};
+  // Blocks forgotten so far, written under _mtx.
+  std::atomic<uint64_t> _forgets{0};
+  Slot _slots[TABLE_SIZE];
+};
+
+#define REF_PTR_PROFILE_RMW(op, expr)                                          \
+  ContentionProfiler::measure(this, ContentionProfiler::op,                    \
+                              [&] { return (expr); })
+#else
+#define REF_PTR_PROFILE_RMW(op, expr) (expr)
+#endif
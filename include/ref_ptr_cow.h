@@ -0,0 +1,87 @@
+#pragma once
+
+// Copy-on-write pointer for large values shared read-only through ref_ptr.
+//
+// Reads go straight to the shared object. A write first checks, with
+// RefCntImpl::unique(), that no other strong reference exists and clones the
+// object otherwise, so a value is copied at most once per write no matter
+// how many fields change:
+//
+//   cow_ptr<Config> cfg = ...;
+//   auto w = cfg.write(); // clones here if cfg is shared
+//   w->timeout = 5;
+//   w->retries = 3;
+//
+// Cloning calls Clone, by default `src.clone()` returning ref_ptr<T>.
+// Copies of a cow_ptr made while a writer is alive share the object it is
+// writing to, so take copies before or after. obs_ptrs do not count as
+// sharing: one that locks the object sees it modified in place.
+
+#include <cstddef>
+#include <utility>
+
+#include "ref_ptr.h"
+
+template <typename T> struct cow_clone {
+  ref_ptr<T> operator()(const T &src) const { return src.clone(); }
+};
+
+template <typename T, typename Clone = cow_clone<T>> class cow_ptr {
+public:
+  using element_type = T;
+
+  // Mutable access to a cow_ptr's object, which it owns alone.
+  class writer {
+  public:
+    T *operator->() const noexcept { return _obj; }
+    T &operator*() const noexcept { return *_obj; }
+    T *get() const noexcept { return _obj; }
+
+  private:
+    friend class cow_ptr;
+    explicit writer(T *obj) : _obj(obj) {}
+    T *_obj;
+  };
+
+  cow_ptr() noexcept = default;
+  cow_ptr(std::nullptr_t) noexcept {}
+  explicit cow_ptr(ref_ptr<T> p) noexcept : _ptr(std::move(p)) {}
+
+  explicit operator bool() const noexcept { return bool(_ptr); }
+
+  const T *get() const noexcept { return _ptr.get(); }
+  const T *operator->() const noexcept { return _ptr.get(); }
+  const T &operator*() const noexcept { return *_ptr; }
+
+  long use_count() const noexcept { return _ptr.use_count(); }
+  bool unique() const noexcept { return _ptr && _ptr->cnt()->unique(); }
+
+  // Read-only reference that stays valid across later writes to this one.
+  ref_ptr<const T> share() const noexcept { return _ptr; }
+
+  // The object, cloned first unless this is its only strong reference. Null
+  // when empty.
+  T *mutate() {
+    if (_ptr && !_ptr->cnt()->unique())
+      _ptr = Clone()(*_ptr);
+    return _ptr.get();
+  }
+
+  // Scope for several modifications that clones at most once.
+  writer write() { return writer(mutate()); }
+
+  void reset() noexcept { _ptr.reset(); }
+
+private:
+  ref_ptr<T> _ptr;
+};
+
+template <typename T, typename C>
+inline bool operator==(const cow_ptr<T, C> &lhs, std::nullptr_t) {
+  return lhs.get() == nullptr;
+}
+
+template <typename T, typename C>
+inline bool operator!=(const cow_ptr<T, C> &lhs, std::nullptr_t) {
+  return lhs.get() != nullptr;
+}
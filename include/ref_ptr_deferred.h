@@ -0,0 +1,230 @@
+#pragma once
+
+// Deferred reference counting for loops that copy and drop references to the
+// same few objects.
+//
+// A deferred_ref_ptr logs its decrements in a small table of the calling
+// thread, keyed by control block, instead of touching the shared counter. A
+// copy made while the table holds a pending decrement for the block takes
+// that reference over and cancels it, so copy/drop pairs cost no atomics at
+// all. The net decrement reaches the counter when the table is full, at
+// deferred_counts::flush() and when a deferred_epoch or the thread ends;
+// only then can the count drop to zero and the object be destroyed, and
+// until then obs_ptr::lock() still succeeds.
+//
+//   deferred_epoch epoch; // flushes here at the end of the scope
+//   for (...) {
+//     deferred_ref_ptr<Node> p = shared; // cancels the last drop
+//     ...
+//   }                                    // logs a drop
+//
+// Counts are only ever too high between flushes, which keeps zero detection
+// exact. deferred_epoch(true) also logs the increments of deferred_ref_ptr
+// copies that find no pending decrement. The thread must then own a
+// reference of its own to every object it copies, and the copies must not
+// leave the thread, until the epoch ends.
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "ref_ptr.h"
+
+class deferred_counts {
+public:
+  static constexpr int SLOT_BITS = 6;
+  static constexpr size_t SLOTS = size_t(1) << SLOT_BITS; // flushed half full
+
+  // The calling thread's table, flushed when the thread exits.
+  static deferred_counts &local() {
+    static thread_local deferred_counts counts;
+    return counts;
+  }
+
+  ~deferred_counts() { flush(); }
+
+  // A reference to cnt's object for a copy: a pending decrement taken over,
+  // a logged increment in an epoch that defers them, or an increment.
+  template <typename RefCntType> void ref(RefCntType *cnt) {
+    auto &e = entry(cnt);
+    if (e.delta < 0 || _defer_increments) {
+      e.delta++;
+      return;
+    }
+    _atomics++;
+    cnt->ref();
+  }
+
+  // A reference that must be real now, e.g. for a ref_ptr.
+  template <typename RefCntType> void ref_now(RefCntType *cnt) {
+    auto &e = entry(cnt);
+    if (e.delta < 0) {
+      e.delta++;
+      return;
+    }
+    _atomics++;
+    cnt->ref();
+  }
+
+  template <typename RefCntType> void deref(RefCntType *cnt) {
+    entry(cnt).delta--;
+  }
+
+  // Applies the net counts; objects whose count reaches zero are destroyed.
+  // Their destructors may drop deferred references in turn, which are
+  // flushed too.
+  void flush() {
+    while (_used) {
+      Entry pending[SLOTS];
+      size_t n = 0;
+      for (auto &e : _slots) {
+        if (e.cnt && e.delta)
+          pending[n++] = e;
+        e = Entry{};
+      }
+      _used = 0;
+      _atomics += n;
+      for (size_t i = 0; i < n; i++)
+        pending[i].apply(pending[i].cnt, pending[i].delta);
+    }
+  }
+
+  // Counter updates made so far: increments not covered by the table and
+  // flushed entries.
+  size_t atomics() const { return _atomics; }
+
+private:
+  friend class deferred_epoch;
+
+  struct Entry {
+    void *cnt{nullptr};
+    void (*apply)(void *cnt, intptr_t delta){nullptr};
+    intptr_t delta{0};
+  };
+
+  template <typename RefCntType>
+  static void apply(void *cnt, intptr_t delta) {
+    auto c = static_cast<RefCntType *>(cnt);
+    using size_type = typename RefCntType::size_type;
+    if (delta > 0)
+      c->add_ref(size_type(delta));
+    else
+      c->release(size_type(-delta));
+  }
+
+  // Open addressing with linear probing; a full table is flushed. An entry
+  // with no net count may outlive its block, so its apply is refreshed.
+  template <typename RefCntType> Entry &entry(RefCntType *cnt) {
+    constexpr uint64_t FIBONACCI = 0x9E3779B97F4A7C15u;
+    auto i = size_t(uint64_t(reinterpret_cast<uintptr_t>(cnt)) * FIBONACCI >>
+                    (64 - SLOT_BITS));
+    for (;; i = (i + 1) & (SLOTS - 1)) {
+      auto &e = _slots[i];
+      if (e.cnt == cnt) {
+        if (e.delta == 0)
+          e.apply = apply<RefCntType>;
+        return e;
+      }
+      if (!e.cnt) {
+        if (_used == SLOTS / 2) {
+          flush();
+          return entry(cnt);
+        }
+        _used++;
+        e.cnt = cnt;
+        e.apply = apply<RefCntType>;
+        return e;
+      }
+    }
+  }
+
+  Entry _slots[SLOTS];
+  size_t _used{0};
+  size_t _atomics{0};
+  bool _defer_increments{false};
+};
+
+// Flushes the calling thread's deferred counts at the end of the scope.
+class deferred_epoch {
+public:
+  explicit deferred_epoch(bool defer_increments = false)
+      : _outer(deferred_counts::local()._defer_increments) {
+    deferred_counts::local()._defer_increments = _outer || defer_increments;
+  }
+  deferred_epoch(const deferred_epoch &) = delete;
+  deferred_epoch &operator=(const deferred_epoch &) = delete;
+
+  ~deferred_epoch() {
+    auto &counts = deferred_counts::local();
+    counts.flush();
+    counts._defer_increments = _outer;
+  }
+
+private:
+  bool _outer;
+};
+
+template <typename T> class deferred_ref_ptr {
+public:
+  using element_type = T;
+
+  deferred_ref_ptr() noexcept = default;
+  deferred_ref_ptr(std::nullptr_t) noexcept {}
+
+  // Takes over p's reference.
+  template <typename U>
+  deferred_ref_ptr(ref_ptr<U> &&p) noexcept : _obj(p.obj) {
+    p.obj = nullptr;
+  }
+  // A real reference even in an epoch that defers increments: p may be a
+  // temporary the thread does not keep.
+  template <typename U>
+  deferred_ref_ptr(const ref_ptr<U> &p) noexcept : _obj(p.get()) {
+    if (_obj)
+      deferred_counts::local().ref_now(_obj->cnt());
+  }
+
+  deferred_ref_ptr(const deferred_ref_ptr &o) noexcept : _obj(o._obj) {
+    if (_obj)
+      deferred_counts::local().ref(_obj->cnt());
+  }
+  deferred_ref_ptr(deferred_ref_ptr &&o) noexcept : _obj(o._obj) {
+    o._obj = nullptr;
+  }
+
+  deferred_ref_ptr &operator=(deferred_ref_ptr o) noexcept {
+    std::swap(_obj, o._obj);
+    return *this;
+  }
+
+  ~deferred_ref_ptr() { reset(); }
+
+  void reset() noexcept {
+    if (_obj) {
+      deferred_counts::local().deref(_obj->cnt());
+      _obj = nullptr;
+    }
+  }
+
+  explicit operator bool() const noexcept { return _obj != nullptr; }
+  T *get() const noexcept { return _obj; }
+  T *operator->() const noexcept { return _obj; }
+  T &operator*() const noexcept { return *_obj; }
+
+  // A counted reference, usable anywhere.
+  ref_ptr<T> share() const noexcept {
+    if (!_obj)
+      return nullptr;
+    deferred_counts::local().ref_now(_obj->cnt());
+    return ref_ptr<T>(_obj);
+  }
+  operator ref_ptr<T>() const noexcept { return share(); }
+  operator obs_ptr<T>() const noexcept { return obs_ptr<T>(_obj); }
+
+  bool operator==(const deferred_ref_ptr &o) const noexcept {
+    return _obj == o._obj;
+  }
+
+private:
+  T *_obj{nullptr};
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+// NUMA-aware placement of objects and their control blocks.
+//
+// numa_allocator keeps one slab_allocator per NUMA node, each binding its
+// spans to that node, and places the object and the control block on
+//   - the node of the CPU the creating thread runs on, by default
+//   - a fixed node, with numa_allocator(node)
+// so the counter updates of a thread on that node stay in local memory.
+//
+// Nodes are those the process may allocate on (get_mempolicy with
+// MPOL_F_MEMS_ALLOWED), so numactl --membind/--cpunodebind restrict it as
+// expected. With fewer than two such nodes, or a kernel without NUMA
+// support, spans are not bound and the allocator behaves as slab_allocator.
+// A requested node outside the allowed set places on the creating thread's
+// node.
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+#include "ref_ptr_slab.h"
+
+// NUMA nodes the calling process may allocate on, ascending. Empty when the
+// kernel has no NUMA support.
+inline const std::vector<int> &numa_nodes() {
+  static const std::vector<int> nodes = [] {
+    constexpr size_t BITS = 8 * sizeof(unsigned long);
+    constexpr size_t MAX_NODES = slab_allocator::MAX_NODES;
+    unsigned long mask[MAX_NODES / BITS] = {};
+    std::vector<int> allowed;
+    if (syscall(SYS_get_mempolicy, nullptr, mask, MAX_NODES + 1, nullptr,
+                MPOL_F_MEMS_ALLOWED) != 0)
+      return allowed;
+    for (size_t n = 0; n < MAX_NODES; n++) {
+      if (mask[n / BITS] & (1UL << (n % BITS)))
+        allowed.push_back(int(n));
+    }
+    return allowed;
+  }();
+  return nodes;
+}
+
+// Node of the CPU the calling thread runs on, 0 when unknown.
+inline int numa_current_node() {
+  unsigned cpu = 0, node = 0;
+  if (getcpu(&cpu, &node) != 0)
+    return 0;
+  return int(node);
+}
+
+// Node holding the page at `p`, faulting it in if needed. -1 when unknown.
+inline int numa_node_of(const void *p) {
+  int node = -1;
+  if (syscall(SYS_get_mempolicy, &node, nullptr, 0, p,
+              MPOL_F_NODE | MPOL_F_ADDR) != 0)
+    return -1;
+  return node;
+}
+
+class numa_allocator {
+public:
+  numa_allocator() : numa_allocator(-1) {}
+
+  // Places on `node`; -1 for the creating thread's node.
+  explicit numa_allocator(int node) {
+    const auto &nodes = numa_nodes();
+    if (nodes.size() < 2) {
+      _slabs.push_back(std::make_unique<slab_allocator>());
+      _any = _slabs[0].get();
+      return;
+    }
+    _slabs.resize(size_t(nodes.back()) + 1);
+    for (int n : nodes)
+      _slabs[n] = std::make_unique<slab_allocator>(n);
+    _any = _slabs[nodes.front()].get();
+    if (node >= 0 && size_t(node) < _slabs.size() && _slabs[node])
+      _fixed = _slabs[node].get();
+  }
+
+  numa_allocator(const numa_allocator &) = delete;
+  numa_allocator &operator=(const numa_allocator &) = delete;
+
+  // Frees from the spans of any node without the allocator, so objects may
+  // outlive it as with slab_allocator.
+  using free_type = slab_allocator::free_type;
+
+  void *alloc(size_t size) { return slab().alloc(size); }
+  void dealloc(void *ptr) { free_type().dealloc(ptr); }
+
+  void *alloc_block(size_t size, size_t align) {
+    return slab().alloc_block(size, align);
+  }
+  void dealloc_block(void *ptr) { free_type().dealloc_block(ptr); }
+
+  // Whether allocations are bound to nodes at all.
+  bool numa() const { return _slabs.size() > 1; }
+
+private:
+  slab_allocator &slab() {
+    if (_fixed)
+      return *_fixed;
+    if (_slabs.size() == 1)
+      return *_slabs[0];
+    const auto node = size_t(numa_current_node());
+    if (node < _slabs.size() && _slabs[node])
+      return *_slabs[node];
+    // Running on a node outside the allowed set.
+    return *_any;
+  }
+
+  std::vector<std::unique_ptr<slab_allocator>> _slabs;
+  slab_allocator *_fixed{nullptr};
+  slab_allocator *_any{nullptr};
+};
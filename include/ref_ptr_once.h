@@ -0,0 +1,75 @@
+#pragma once
+
+// Lazily built shared instances.
+//
+// once_ref<T> builds its object on first use and then hands out borrowed
+// references with one acquire load:
+//
+//   static once_ref<Service> service;
+//   Service &s = service.get([] { return make_ref<Service>(); });
+//
+// There is no lock and no once flag. Threads that find it empty all call
+// make, the first to publish its object wins, and the others drop theirs.
+// make may thus run more than once, and the extra objects must be safe to
+// throw away. A make that returns null throws std::runtime_error and leaves
+// the once_ref empty. share() hands out a counted ref_ptr instead.
+//
+// References from get() stay valid while the once_ref lives. A
+// once_ref<T, true> is immortal: it never drops its reference, so they stay
+// valid during static destruction too, and the object's count never
+// reaches zero.
+
+#include <atomic>
+#include <stdexcept>
+#include <utility>
+
+#include "ref_ptr.h"
+
+template <typename T, bool Immortal = false> class once_ref {
+public:
+  once_ref() noexcept = default;
+  once_ref(const once_ref &) = delete;
+  once_ref &operator=(const once_ref &) = delete;
+
+  ~once_ref() {
+    if constexpr (!Immortal) {
+      if (auto obj = _obj.load(std::memory_order_acquire))
+        obj->cnt()->deref();
+    }
+  }
+
+  // The object, built by make() (returning a ref_ptr) if there is none yet.
+  template <typename Make> T &get(Make &&make) {
+    if (auto obj = _obj.load(std::memory_order_acquire))
+      return *obj;
+    return build(std::forward<Make>(make));
+  }
+
+  template <typename Make> ref_ptr<T> share(Make &&make) {
+    T &obj = get(std::forward<Make>(make));
+    obj.cnt()->ref();
+    return ref_ptr<T>(&obj);
+  }
+
+  // The object, null before the first get().
+  T *peek() const noexcept { return _obj.load(std::memory_order_acquire); }
+
+private:
+  template <typename Make> T &build(Make &&make) {
+    ref_ptr<T> made = make();
+    if (!made)
+      throw std::runtime_error("once_ref: make returned null");
+    T *expected = nullptr;
+    if (_obj.compare_exchange_strong(expected, made.get(),
+                                     std::memory_order_acq_rel,
+                                     std::memory_order_acquire)) {
+      // The once_ref keeps the reference.
+      T *obj = made.obj;
+      made.obj = nullptr;
+      return *obj;
+    }
+    return *expected;
+  }
+
+  std::atomic<T *> _obj{nullptr};
+};
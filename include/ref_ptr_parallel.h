@@ -0,0 +1,105 @@
+#pragma once
+
+// Parallel release of large ranges of ref_ptr.
+//
+// Dropping millions of uniquely owned objects runs one deref() and one
+// destructor after another. parallel_release splits a contiguous range into
+// chunks of `grain` elements, hands them to an executor and releases the
+// chunks concurrently, leaving every element null:
+//
+//   thread_pool pool(4);                 // utils/thread_pool.h
+//   size_t freed = parallel_release(cache_entries, pool);
+//   cache_entries.clear();               // only null pointers left
+//
+// The executor is anything with append_task(f), e.g. thread_pool. The
+// calling thread releases chunks too and then waits for this call's chunks
+// only, never for the executor's other tasks, so parallel_release may run
+// inside one of the executor's own tasks.
+//
+// Within a chunk the objects and then their control blocks are prefetched
+// ahead of the decrements, so the cache misses of consecutive elements
+// overlap. The return value counts the references that were the last strong
+// one, i.e. the objects destroyed; objects also owned elsewhere survive.
+//
+// Destructors run on the executor's threads and the caller's, so the
+// objects' allocators must allow freeing from any thread. A range below
+// `grain` elements is released on the calling thread; a grain of 0 is taken
+// as 1.
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <ranges>
+
+#include "ref_ptr.h"
+
+// Distances, in elements, at which objects and control blocks are
+// prefetched. cnt() reads the object, so it is fetched first.
+constexpr size_t RELEASE_PREFETCH_OBJECT = 16;
+constexpr size_t RELEASE_PREFETCH_BLOCK = 8;
+
+namespace parallel_detail {
+// Releases [first, last), returns the number of objects destroyed.
+template <typename T>
+size_t release_chunk(ref_ptr<T> *first, ref_ptr<T> *last) {
+  const auto n = size_t(last - first);
+  size_t destroyed = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (i + RELEASE_PREFETCH_OBJECT < n) {
+      if (auto obj = first[i + RELEASE_PREFETCH_OBJECT].obj)
+        __builtin_prefetch(obj, 0);
+    }
+    if (i + RELEASE_PREFETCH_BLOCK < n) {
+      if (auto obj = first[i + RELEASE_PREFETCH_BLOCK].obj)
+        __builtin_prefetch(obj->cnt(), 1);
+    }
+    if (auto obj = first[i].obj) {
+      first[i].obj = nullptr;
+      destroyed += obj->cnt()->deref() == 0;
+    }
+  }
+  return destroyed;
+}
+} // namespace parallel_detail
+
+template <std::ranges::contiguous_range Range, typename Executor>
+size_t parallel_release(Range &&range, Executor &executor,
+                        size_t grain = 1 << 14) {
+  if (grain == 0)
+    grain = 1;
+  auto first = std::ranges::data(range);
+  const auto n = size_t(std::ranges::size(range));
+  if (n <= grain)
+    return parallel_detail::release_chunk(first, first + n);
+
+  // Chunks are claimed from a counter by the tasks and the caller. A task
+  // that starts after the call returned claims nothing, but still reads
+  // the counter, so the state is shared with the tasks.
+  struct State {
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+    std::atomic<size_t> destroyed{0};
+  };
+  auto state = std::make_shared<State>();
+  const size_t chunks = (n + grain - 1) / grain;
+  auto run = [state, first, n, grain, chunks] {
+    size_t c;
+    while ((c = state->next.fetch_add(1, std::memory_order_relaxed)) <
+           chunks) {
+      const auto begin = c * grain;
+      const auto end = begin + grain < n ? begin + grain : n;
+      state->destroyed.fetch_add(
+          parallel_detail::release_chunk(first + begin, first + end),
+          std::memory_order_relaxed);
+      if (state->done.fetch_add(1, std::memory_order_acq_rel) + 1 == chunks)
+        state->done.notify_all();
+    }
+  };
+  for (size_t c = 1; c < chunks; c++)
+    executor.append_task(run);
+  run();
+  for (auto done = state->done.load(std::memory_order_acquire);
+       done < chunks; done = state->done.load(std::memory_order_acquire))
+    state->done.wait(done, std::memory_order_acquire);
+  return state->destroyed.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+// Bounded lock-free MPMC queue of ref_ptr<T>.
+//
+// A cell array with per-cell sequence numbers (D. Vyukov's bounded MPMC
+// queue). Only the raw pointer travels through the queue: push takes the
+// reference out of the caller's ref_ptr and pop hands it to the receiver's,
+// so a message costs no ref/deref pair. The bulk operations claim up to n
+// consecutive cells with a single CAS.
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "ref_ptr.h"
+
+template <typename T> class ref_ptr_queue {
+public:
+  // capacity is rounded up to a power of two.
+  explicit ref_ptr_queue(size_t capacity)
+      : _mask(std::max<size_t>(std::bit_ceil(capacity), 2) - 1),
+        _cells(new Cell[_mask + 1]) {
+    for (size_t i = 0; i <= _mask; i++)
+      _cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  ref_ptr_queue(const ref_ptr_queue &) = delete;
+  ref_ptr_queue &operator=(const ref_ptr_queue &) = delete;
+
+  // Releases the references still queued.
+  ~ref_ptr_queue() {
+    ref_ptr<T> p;
+    while (try_pop(p))
+      p.reset();
+  }
+
+  size_t capacity() const { return _mask + 1; }
+
+  // Moves p into the queue; p is left untouched when the queue is full.
+  bool try_push(ref_ptr<T> &&p) { return try_push_bulk(&p, 1) == 1; }
+
+  bool try_pop(ref_ptr<T> &out) { return try_pop_bulk(&out, 1) == 1; }
+
+  // Moves up to n pointers from first[0..n) into the queue, in order, and
+  // returns how many; the rest are left untouched.
+  size_t try_push_bulk(ref_ptr<T> *first, size_t n) {
+    if (n == 0)
+      return 0;
+    size_t pos = _tail.load(std::memory_order_relaxed);
+    size_t k;
+    for (;;) {
+      k = ready(pos, n, 0);
+      if (k == 0) {
+        // Either full or another producer got ahead of us.
+        const auto seq = sequence(pos);
+        if (intptr_t(seq - pos) < 0)
+          return 0;
+        pos = _tail.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (_tail.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed))
+        break;
+    }
+    for (size_t i = 0; i < k; i++) {
+      auto &cell = _cells[(pos + i) & _mask];
+      cell.obj = first[i].obj;
+      first[i].obj = nullptr;
+      cell.seq.store(pos + i + 1, std::memory_order_release);
+    }
+    return k;
+  }
+
+  // Moves up to n pointers out of the queue into out[0..n), releasing what
+  // out held, and returns how many.
+  size_t try_pop_bulk(ref_ptr<T> *out, size_t n) {
+    if (n == 0)
+      return 0;
+    size_t pos = _head.load(std::memory_order_relaxed);
+    size_t k;
+    for (;;) {
+      k = ready(pos, n, 1);
+      if (k == 0) {
+        const auto seq = sequence(pos);
+        if (intptr_t(seq - (pos + 1)) < 0)
+          return 0;
+        pos = _head.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (_head.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed))
+        break;
+    }
+    for (size_t i = 0; i < k; i++) {
+      auto &cell = _cells[(pos + i) & _mask];
+      T *obj = cell.obj;
+      cell.seq.store(pos + i + _mask + 1, std::memory_order_release);
+      out[i] = ref_ptr<T>(obj);
+    }
+    return k;
+  }
+
+  // Approximate, for monitoring.
+  size_t size_approx() const {
+    const auto tail = _tail.load(std::memory_order_relaxed);
+    const auto head = _head.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T *obj{nullptr};
+  };
+
+  size_t sequence(size_t pos) const {
+    return _cells[pos & _mask].seq.load(std::memory_order_acquire);
+  }
+
+  // Number of consecutive cells from pos, at most n, whose sequence is
+  // pos + i + offset: free cells for offset 0, filled ones for offset 1.
+  size_t ready(size_t pos, size_t n, size_t offset) const {
+    n = std::min(n, _mask + 1);
+    size_t k = 0;
+    while (k < n && sequence(pos + k) == pos + k + offset)
+      k++;
+    return k;
+  }
+
+  const size_t _mask;
+  std::unique_ptr<Cell[]> _cells;
+  alignas(hardware_destructive_interference_size) std::atomic<size_t> _tail{0};
+  alignas(hardware_destructive_interference_size) std::atomic<size_t> _head{0};
+};
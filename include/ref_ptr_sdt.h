@@ -0,0 +1,100 @@
+#pragma once
+
+// Static tracepoints (USDT) for the reference counting hot path.
+//
+// Every probe is a single `nop` plus an ELF note in `.note.stapsdt`, so it
+// costs nothing measurable until a tracer (bpftrace, perf, systemtap) attaches
+// to it:
+//
+//   bpftrace -e 'usdt:./app:ref_ptr:make { printf("%s\n", str(arg2)); }'
+//   perf buildid-cache --add ./app && perf list sdt_ref_ptr:*
+//
+// Probes are taken from <sys/sdt.h> when it is available. Otherwise the
+// minimal note emitter below is used on x86-64 and AArch64 Linux, and the
+// probes compile to nothing everywhere else. Define REF_PTR_DISABLE_PROBES to
+// remove them entirely.
+
+#if defined(REF_PTR_DISABLE_PROBES)
+#define REF_PTR_HAS_PROBES 0
+#elif defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define REF_PTR_HAS_PROBES 1
+#define REF_PTR_PROBE1(name, a0) DTRACE_PROBE1(ref_ptr, name, a0)
+#define REF_PTR_PROBE2(name, a0, a1) DTRACE_PROBE2(ref_ptr, name, a0, a1)
+#define REF_PTR_PROBE3(name, a0, a1, a2)                                       \
+  DTRACE_PROBE3(ref_ptr, name, a0, a1, a2)
+#endif
+#endif
+
+#if !defined(REF_PTR_HAS_PROBES) && defined(__linux__) &&                      \
+    (defined(__GNUC__) || defined(__clang__)) &&                               \
+    (defined(__x86_64__) || defined(__aarch64__))
+#define REF_PTR_HAS_PROBES 1
+
+// Argument spec is "<signed size>@<operand>", e.g. "-4@%edx 8@%rdi".
+#define REF_PTR_SDT_ARG(n) "%c[s" #n "]@%[a" #n "]"
+#define REF_PTR_SDT_OPERAND(n, v)                                              \
+  [s##n] "n"(ref_ptr_sdt::arg_size<decltype(v)>()), [a##n] "nor"(v)
+
+#define REF_PTR_SDT_NOTE(name, args)                                           \
+  "990: nop\n"                                                                 \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                \
+  ".balign 4\n"                                                                \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                           \
+  "991: .asciz \"stapsdt\"\n"                                                  \
+  "992: .balign 4\n"                                                           \
+  "993: .8byte 990b\n"                                                         \
+  ".8byte _.stapsdt.base\n"                                                    \
+  ".8byte 0\n"                                                                 \
+  ".asciz \"ref_ptr\"\n"                                                       \
+  ".asciz \"" #name "\"\n"                                                     \
+  ".asciz \"" args "\"\n"                                                      \
+  "994: .balign 4\n"                                                           \
+  ".popsection\n"                                                              \
+  ".ifndef _.stapsdt.base\n"                                                   \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"      \
+  ".weak _.stapsdt.base\n"                                                     \
+  ".hidden _.stapsdt.base\n"                                                   \
+  "_.stapsdt.base: .space 1\n"                                                 \
+  ".size _.stapsdt.base, 1\n"                                                  \
+  ".popsection\n"                                                              \
+  ".endif\n"
+
+#define REF_PTR_PROBE1(name, a0)                                               \
+  __asm__ __volatile__(REF_PTR_SDT_NOTE(name, REF_PTR_SDT_ARG(0))              \
+                       :                                                       \
+                       : REF_PTR_SDT_OPERAND(0, a0))
+#define REF_PTR_PROBE2(name, a0, a1)                                           \
+  __asm__ __volatile__(                                                        \
+      REF_PTR_SDT_NOTE(name, REF_PTR_SDT_ARG(0) " " REF_PTR_SDT_ARG(1))        \
+      :                                                                        \
+      : REF_PTR_SDT_OPERAND(0, a0), REF_PTR_SDT_OPERAND(1, a1))
+#define REF_PTR_PROBE3(name, a0, a1, a2)                                       \
+  __asm__ __volatile__(                                                        \
+      REF_PTR_SDT_NOTE(name, REF_PTR_SDT_ARG(0) " " REF_PTR_SDT_ARG(           \
+                                 1) " " REF_PTR_SDT_ARG(2))                    \
+      :                                                                        \
+      : REF_PTR_SDT_OPERAND(0, a0), REF_PTR_SDT_OPERAND(1, a1),                \
+        REF_PTR_SDT_OPERAND(2, a2))
+
+#include <type_traits>
+
+namespace ref_ptr_sdt {
+template <typename T> constexpr int arg_size() {
+  using U = std::decay_t<T>;
+  constexpr int size = std::is_pointer_v<U> ? 8 : int(sizeof(U));
+  return std::is_signed_v<U> ? -size : size;
+}
+} // namespace ref_ptr_sdt
+#endif
+
+#ifndef REF_PTR_HAS_PROBES
+#define REF_PTR_HAS_PROBES 0
+#endif
+
+#if !REF_PTR_HAS_PROBES
+#define REF_PTR_PROBE1(name, a0)
+#define REF_PTR_PROBE2(name, a0, a1)
+#define REF_PTR_PROBE3(name, a0, a1, a2)
+#endif
@@ -0,0 +1,85 @@
+#pragma once
+
+// Conversions between ref_ptr and std::shared_ptr for APIs that take the
+// latter.
+//
+// to_shared_ptr() hands a reference to a shared_ptr whose deleter derefs the
+// RefCntImpl: one control block allocation, and no count traffic when the
+// ref_ptr is moved in. Objects deriving from enable_shared_from_ref<T> also
+// cache that control block, so converting the same object again while a
+// shared_ptr to it is alive allocates nothing and leaves the intrusive count
+// alone.
+//
+// from_shared_ptr() goes back to a ref_ptr with a single ref() for
+// shared_ptrs made by to_shared_ptr(); other shared_ptrs do not own a
+// reference to the intrusive count and give null.
+
+#include <memory>
+#include <type_traits>
+
+#include "ref_ptr.h"
+
+// Deleter of the shared_ptrs made by to_shared_ptr().
+struct ref_ptr_deleter {
+  template <typename T> void operator()(T *obj) const {
+    if (obj)
+      obj->cnt()->deref();
+  }
+};
+
+template <typename T> class enable_shared_from_ref {
+protected:
+  enable_shared_from_ref() = default;
+  enable_shared_from_ref(const enable_shared_from_ref &) {}
+  enable_shared_from_ref &operator=(const enable_shared_from_ref &) {
+    return *this;
+  }
+
+private:
+  template <typename U>
+  friend std::shared_ptr<U> share_ref(U *obj, bool owned);
+  SpinLock _shared_lock;
+  std::weak_ptr<T> _shared;
+};
+
+// obj is non-null; owned says whether the caller's reference is handed over.
+template <typename T> std::shared_ptr<T> share_ref(T *obj, bool owned) {
+  if constexpr (std::is_base_of_v<enable_shared_from_ref<T>, T>) {
+    auto &cache = static_cast<enable_shared_from_ref<T> &>(*obj);
+    std::lock_guard<SpinLock> lk(cache._shared_lock);
+    if (auto shared = cache._shared.lock()) {
+      if (owned)
+        obj->cnt()->deref();
+      return shared;
+    }
+    if (!owned)
+      obj->cnt()->ref();
+    std::shared_ptr<T> shared(obj, ref_ptr_deleter());
+    cache._shared = shared;
+    return shared;
+  } else {
+    if (!owned)
+      obj->cnt()->ref();
+    return std::shared_ptr<T>(obj, ref_ptr_deleter());
+  }
+}
+
+template <typename T> std::shared_ptr<T> to_shared_ptr(ref_ptr<T> &&ref) {
+  if (!ref)
+    return nullptr;
+  T *obj = ref.obj;
+  ref.obj = nullptr;
+  return share_ref(obj, true);
+}
+
+template <typename T> std::shared_ptr<T> to_shared_ptr(const ref_ptr<T> &ref) {
+  return ref ? share_ref(ref.obj, false) : nullptr;
+}
+
+template <typename T>
+ref_ptr<T> from_shared_ptr(const std::shared_ptr<T> &shared) {
+  if (!shared || !std::get_deleter<ref_ptr_deleter>(shared))
+    return nullptr;
+  shared->cnt()->ref();
+  return ref_ptr<T>(shared.get());
+}
@@ -0,0 +1,781 @@
+#pragma once
+
+// Reference counted objects shared between processes through a POSIX shared
+// memory segment.
+//
+// shm_segment maps a segment made with shm_open and allocates from it
+// (alloc/dealloc, so it is also an AllocatorType). shm_make<T>() places an
+// object right behind a shm_block control block. The block has no vtable and
+// no process addresses: the object's destructor is found by type in a
+// per-process registry, and shm_ref_ptr/shm_obs_ptr hold self-relative
+// offsets, valid wherever each process maps the segment. T must be usable
+// from every process that maps it: no process-local pointers, and for
+// references to other shared objects, shm_ref_ptr members.
+//
+// Counts are split by the process slot that holds the reference. A
+// reference stored inside the segment belongs to the segment itself. When a
+// process dies, reap() run by any survivor releases what its slot held; a
+// process killed in the middle of a count update at worst leaks that object,
+// it never frees one that is still referenced.
+//
+// A slot records its process's pid, start time and pid namespace, so that a
+// later process given the same pid is not taken for it. Holders in another
+// pid namespace are left to reapers in theirs, and a holder whose start time
+// cannot be read (/proc mounted with hidepid) is only reaped once its pid is
+// gone.
+//
+// Processes attach with the segment's name. A child made with fork() must
+// open the segment again instead of using the parent's mapping. Local
+// shm_ref_ptr/shm_obs_ptr must be released before their process's
+// shm_segment is destroyed: the segment then releases what they still
+// hold, and releasing one of them afterwards aborts.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ref_ptr.h"
+
+#ifndef REF_PTR_SHM_MAX_PROCESSES
+#define REF_PTR_SHM_MAX_PROCESSES 16
+#endif
+
+template <typename T> class shm_ref_ptr;
+template <typename T> class shm_obs_ptr;
+
+// Control block, followed by the object. The strong references share one
+// weak reference, as in RefCntImpl.
+struct shm_block {
+  static constexpr int MAX_PROCESSES = REF_PTR_SHM_MAX_PROCESSES;
+  // Slot of the references stored in the segment.
+  static constexpr int SEGMENT = -1;
+
+  std::atomic<int32_t> strong{1};
+  std::atomic<int32_t> weak{1};
+  uint64_t type;
+  // References held by each process slot: strong in the low 32 bits, weak
+  // in the high ones.
+  std::atomic<uint64_t> held[MAX_PROCESSES]{};
+
+  explicit shm_block(uint64_t type) : type(type) {}
+
+  static constexpr size_t object_offset() {
+    return (sizeof(shm_block) + 15) / 16 * 16;
+  }
+  void *object() {
+    return reinterpret_cast<uint8_t *>(this) + object_offset();
+  }
+};
+
+// Destructors of the types made by shm_make, by a hash of the type name.
+// Processes running the same binary register the same types at startup.
+class shm_types {
+public:
+  using destroy_fn = void (*)(void *);
+
+  template <typename T> static uint64_t add() {
+    // FNV-1a
+    uint64_t id = 0xcbf29ce484222325ull;
+    for (auto p = typeid(T).name(); *p; p++)
+      id = (id ^ uint8_t(*p)) * 0x100000001b3ull;
+    std::lock_guard<std::mutex> lk(registry().mut);
+    registry().types[id] = [](void *obj) { static_cast<T *>(obj)->~T(); };
+    return id;
+  }
+
+  static destroy_fn find(uint64_t id) {
+    std::lock_guard<std::mutex> lk(registry().mut);
+    auto it = registry().types.find(id);
+    return it == registry().types.end() ? nullptr : it->second;
+  }
+
+private:
+  struct Registry {
+    std::mutex mut;
+    std::unordered_map<uint64_t, destroy_fn> types;
+  };
+  static Registry &registry() {
+    static Registry r;
+    return r;
+  }
+};
+
+template <typename T> inline const uint64_t shm_type_id = shm_types::add<T>();
+
+class shm_segment {
+public:
+  static constexpr int MAX_PROCESSES = shm_block::MAX_PROCESSES;
+
+  // Creates the segment name of size bytes; fails if it exists.
+  shm_segment(const char *name, size_t size) {
+    _fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (_fd < 0)
+      throw std::system_error(errno, std::generic_category(), "shm_open");
+    if (ftruncate(_fd, off_t(size)) != 0) {
+      const int err = errno;
+      ::close(_fd);
+      shm_unlink(name);
+      throw std::system_error(err, std::generic_category(), "ftruncate");
+    }
+    map(size);
+    auto h = new (_base) Header;
+    h->size = size;
+    h->top = FIRST_CHUNK;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&h->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    h->magic.store(MAGIC, std::memory_order_release);
+    attach();
+  }
+
+  // Opens an existing segment.
+  explicit shm_segment(const char *name) {
+    _fd = shm_open(name, O_RDWR, 0600);
+    if (_fd < 0)
+      throw std::system_error(errno, std::generic_category(), "shm_open");
+    struct stat st;
+    if (fstat(_fd, &st) != 0 || size_t(st.st_size) < FIRST_CHUNK) {
+      ::close(_fd);
+      throw std::system_error(EINVAL, std::generic_category(), "shm_segment");
+    }
+    map(size_t(st.st_size));
+    if (header()->magic.load(std::memory_order_acquire) != MAGIC) {
+      unmap();
+      throw std::system_error(EINVAL, std::generic_category(), "shm_segment");
+    }
+    attach();
+  }
+
+  // Releases the references this process still holds. Its local pointers
+  // must be gone by now: one released later finds no segment and aborts.
+  ~shm_segment() {
+    release_slot(_slot);
+    free_holder(_slot);
+    unmap();
+  }
+
+  shm_segment(const shm_segment &) = delete;
+  shm_segment &operator=(const shm_segment &) = delete;
+
+  static void unlink(const char *name) { shm_unlink(name); }
+
+  void *alloc(size_t size) { return payload(carve(size, RAW)); }
+  void dealloc(void *ptr) {
+    if (ptr)
+      release_chunk(chunk_of(ptr));
+  }
+
+  bool contains(const void *p) const {
+    const auto a = reinterpret_cast<uintptr_t>(p);
+    const auto base = reinterpret_cast<uintptr_t>(_base);
+    return a >= base && a < base + _size;
+  }
+
+  // The slot of this process.
+  int slot() const { return _slot; }
+
+  // Objects whose destructor this process could not find; they stay
+  // allocated.
+  size_t leaked() const {
+    return header()->leaked.load(std::memory_order_relaxed);
+  }
+
+  // Publishes root for the other processes; the segment keeps a reference.
+  template <typename T> void set_root(const shm_ref_ptr<T> &root) {
+    auto b = root.block();
+    if (b)
+      ref(b, shm_block::SEGMENT);
+    uint64_t old;
+    {
+      Guard g(header());
+      old = header()->root;
+      header()->root = b ? offset(b) : 0;
+    }
+    if (old)
+      deref(block_at(old), shm_block::SEGMENT);
+  }
+
+  template <typename T> shm_ref_ptr<T> root() const {
+    shm_ref_ptr<T> r;
+    Guard g(header());
+    if (const auto off = header()->root) {
+      auto b = block_at(off);
+      ref(b, r.holder_slot(b));
+      r.set(b);
+    }
+    return r;
+  }
+
+  // Releases the references held by processes that exited without
+  // detaching, and frees their slots. Returns how many were reaped.
+  size_t reap() {
+    size_t reaped = 0;
+    const auto ns = pid_namespace();
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+      auto &holder = header()->holders[i];
+      auto id = holder.id.load(std::memory_order_acquire);
+      if (pid_of(id) <= 0 || !holder_dead(holder, pid_of(id), ns))
+        continue;
+      // Claim the slot so that no other reaper or new process takes it. The
+      // generation fails the claim if the slot was taken again meanwhile.
+      if (!holder.id.compare_exchange_strong(id, (id & GENERATION) |
+                                                     uint32_t(REAPING)))
+        continue;
+      release_slot(i);
+      free_holder(i);
+      reaped++;
+    }
+    return reaped;
+  }
+
+  // The attached segment containing p.
+  static shm_segment *find(const void *p) {
+    for (auto &s : attached()) {
+      auto seg = s.load(std::memory_order_acquire);
+      if (seg && seg->contains(p))
+        return seg;
+    }
+    return nullptr;
+  }
+
+private:
+  template <typename T> friend class shm_ref_ptr;
+  template <typename T> friend class shm_obs_ptr;
+  template <typename T, typename... Args>
+  friend shm_ref_ptr<T> shm_make(shm_segment &seg, Args &&...args);
+
+  static constexpr uint64_t MAGIC = 0x7265665f73686d32ull; // "ref_shm2"
+  static constexpr int CLASSES = 48;
+  static constexpr size_t MIN_CHUNK = 32;
+  static constexpr pid_t REAPING = -1;
+  static constexpr uint64_t GENERATION = ~uint64_t(0xffffffffu);
+  // Start time of a holder without /proc, judged by its pid alone.
+  static constexpr uint64_t UNKNOWN_START = ~uint64_t(0);
+
+  enum EChunkKind : uint32_t { FREE, RAW, BLOCK };
+
+  struct Chunk {
+    uint32_t cls;
+    uint32_t kind;
+    uint64_t next; // next free chunk of the class
+  };
+  static_assert(sizeof(Chunk) == 16);
+
+  // The process attached to a slot. id has the pid in its low 32 bits, 0
+  // when the slot is free, and above them a generation counting the
+  // attaches. start (0 until recorded) and pidns tell the process from a
+  // later one with the same pid.
+  struct Holder {
+    std::atomic<uint64_t> id{0};
+    std::atomic<uint64_t> start{0};
+    std::atomic<uint64_t> pidns{0};
+  };
+
+  struct Header {
+    std::atomic<uint64_t> magic{0};
+    uint64_t size;
+    pthread_mutex_t mutex;
+    uint64_t top;             // end of the chunks carved so far
+    uint64_t free[CLASSES]{}; // free chunks by size class
+    uint64_t root{0}; // block of the root, under the lock
+    std::atomic<uint64_t> leaked{0};
+    Holder holders[MAX_PROCESSES];
+  };
+
+  static constexpr size_t FIRST_CHUNK = (sizeof(Header) + 63) / 64 * 64;
+
+  // Robust process-shared lock: a holder that died leaves the free lists
+  // consistent, since every update is a single store.
+  class Guard {
+  public:
+    explicit Guard(Header *h) : _h(h) {
+      if (pthread_mutex_lock(&_h->mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(&_h->mutex);
+    }
+    ~Guard() { pthread_mutex_unlock(&_h->mutex); }
+
+  private:
+    Header *_h;
+  };
+
+  static std::atomic<shm_segment *> (&attached())[8] {
+    static std::atomic<shm_segment *> segments[8];
+    return segments;
+  }
+
+  Header *header() const { return reinterpret_cast<Header *>(_base); }
+  uint64_t offset(const void *p) const {
+    return uint64_t(reinterpret_cast<const uint8_t *>(p) - _base);
+  }
+  Chunk *chunk_at(uint64_t off) const {
+    return reinterpret_cast<Chunk *>(_base + off);
+  }
+  shm_block *block_at(uint64_t off) const {
+    return reinterpret_cast<shm_block *>(_base + off);
+  }
+  static void *payload(Chunk *c) { return c + 1; }
+  static Chunk *chunk_of(void *p) { return static_cast<Chunk *>(p) - 1; }
+
+  void map(size_t size) {
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (p == MAP_FAILED) {
+      const int err = errno;
+      ::close(_fd);
+      throw std::system_error(err, std::generic_category(), "mmap");
+    }
+    _base = static_cast<uint8_t *>(p);
+    _size = size;
+  }
+
+  void unmap() {
+    for (auto &s : attached()) {
+      auto self = this;
+      s.compare_exchange_strong(self, nullptr);
+    }
+    munmap(_base, _size);
+    ::close(_fd);
+  }
+
+  void attach() {
+    const auto start = start_time(0);
+    const auto ns = pid_namespace();
+    for (bool reaped = false;; reaped = true) {
+      for (int i = 0; i < MAX_PROCESSES; i++) {
+        auto &holder = header()->holders[i];
+        auto id = holder.id.load(std::memory_order_relaxed);
+        const auto taken =
+            ((id & GENERATION) + (uint64_t(1) << 32)) | uint32_t(getpid());
+        if (pid_of(id) != 0 || !holder.id.compare_exchange_strong(id, taken))
+          continue;
+        // Reapers leave the slot alone until its start is stored.
+        holder.pidns.store(ns, std::memory_order_relaxed);
+        holder.start.store(start ? start : UNKNOWN_START,
+                           std::memory_order_release);
+        _slot = i;
+        for (auto &s : attached()) {
+          shm_segment *empty = nullptr;
+          if (s.compare_exchange_strong(empty, this))
+            return;
+        }
+        free_holder(i);
+        unmap();
+        throw std::system_error(EMFILE, std::generic_category(),
+                                "shm_segment");
+      }
+      if (reaped || reap() == 0) {
+        unmap();
+        throw std::system_error(EUSERS, std::generic_category(),
+                                "shm_segment");
+      }
+    }
+  }
+
+  static pid_t pid_of(uint64_t id) { return pid_t(uint32_t(id)); }
+
+  // Frees slot i for the next process, keeping its generation.
+  void free_holder(int i) {
+    auto &holder = header()->holders[i];
+    holder.start.store(0, std::memory_order_relaxed);
+    holder.pidns.store(0, std::memory_order_relaxed);
+    holder.id.store(holder.id.load(std::memory_order_relaxed) & GENERATION,
+                    std::memory_order_release);
+  }
+
+  // Whether the process recorded in holder, with pid pid, is gone. ns is the
+  // caller's pid namespace, in which pid means something else if it is not
+  // the holder's.
+  static bool holder_dead(const Holder &holder, pid_t pid, uint64_t ns) {
+    const auto start = holder.start.load(std::memory_order_acquire);
+    if (start == 0 || holder.pidns.load(std::memory_order_relaxed) != ns)
+      return false;
+    if (start != UNKNOWN_START) {
+      if (const auto now = start_time(pid))
+        return now != start;
+    }
+    return kill(pid, 0) != 0 && errno == ESRCH;
+  }
+
+  // Start time of process pid (0: this process) in clock ticks since boot,
+  // UNKNOWN_START for a zombie, 0 when /proc does not tell. A zombie no
+  // longer holds anything, so it never matches a recorded start.
+  static uint64_t start_time(pid_t pid) {
+    char path[32] = "/proc/self/stat";
+    if (pid)
+      std::snprintf(path, sizeof(path), "/proc/%d/stat", int(pid));
+    FILE *f = std::fopen(path, "r");
+    if (!f)
+      return 0;
+    char buf[512];
+    const size_t n = std::fread(buf, 1, sizeof(buf) - 1, f);
+    std::fclose(f);
+    buf[n] = '\0';
+    // The command name, in parentheses, may hold spaces and parentheses;
+    // then come the state (field 3) and 18 fields up to starttime (22).
+    const char *fields = std::strrchr(buf, ')');
+    char state = 0;
+    unsigned long long start = 0;
+    if (!fields || std::sscanf(fields + 1,
+                               " %c %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s"
+                               " %*s %*s %*s %*s %*s %*s %*s %*s %llu",
+                               &state, &start) != 2)
+      return 0;
+    return state == 'Z' || state == 'X' ? UNKNOWN_START : start;
+  }
+
+  static uint64_t pid_namespace() {
+    struct stat st;
+    return stat("/proc/self/ns/pid", &st) == 0 ? uint64_t(st.st_ino) : 0;
+  }
+
+  Chunk *carve(size_t size, EChunkKind kind) {
+    int cls = 0;
+    while ((MIN_CHUNK << cls) < size + sizeof(Chunk))
+      if (++cls == CLASSES)
+        throw std::bad_alloc();
+    auto h = header();
+    Guard g(h);
+    Chunk *c;
+    if (h->free[cls]) {
+      c = chunk_at(h->free[cls]);
+      h->free[cls] = c->next;
+    } else {
+      if (h->top + (MIN_CHUNK << cls) > h->size)
+        throw std::bad_alloc();
+      c = chunk_at(h->top);
+      c->cls = uint32_t(cls);
+      h->top += MIN_CHUNK << cls;
+    }
+    c->kind = kind;
+    return c;
+  }
+
+  void release_chunk(Chunk *c) {
+    auto h = header();
+    Guard g(h);
+    c->kind = FREE;
+    c->next = h->free[c->cls];
+    h->free[c->cls] = offset(c);
+  }
+
+  // Counting. slot is the holder's process slot, or SEGMENT. The total goes
+  // up before the process count and down after it, so a process dying
+  // between the two leaves the total too high, never too low.
+  static void ref(shm_block *b, int slot) {
+    b->strong.fetch_add(1, std::memory_order_relaxed);
+    if (slot != shm_block::SEGMENT)
+      b->held[slot].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static bool try_ref(shm_block *b, int slot) {
+    auto cnt = b->strong.load(std::memory_order_relaxed);
+    do {
+      if (cnt <= 0)
+        return false;
+    } while (!b->strong.compare_exchange_weak(cnt, cnt + 1,
+                                              std::memory_order_acquire,
+                                              std::memory_order_relaxed));
+    if (slot != shm_block::SEGMENT)
+      b->held[slot].fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  void deref(shm_block *b, int slot) {
+    if (slot != shm_block::SEGMENT)
+      b->held[slot].fetch_sub(1, std::memory_order_relaxed);
+    release_strong(b);
+  }
+
+  static void weak_ref(shm_block *b, int slot) {
+    b->weak.fetch_add(1, std::memory_order_relaxed);
+    if (slot != shm_block::SEGMENT)
+      b->held[slot].fetch_add(uint64_t(1) << 32, std::memory_order_relaxed);
+  }
+
+  void weak_deref(shm_block *b, int slot) {
+    if (slot != shm_block::SEGMENT)
+      b->held[slot].fetch_sub(uint64_t(1) << 32, std::memory_order_relaxed);
+    release_weak(b);
+  }
+
+  // Hands a reference over from one holder slot to another.
+  static void move(shm_block *b, int from, int to, uint64_t unit) {
+    if (from == to)
+      return;
+    if (to != shm_block::SEGMENT)
+      b->held[to].fetch_add(unit, std::memory_order_relaxed);
+    if (from != shm_block::SEGMENT)
+      b->held[from].fetch_sub(unit, std::memory_order_relaxed);
+  }
+
+  void release_strong(shm_block *b) {
+    if (b->strong.fetch_sub(1, std::memory_order_acq_rel) != 1)
+      return;
+    if (auto destroy = shm_types::find(b->type))
+      destroy(b->object());
+    else
+      header()->leaked.fetch_add(1, std::memory_order_relaxed);
+    release_weak(b);
+  }
+
+  void release_weak(shm_block *b) {
+    if (b->weak.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      release_chunk(chunk_of(b));
+  }
+
+  // Releases everything slot holds. Blocks are pinned with a weak
+  // reference while the chunks are walked under the lock, and released
+  // after it, since destructors free chunks.
+  void release_slot(int slot) {
+    struct Held {
+      shm_block *block;
+      uint64_t counts;
+    };
+    std::vector<Held> found;
+    {
+      auto h = header();
+      Guard g(h);
+      for (auto off = FIRST_CHUNK; off < h->top;) {
+        auto c = chunk_at(off);
+        off += MIN_CHUNK << c->cls;
+        if (c->kind != BLOCK)
+          continue;
+        auto b = static_cast<shm_block *>(payload(c));
+        if (b->held[slot].load(std::memory_order_relaxed) == 0)
+          continue;
+        auto weak = b->weak.load(std::memory_order_relaxed);
+        do {
+          if (weak <= 0)
+            break;
+        } while (!b->weak.compare_exchange_weak(weak, weak + 1));
+        if (weak <= 0)
+          continue;
+        found.push_back({b, b->held[slot].exchange(0)});
+      }
+    }
+    for (auto &f : found) {
+      for (auto n = f.counts & 0xffffffffu; n; n--)
+        release_strong(f.block);
+      for (auto n = f.counts >> 32; n; n--)
+        release_weak(f.block);
+      release_weak(f.block);
+    }
+  }
+
+  int _fd{-1};
+  uint8_t *_base{nullptr};
+  size_t _size{0};
+  int _slot{0};
+};
+
+// Common part of shm_ref_ptr and shm_obs_ptr: a self-relative offset to the
+// block, 0 for null.
+class shm_ptr_base {
+public:
+  shm_block *block() const {
+    return _off ? reinterpret_cast<shm_block *>(
+                      reinterpret_cast<intptr_t>(this) + _off)
+                : nullptr;
+  }
+
+protected:
+  void set(shm_block *b) {
+    _off = b ? reinterpret_cast<intptr_t>(b) - reinterpret_cast<intptr_t>(this)
+             : 0;
+  }
+
+  // The slot references held by this pointer are counted in.
+  int holder_slot(const shm_block *b) const {
+    auto seg = segment_of(b);
+    return seg->contains(this) ? shm_block::SEGMENT : seg->slot();
+  }
+
+  // The segment b is in. A pointer that outlived its segment's shm_segment
+  // has nowhere to count: abort with a message rather than crash on null.
+  static shm_segment *segment_of(const shm_block *b) noexcept {
+    auto seg = shm_segment::find(b);
+    if (!seg) {
+      std::fprintf(stderr,
+                   "shm_ref_ptr: block %p is in no attached shm_segment\n",
+                   static_cast<const void *>(b));
+      std::abort();
+    }
+    return seg;
+  }
+
+  intptr_t _off{0};
+};
+
+template <typename T> class shm_ref_ptr : public shm_ptr_base {
+public:
+  using element_type = T;
+
+  shm_ref_ptr() noexcept = default;
+  shm_ref_ptr(std::nullptr_t) noexcept {}
+
+  shm_ref_ptr(const shm_ref_ptr &o) noexcept { copy(o.block()); }
+
+  shm_ref_ptr(shm_ref_ptr &&o) noexcept { steal(o); }
+
+  shm_ref_ptr &operator=(const shm_ref_ptr &o) noexcept {
+    if (this != &o) {
+      auto b = o.block();
+      reset();
+      copy(b);
+    }
+    return *this;
+  }
+
+  shm_ref_ptr &operator=(shm_ref_ptr &&o) noexcept {
+    if (this != &o) {
+      reset();
+      steal(o);
+    }
+    return *this;
+  }
+
+  ~shm_ref_ptr() { reset(); }
+
+  T *get() const noexcept {
+    auto b = block();
+    return b ? static_cast<T *>(b->object()) : nullptr;
+  }
+  T *operator->() const noexcept { return get(); }
+  T &operator*() const noexcept { return *get(); }
+  explicit operator bool() const noexcept { return _off != 0; }
+
+  long use_count() const noexcept {
+    auto b = block();
+    return b ? b->strong.load(std::memory_order_relaxed) : 0;
+  }
+
+  void reset() noexcept {
+    if (auto b = block()) {
+      set(nullptr);
+      segment_of(b)->deref(b, holder_slot(b));
+    }
+  }
+
+  bool operator==(const shm_ref_ptr &o) const { return get() == o.get(); }
+  bool operator==(std::nullptr_t) const { return _off == 0; }
+
+private:
+  friend class shm_segment;
+  template <typename U> friend class shm_obs_ptr;
+  template <typename U, typename... Args>
+  friend shm_ref_ptr<U> shm_make(shm_segment &seg, Args &&...args);
+
+  void copy(shm_block *b) {
+    if (b) {
+      shm_segment::ref(b, holder_slot(b));
+      set(b);
+    }
+  }
+
+  void steal(shm_ref_ptr &o) {
+    if (auto b = o.block()) {
+      shm_segment::move(b, o.holder_slot(b), holder_slot(b), 1);
+      o.set(nullptr);
+      set(b);
+    }
+  }
+};
+
+template <typename T> class shm_obs_ptr : public shm_ptr_base {
+public:
+  using element_type = T;
+
+  shm_obs_ptr() noexcept = default;
+
+  shm_obs_ptr(const shm_ref_ptr<T> &r) noexcept { copy(r.block()); }
+  shm_obs_ptr(const shm_obs_ptr &o) noexcept { copy(o.block()); }
+  shm_obs_ptr(shm_obs_ptr &&o) noexcept {
+    if (auto b = o.block()) {
+      shm_segment::move(b, o.holder_slot(b), holder_slot(b), uint64_t(1)
+                                                                 << 32);
+      o.set(nullptr);
+      set(b);
+    }
+  }
+
+  shm_obs_ptr &operator=(const shm_obs_ptr &o) noexcept {
+    if (this != &o) {
+      auto b = o.block();
+      reset();
+      copy(b);
+    }
+    return *this;
+  }
+
+  ~shm_obs_ptr() { reset(); }
+
+  bool expired() const noexcept {
+    auto b = block();
+    return !b || b->strong.load(std::memory_order_relaxed) <= 0;
+  }
+
+  shm_ref_ptr<T> lock() const noexcept {
+    shm_ref_ptr<T> r;
+    if (auto b = block()) {
+      if (shm_segment::try_ref(b, r.holder_slot(b)))
+        r.set(b);
+    }
+    return r;
+  }
+
+  void reset() noexcept {
+    if (auto b = block()) {
+      set(nullptr);
+      segment_of(b)->weak_deref(b, holder_slot(b));
+    }
+  }
+
+private:
+  void copy(shm_block *b) {
+    if (b) {
+      shm_segment::weak_ref(b, holder_slot(b));
+      set(b);
+    }
+  }
+};
+
+// Constructs T in seg; the reference is held by the caller's process.
+template <typename T, typename... Args>
+shm_ref_ptr<T> shm_make(shm_segment &seg, Args &&...args) {
+  static_assert(alignof(T) <= 16);
+  auto chunk = seg.carve(shm_block::object_offset() + sizeof(T),
+                         shm_segment::BLOCK);
+  auto b = new (shm_segment::payload(chunk)) shm_block(shm_type_id<T>);
+  try {
+    new (b->object()) T(std::forward<Args>(args)...);
+  } catch (...) {
+    seg.release_chunk(chunk);
+    throw;
+  }
+  shm_ref_ptr<T> r;
+  const auto slot = r.holder_slot(b);
+  if (slot != shm_block::SEGMENT)
+    b->held[slot].store(1, std::memory_order_relaxed);
+  r.set(b);
+  return r;
+}
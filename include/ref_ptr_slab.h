@@ -0,0 +1,190 @@
+#pragma once
+
+// Region allocator for large populations of small ref-counted objects.
+//
+// Memory comes from SPAN_SIZE spans mapped with mmap, aligned to their size
+// and advised MADV_HUGEPAGE, so a traversal over millions of objects touches
+// few TLB entries. Allocations are bumped in order out of the current span of
+// the allocating thread's arena, and slab_allocator places control blocks
+// too (see BlockAllocator): objects made one after another sit next to each
+// other and to their control blocks.
+//
+// A span counts its live allocations and goes back to the OS with munmap when
+// the last one is freed. Freed memory is not reused before that, so the
+// allocator suits objects that are created and dropped in groups rather than
+// long-lived spans with a few survivors. Allocations above LARGE_SIZE get a
+// mapping of their own.
+//
+// Freeing only touches the span, so it needs no allocator: control blocks
+// free through the stateless slab_allocator::free_type (see allocator_free)
+// and objects may outlive the allocator.
+//
+// slab_allocator(node) binds its spans to a NUMA node with mbind before they
+// are touched (see numa_allocator in ref_ptr_numa.h).
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+#include "ref_ptr.h"
+
+class slab_allocator {
+public:
+  // Frees what any slab_allocator allocated, alive or not.
+  struct free_type {
+    void dealloc(void *ptr) { dealloc_block(ptr); }
+    void dealloc_block(void *ptr) {
+      if (ptr)
+        unref(span_of(ptr));
+    }
+  };
+
+  static constexpr size_t SPAN_SIZE = size_t(2) << 20;
+  static constexpr size_t LARGE_SIZE = SPAN_SIZE / 8;
+  static constexpr size_t ALIGN = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+  static constexpr size_t MAX_NODES = 1024;
+
+  slab_allocator() = default;
+  // Spans on NUMA node `node`, or wherever first touched for -1.
+  explicit slab_allocator(int node) : _node(node) {}
+  slab_allocator(const slab_allocator &) = delete;
+  slab_allocator &operator=(const slab_allocator &) = delete;
+
+  ~slab_allocator() {
+    for (auto &a : _arenas) {
+      if (a.span)
+        unref(a.span);
+    }
+  }
+
+  void *alloc(size_t size) { return alloc_block(size, ALIGN); }
+  void dealloc(void *ptr) { free_type().dealloc(ptr); }
+
+  void *alloc_block(size_t size, size_t align) {
+    align = std::max(align, ALIGN);
+    if (size + align > LARGE_SIZE)
+      return alloc_large(size, align);
+    auto &a = arena();
+    std::lock_guard<SpinLock> lk(a.lock);
+    auto top = a.span ? round_up(a.span->top, align) : SPAN_SIZE;
+    if (top + size > SPAN_SIZE) {
+      if (a.span)
+        unref(a.span);
+      a.span = map(SPAN_SIZE);
+      top = round_up(a.span->top, align);
+    }
+    a.span->top = top + size;
+    a.span->live.fetch_add(1, std::memory_order_relaxed);
+    return reinterpret_cast<uint8_t *>(a.span) + top;
+  }
+
+  void dealloc_block(void *ptr) { free_type().dealloc_block(ptr); }
+
+  // Bytes currently mapped by all slab allocators.
+  static size_t mapped_bytes() {
+    return mapped().load(std::memory_order_relaxed);
+  }
+
+private:
+  struct alignas(hardware_destructive_interference_size) Span {
+    // Live allocations, plus one while an arena allocates from the span.
+    std::atomic<size_t> live{1};
+    size_t size;
+    size_t top; // next free offset, under the arena lock
+  };
+
+  struct alignas(hardware_destructive_interference_size) Arena {
+    SpinLock lock;
+    Span *span{nullptr};
+  };
+
+  static constexpr size_t ARENAS = 8;
+
+  static size_t round_up(size_t n, size_t align) {
+    return (n + align - 1) & ~(align - 1);
+  }
+
+  static std::atomic<size_t> &mapped() {
+    static std::atomic<size_t> bytes{0};
+    return bytes;
+  }
+
+  // Allocations start within the first SPAN_SIZE bytes of their mapping,
+  // large ones included.
+  static Span *span_of(void *ptr) {
+    return reinterpret_cast<Span *>(reinterpret_cast<uintptr_t>(ptr) &
+                                    ~(SPAN_SIZE - 1));
+  }
+
+  // Threads spread over the arenas in the order they first allocate.
+  Arena &arena() {
+    static std::atomic<size_t> next{0};
+    static thread_local size_t index =
+        next.fetch_add(1, std::memory_order_relaxed) % ARENAS;
+    return _arenas[index];
+  }
+
+  void *alloc_large(size_t size, size_t align) {
+    auto span = map(round_up(round_up(sizeof(Span), align) + size, SPAN_SIZE));
+    const auto offset = round_up(span->top, align);
+    span->top = offset + size;
+    return reinterpret_cast<uint8_t *>(span) + offset;
+  }
+
+  // A span of size bytes, aligned to SPAN_SIZE, holding one reference.
+  Span *map(size_t size) {
+    // Over-map, then trim to the alignment.
+    const size_t length = size + SPAN_SIZE;
+    void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      throw std::bad_alloc();
+    const auto raw = reinterpret_cast<uintptr_t>(p);
+    const auto base = round_up(raw, SPAN_SIZE);
+    if (base > raw)
+      munmap(p, base - raw);
+    if (raw + length > base + size)
+      munmap(reinterpret_cast<void *>(base + size), raw + length - base - size);
+#ifdef MADV_HUGEPAGE
+    madvise(reinterpret_cast<void *>(base), size, MADV_HUGEPAGE);
+#endif
+    if (_node >= 0)
+      bind(reinterpret_cast<void *>(base), size, _node);
+    mapped().fetch_add(size, std::memory_order_relaxed);
+    auto span = new (reinterpret_cast<void *>(base)) Span;
+    span->size = size;
+    span->top = sizeof(Span);
+    return span;
+  }
+
+  // Preferred rather than strict: under memory pressure on the node the
+  // kernel falls back to another one instead of failing the fault.
+  static void bind(void *p, size_t size, int node) {
+    constexpr size_t BITS = 8 * sizeof(unsigned long);
+    unsigned long mask[MAX_NODES / BITS] = {};
+    if (size_t(node) >= MAX_NODES)
+      return;
+    mask[node / BITS] = 1UL << (node % BITS);
+    // maxnode counts one past the last bit the kernel reads.
+    syscall(SYS_mbind, p, size, MPOL_PREFERRED, mask, MAX_NODES + 1, 0);
+  }
+
+  static void unref(Span *span) {
+    if (span->live.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      const auto size = span->size;
+      munmap(span, size);
+      mapped().fetch_sub(size, std::memory_order_relaxed);
+    }
+  }
+
+  Arena _arenas[ARENAS];
+  int _node{-1};
+};
@@ -0,0 +1,507 @@
+#pragma once
+
+// Binary snapshots of ref_ptr/obs_ptr object graphs.
+//
+// save_snapshot() walks the objects strongly reachable from a root and
+// writes each one's fields through its snapshot(snapshot_writer &) member,
+// with ref_ptr and obs_ptr fields written as node indices, so shared nodes
+// stay shared and weak edges stay weak. Weak edges to objects outside the
+// strongly reachable set load as expired. Elements of vm_make_array()
+// arrays are not supported.
+//
+// load_snapshot() maps the file and builds the graph in one pass: all
+// control blocks and objects are placed in a single snapshot_arena laid out
+// by the writer, so every edge, forward ones included, is resolved before
+// its target is constructed, and the counts are preset from the in-degrees
+// instead of being incremented edge by edge. Objects are constructed with
+// T(refcnt, snapshot_reader &) and read their fields back in the order they
+// were written. The arena is freed when its last object and control block
+// are gone. A node table whose nodes overlap or leave the arena fails the
+// load before anything is built. A payload that is short, too long or holds
+// a bad node index or an offset outside its target fails it once every
+// object is built: the graph is destroyed, the arena freed and
+// std::runtime_error thrown. The loading constructors themselves must not
+// throw.
+//
+// Types are found by the hash of their type name: register each one with
+// snapshot_types<refcnt_type>::add<T>() in the saving and the loading
+// process, which must agree on the types' layout.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+#include "ref_ptr.h"
+
+template <typename RefCntType> class snapshot_writer;
+template <typename RefCntType> class snapshot_reader;
+template <typename T> ref_ptr<T> load_snapshot(const char *path);
+
+// Memory of a loaded snapshot. Unmapped when every object and control
+// block placed in it has been released.
+class snapshot_arena {
+public:
+  static snapshot_arena *create(size_t size, size_t allocations) {
+    void *p = mmap(nullptr, size ? size : 1, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+    return new snapshot_arena(static_cast<uint8_t *>(p), size, allocations);
+  }
+
+  uint8_t *data() const { return _base; }
+
+  // The arena is filled by the loader only.
+  void *alloc(size_t) { throw std::bad_alloc(); }
+  void *alloc_block(size_t, size_t) { throw std::bad_alloc(); }
+
+  void dealloc(void *) { release(); }
+  void dealloc_block(void *) { release(); }
+
+private:
+  template <typename T> friend ref_ptr<T> load_snapshot(const char *path);
+
+  snapshot_arena(uint8_t *base, size_t size, size_t allocations)
+      : _base(base), _size(size), _live(allocations) {}
+
+  // Frees the arena whatever is left in it, after a failed load.
+  void discard() {
+    munmap(_base, _size ? _size : 1);
+    delete this;
+  }
+
+  void release() {
+    if (_live.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      munmap(_base, _size ? _size : 1);
+      delete this;
+    }
+  }
+
+  uint8_t *_base;
+  size_t _size;
+  std::atomic<size_t> _live;
+};
+
+// Bytes of a control block placed in a snapshot_arena.
+template <typename RefCntType>
+inline constexpr size_t snapshot_block_size =
+    RefCntType::template block_size<snapshot_arena>();
+
+// Loadable types for control blocks of RefCntType.
+template <typename RefCntType> class snapshot_types {
+public:
+  struct Type {
+    size_t size;
+    size_t align;
+    void (*save)(const void *obj, snapshot_writer<RefCntType> &w);
+    void (*load)(void *place, RefCntType *cnt,
+                 snapshot_reader<RefCntType> &r);
+    void (*destroy)(void *obj);
+  };
+
+  template <typename T> static uint64_t add() {
+    static_assert(std::is_same_v<typename T::refcnt_type, RefCntType>);
+    const auto id = type_id(typeid(T));
+    std::lock_guard<std::mutex> lk(registry().mut);
+    registry().types[id] = {
+        sizeof(T), alignof(T),
+        [](const void *obj, snapshot_writer<RefCntType> &w) {
+          static_cast<const T *>(obj)->snapshot(w);
+        },
+        [](void *place, RefCntType *cnt, snapshot_reader<RefCntType> &r) {
+          auto obj = ::new (place) T(cnt, r);
+          cnt->init(r.arena(), obj);
+          REF_PTR_PROBE3(make, obj, cnt, ref_type_name<T>());
+        },
+        [](void *obj) { static_cast<T *>(obj)->~T(); }};
+    return id;
+  }
+
+  static const Type *find(uint64_t id) {
+    std::lock_guard<std::mutex> lk(registry().mut);
+    auto it = registry().types.find(id);
+    return it == registry().types.end() ? nullptr : &it->second;
+  }
+
+  static uint64_t type_id(const std::type_info &type) {
+    // FNV-1a
+    uint64_t id = 0xcbf29ce484222325ull;
+    for (auto p = type.name(); *p; p++)
+      id = (id ^ uint8_t(*p)) * 0x100000001b3ull;
+    return id;
+  }
+
+private:
+  struct Registry {
+    std::mutex mut;
+    std::unordered_map<uint64_t, Type> types;
+  };
+  static Registry &registry() {
+    static Registry r;
+    return r;
+  }
+};
+
+namespace snapshot_format {
+constexpr uint64_t MAGIC = 0x72656670736e6170ull; // "refpsnap"
+constexpr uint32_t VERSION = 1;
+
+struct Header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t cnt_size; // sizeof the control block type
+  uint64_t nodes;
+  uint64_t arena_size;
+  uint64_t root_delta; // root pointer minus its most derived object
+};
+
+struct Node {
+  uint64_t type;
+  uint64_t block;  // arena offsets
+  uint64_t object;
+  uint64_t payload; // file offset and size of the fields
+  uint64_t payload_size;
+  int32_t strong;
+  int32_t weak;
+};
+
+// In a payload, an edge is a 1-based node index, 0 for null, followed for
+// strong edges by the pointer's offset into its object. Weak edges are
+// patched once the nodes are known.
+struct Patch {
+  size_t at;
+  const void *cnt;
+};
+} // namespace snapshot_format
+
+template <typename RefCntType> class snapshot_writer {
+public:
+  template <typename V> void write(const V &v) {
+    static_assert(std::is_trivially_copyable_v<V>);
+    write_bytes(&v, sizeof(v));
+  }
+
+  void write_bytes(const void *p, size_t n) {
+    auto b = static_cast<const uint8_t *>(p);
+    _bytes.insert(_bytes.end(), b, b + n);
+  }
+
+  template <typename U> void write(const ref_ptr<U> &p) {
+    uint32_t index = 0;
+    int64_t delta = 0;
+    if (auto obj = p.get()) {
+      auto &n =
+          node(obj->cnt(), dynamic_cast<const void *>(obj), typeid(*obj));
+      n.strong++;
+      index = n.index + 1;
+      delta = reinterpret_cast<const uint8_t *>(obj) -
+              static_cast<const uint8_t *>(n.obj);
+    }
+    write(index);
+    write(delta);
+  }
+
+  // Resolved once the strongly reachable nodes are known.
+  template <typename U> void write(const obs_ptr<U> &p) {
+    _weak_edges.push_back({_bytes.size(), p.cnt});
+    write(uint32_t(0));
+  }
+
+private:
+  template <typename T>
+  friend void save_snapshot(const char *path, const ref_ptr<T> &root);
+
+  struct Node {
+    uint32_t index;
+    const void *obj; // most derived
+    uint64_t type;
+    int32_t strong{0};
+    int32_t weak{0};
+    size_t payload{0}; // in _bytes; nodes are saved one after another
+    size_t payload_size{0};
+  };
+
+  Node &node(const void *cnt, const void *obj, const std::type_info &type) {
+    auto [it, added] = _index.try_emplace(cnt, uint32_t(_nodes.size()));
+    if (added) {
+      _nodes.push_back({it->second, obj,
+                        snapshot_types<RefCntType>::type_id(type)});
+      _pending.push_back(it->second);
+    }
+    return _nodes[it->second];
+  }
+
+  std::deque<Node> _nodes;
+  std::unordered_map<const void *, uint32_t> _index; // by control block
+  std::deque<uint32_t> _pending;
+  std::vector<uint8_t> _bytes;
+  std::vector<snapshot_format::Patch> _weak_edges;
+};
+
+template <typename RefCntType> class snapshot_reader {
+public:
+  template <typename V> V read() {
+    static_assert(std::is_trivially_copyable_v<V>);
+    V v;
+    read_bytes(&v, sizeof(v));
+    return v;
+  }
+
+  // A corrupt payload does not throw from inside a constructor, whose
+  // edges to objects not built yet could not be dropped: the reader returns
+  // zeros and null edges instead and the load fails once all are built.
+  void read_bytes(void *p, size_t n) {
+    if (n > size_t(_end - _pos)) {
+      std::memset(p, 0, n);
+      _pos = _end;
+      _corrupt = true;
+      return;
+    }
+    std::memcpy(p, _pos, n);
+    _pos += n;
+  }
+
+  // The reference is already counted: no count is touched while loading.
+  template <typename U> ref_ptr<U> read_ref() {
+    const auto index = read<uint32_t>();
+    const auto delta = read<int64_t>();
+    auto n = node(index);
+    if (!n)
+      return nullptr;
+    if (!inside(_sizes[index - 1], delta, sizeof(U), alignof(U))) {
+      _corrupt = true;
+      return nullptr;
+    }
+    return ref_ptr<U>(
+        reinterpret_cast<U *>(_arena->data() + n->object + delta));
+  }
+
+  template <typename U> obs_ptr<U> read_obs() {
+    const auto index = read<uint32_t>();
+    obs_ptr<U> o;
+    if (auto n = node(index))
+      o.cnt = reinterpret_cast<typename U::refcnt_type *>(_arena->data() +
+                                                          n->block);
+    return o;
+  }
+
+  snapshot_arena *arena() const { return _arena; }
+
+private:
+  template <typename T> friend ref_ptr<T> load_snapshot(const char *path);
+
+  const snapshot_format::Node *node(uint32_t index) {
+    if (index > _count)
+      _corrupt = true;
+    return index && index <= _count ? &_nodes[index - 1] : nullptr;
+  }
+
+  // A size byte, align aligned part at offset delta of a size_of byte
+  // object lies within it.
+  static bool inside(size_t size_of, int64_t delta, size_t size,
+                     size_t align) {
+    return delta >= 0 && uint64_t(delta) % align == 0 && size <= size_of &&
+           uint64_t(delta) <= size_of - size;
+  }
+
+  snapshot_arena *_arena;
+  const snapshot_format::Node *_nodes;
+  const size_t *_sizes; // of the nodes' objects
+  uint64_t _count;
+  const uint8_t *_pos;
+  const uint8_t *_end;
+  bool _corrupt{false};
+};
+
+template <typename T>
+void save_snapshot(const char *path, const ref_ptr<T> &root) {
+  using RefCntType = typename T::refcnt_type;
+  using types = snapshot_types<RefCntType>;
+  namespace fmt = snapshot_format;
+  snapshot_writer<RefCntType> w;
+  if (root) {
+    auto &n = w.node(root->cnt(), dynamic_cast<const void *>(root.get()),
+                     typeid(*root));
+    n.strong++;
+  }
+  // Breadth first over the strong edges; the writer queues new targets.
+  while (!w._pending.empty()) {
+    auto &n = w._nodes[w._pending.front()];
+    w._pending.pop_front();
+    auto type = types::find(n.type);
+    if (!type)
+      throw std::runtime_error("snapshot: unregistered type");
+    n.payload = w._bytes.size();
+    type->save(n.obj, w);
+    n.payload_size = w._bytes.size() - n.payload;
+  }
+
+  // Weak edges to nodes in the graph; the rest load as expired.
+  for (auto &e : w._weak_edges) {
+    auto it = w._index.find(e.cnt);
+    if (it == w._index.end())
+      continue;
+    w._nodes[it->second].weak++;
+    const uint32_t index = it->second + 1;
+    std::memcpy(w._bytes.data() + e.at, &index, sizeof(index));
+  }
+
+  // Arena layout: each node's control block, then its object.
+  fmt::Header header{fmt::MAGIC, fmt::VERSION,
+                     snapshot_block_size<RefCntType>, w._nodes.size(), 0, 0};
+  std::vector<fmt::Node> table;
+  uint64_t arena = 0;
+  const uint64_t payloads =
+      sizeof(header) + w._nodes.size() * sizeof(fmt::Node);
+  for (auto &n : w._nodes) {
+    auto type = types::find(n.type);
+    const auto block = (arena + alignof(RefCntType) - 1) /
+                       alignof(RefCntType) * alignof(RefCntType);
+    const auto object =
+        (block + snapshot_block_size<RefCntType> + type->align - 1) /
+        type->align * type->align;
+    arena = object + type->size;
+    table.push_back({n.type, block, object, payloads + n.payload,
+                     n.payload_size, n.strong, n.weak});
+  }
+  header.arena_size = arena;
+  if (root)
+    header.root_delta = reinterpret_cast<const uint8_t *>(root.get()) -
+                        static_cast<const uint8_t *>(w._nodes[0].obj);
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(table.data()),
+            std::streamsize(table.size() * sizeof(fmt::Node)));
+  out.write(reinterpret_cast<const char *>(w._bytes.data()),
+            std::streamsize(w._bytes.size()));
+  if (!out)
+    throw std::system_error(errno, std::generic_category(), "save_snapshot");
+}
+
+template <typename T> ref_ptr<T> load_snapshot(const char *path) {
+  using RefCntType = typename T::refcnt_type;
+  using types = snapshot_types<RefCntType>;
+  namespace fmt = snapshot_format;
+
+  const int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    throw std::system_error(errno, std::generic_category(), "load_snapshot");
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    const int err = errno;
+    ::close(fd);
+    throw std::system_error(err, std::generic_category(), "load_snapshot");
+  }
+  const size_t size = size_t(st.st_size);
+  void *p = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                 : MAP_FAILED;
+  ::close(fd);
+  if (p == MAP_FAILED)
+    throw std::runtime_error("snapshot: cannot map file");
+  struct Unmap {
+    void *p;
+    size_t size;
+    ~Unmap() { munmap(p, size); }
+  } unmap{p, size};
+  auto file = static_cast<const uint8_t *>(p);
+
+  // Validate everything before constructing anything.
+  fmt::Header header;
+  if (size < sizeof(header))
+    throw std::runtime_error("snapshot: truncated");
+  std::memcpy(&header, file, sizeof(header));
+  if (header.magic != fmt::MAGIC || header.version != fmt::VERSION ||
+      header.cnt_size != snapshot_block_size<RefCntType>)
+    throw std::runtime_error("snapshot: incompatible file");
+  if (header.nodes == 0)
+    return nullptr;
+  if (header.nodes > (size - sizeof(header)) / sizeof(fmt::Node))
+    throw std::runtime_error("snapshot: truncated");
+  auto nodes = reinterpret_cast<const fmt::Node *>(file + sizeof(header));
+  std::vector<const typename types::Type *> node_types(header.nodes);
+  std::vector<size_t> sizes(header.nodes);
+  // Each node's block and object follow the previous node's object, as
+  // save_snapshot() lays them out, so no two nodes share arena bytes.
+  uint64_t end = 0;
+  for (uint64_t i = 0; i < header.nodes; i++) {
+    const auto &n = nodes[i];
+    auto type = node_types[i] = types::find(n.type);
+    if (!type)
+      throw std::runtime_error("snapshot: unregistered type");
+    sizes[i] = type->size;
+    if (n.block < end || n.block % alignof(RefCntType) ||
+        n.object % type->align || n.object < n.block ||
+        n.object - n.block < snapshot_block_size<RefCntType> ||
+        n.object > header.arena_size ||
+        type->size > header.arena_size - n.object || n.payload > size ||
+        n.payload_size > size - n.payload || n.strong <= 0 || n.weak < 0)
+      throw std::runtime_error("snapshot: corrupt node table");
+    end = n.object + type->size;
+  }
+  if (!snapshot_reader<RefCntType>::inside(sizes[0],
+                                           int64_t(header.root_delta),
+                                           sizeof(T), alignof(T)))
+    throw std::runtime_error("snapshot: corrupt node table");
+
+  auto arena = snapshot_arena::create(header.arena_size, 2 * header.nodes);
+  auto block = [&](uint64_t i) {
+    return reinterpret_cast<RefCntType *>(arena->data() + nodes[i].block);
+  };
+  // Payloads are only known to their types, so a bad one shows up while its
+  // object is built. Until the graph is known to be whole, the counts are
+  // pinned where no release brings them to zero, so a failed load can
+  // destroy its objects in any order.
+  constexpr auto pinned =
+      std::numeric_limits<typename RefCntType::size_type>::max() / 2;
+  for (uint64_t i = 0; i < header.nodes; i++) {
+    auto cnt = ::new (block(i)) RefCntType();
+    cnt->preset(pinned, RefCntType::WEAK ? pinned : 0);
+  }
+
+  snapshot_reader<RefCntType> r;
+  r._arena = arena;
+  r._nodes = nodes;
+  r._sizes = sizes.data();
+  r._count = header.nodes;
+  for (uint64_t i = 0; i < header.nodes; i++) {
+    const auto &n = nodes[i];
+    r._pos = file + n.payload;
+    r._end = r._pos + n.payload_size;
+    node_types[i]->load(arena->data() + n.object, block(i), r);
+    if (r._pos != r._end)
+      r._corrupt = true;
+  }
+  if (r._corrupt) {
+    for (uint64_t i = 0; i < header.nodes; i++)
+      node_types[i]->destroy(arena->data() + nodes[i].object);
+    arena->discard();
+    throw std::runtime_error("snapshot: corrupt payload");
+  }
+  for (uint64_t i = 0; i < header.nodes; i++)
+    block(i)->preset(nodes[i].strong, nodes[i].weak);
+  // The root's strong count includes the reference returned here.
+  return ref_ptr<T>(reinterpret_cast<T *>(arena->data() + nodes[0].object +
+                                          header.root_delta));
+}
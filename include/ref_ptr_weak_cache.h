@@ -0,0 +1,394 @@
+#pragma once
+
+// Concurrent map from keys to weakly referenced objects, for interning and
+// object caches whose values may be dropped at any time.
+//
+// The map is split into shards by hash. Lookups take no lock: they walk the
+// shard's bucket chain inside an epoch guard and promote the entry with
+// try_ref() (increment-if-nonzero), so they only read shared memory until
+// they touch the object's own counter. Writers serialize on the shard mutex.
+// Unlinked nodes and old bucket arrays are freed once every reader that
+// could still see them has left its guard.
+//
+// Each entry watches its control block (RefCntImpl::watch_expiry); objects
+// that die bump their shard's expired count from the destruction path, and
+// the next writer on that shard sweeps the dead entries once they make up a
+// quarter of it. An object already watched by another cache is only removed
+// by those sweeps or by replacing its key. Blocks without an expiry watcher
+// (RefCntImpl's Expiry, off for packed blocks) are swept when their shard
+// is about to grow instead.
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ref_ptr.h"
+
+// Epoch-based reclamation shared by all weak caches. Threads announce the
+// global epoch while inside a Guard; memory retired at epoch e may be freed
+// once no thread announces e or an earlier epoch.
+class CacheEpochs {
+  struct Record;
+
+public:
+  static CacheEpochs &instance() {
+    static CacheEpochs epochs;
+    return epochs;
+  }
+
+  class Guard {
+  public:
+    Guard() : _rec(local()) {
+      if (_rec->depth++ == 0) {
+        _rec->epoch.store(instance()._global.load(),
+                          std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }
+    }
+    ~Guard() {
+      if (--_rec->depth == 0)
+        _rec->epoch.store(0, std::memory_order_release);
+    }
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+
+  private:
+    Record *_rec;
+  };
+
+  // Epoch to tag memory unlinked now, and starts a new one.
+  uint64_t retire_epoch() { return _global.fetch_add(1); }
+
+  // Memory retired at an epoch below this is unreachable.
+  uint64_t safe_epoch() const {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto safe = _global.load();
+    for (auto r = _records.load(std::memory_order_acquire); r; r = r->next) {
+      const auto e = r->epoch.load(std::memory_order_acquire);
+      if (e && e < safe)
+        safe = e;
+    }
+    return safe;
+  }
+
+private:
+  struct alignas(hardware_destructive_interference_size) Record {
+    std::atomic<uint64_t> epoch{0}; // 0 while outside a guard
+    std::atomic<bool> used{true};
+    int depth{0};
+    Record *next{nullptr};
+  };
+
+  // Records are reused by later threads and never freed.
+  static Record *local() {
+    struct Holder {
+      Record *rec = instance().acquire();
+      ~Holder() { rec->used.store(false, std::memory_order_release); }
+    };
+    static thread_local Holder holder;
+    return holder.rec;
+  }
+
+  Record *acquire() {
+    for (auto r = _records.load(std::memory_order_acquire); r; r = r->next) {
+      bool used = false;
+      if (!r->used.load(std::memory_order_relaxed) &&
+          r->used.compare_exchange_strong(used, true))
+        return r;
+    }
+    auto r = new Record;
+    r->next = _records.load(std::memory_order_relaxed);
+    while (!_records.compare_exchange_weak(r->next, r,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed))
+      ;
+    return r;
+  }
+
+  std::atomic<uint64_t> _global{1};
+  std::atomic<Record *> _records{nullptr};
+};
+
+template <typename K, typename T, typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>>
+class weak_cache {
+  using refcnt_type = typename T::refcnt_type;
+
+public:
+  explicit weak_cache(size_t shards = 16)
+      : _shards(std::max<size_t>(std::bit_ceil(shards), 1)),
+        _shard_mask(_shards.size() - 1) {}
+
+  weak_cache(const weak_cache &) = delete;
+  weak_cache &operator=(const weak_cache &) = delete;
+
+  // Strong reference to the object cached under key, null when there is
+  // none or it has been destroyed. Lock-free.
+  ref_ptr<T> find(const K &key) const {
+    const auto h = hash(key);
+    CacheEpochs::Guard guard;
+    if (auto node = shard(h).lookup(h, key, _eq)) {
+      if (node->cnt->try_ref())
+        return ref_ptr<T>(node->obj);
+    }
+    return nullptr;
+  }
+
+  // Caches value under key, replacing what was there.
+  void insert(const K &key, const ref_ptr<T> &value) {
+    const auto h = hash(key);
+    auto &s = shard(h);
+    std::lock_guard<std::mutex> lk(s.mut);
+    s.put(h, key, value.get(), _eq);
+  }
+
+  // The live object under key, or make()'s result, cached unless null.
+  // make() runs with the shard locked, at most once per missing key.
+  template <typename Make>
+  ref_ptr<T> get_or_insert(const K &key, Make &&make) {
+    if (auto found = find(key))
+      return found;
+    const auto h = hash(key);
+    auto &s = shard(h);
+    std::lock_guard<std::mutex> lk(s.mut);
+    if (auto node = s.lookup(h, key, _eq)) {
+      if (node->cnt->try_ref())
+        return ref_ptr<T>(node->obj);
+    }
+    ref_ptr<T> value = make();
+    if (value)
+      s.put(h, key, value.get(), _eq);
+    return value;
+  }
+
+  bool erase(const K &key) {
+    const auto h = hash(key);
+    auto &s = shard(h);
+    std::lock_guard<std::mutex> lk(s.mut);
+    return s.remove(h, key, _eq);
+  }
+
+  // Entries, including dead ones not swept yet.
+  size_t size() const {
+    size_t n = 0;
+    for (auto &s : _shards) {
+      std::lock_guard<std::mutex> lk(s.mut);
+      n += s.count;
+    }
+    return n;
+  }
+
+  // Removes the entries of destroyed objects now.
+  void sweep() {
+    for (auto &s : _shards) {
+      std::lock_guard<std::mutex> lk(s.mut);
+      s.sweep();
+    }
+  }
+
+private:
+  struct Node {
+    size_t hash;
+    K key;
+    T *obj;
+    refcnt_type *cnt;
+    bool watched{false};
+    std::atomic<Node *> next{nullptr};
+  };
+
+  struct Buckets {
+    size_t mask;
+    std::unique_ptr<std::atomic<Node *>[]> heads;
+    explicit Buckets(size_t size)
+        : mask(size - 1), heads(new std::atomic<Node *>[size]) {}
+    std::atomic<Node *> &head(size_t h) { return heads[h & mask]; }
+  };
+
+  // Node or bucket array waiting for the readers to move on.
+  struct Retired {
+    uint64_t epoch;
+    Node *node;
+    Buckets *buckets;
+  };
+
+  static constexpr size_t INITIAL_BUCKETS = 16;
+  static constexpr size_t RECLAIM_BATCH = 64;
+
+  struct alignas(hardware_destructive_interference_size) Shard {
+    mutable std::mutex mut;
+    std::atomic<Buckets *> buckets{new Buckets(INITIAL_BUCKETS)};
+    std::atomic<uint64_t> resizing{0}; // odd while grow() relinks
+    size_t count{0};
+    ExpirySink *sink{new ExpirySink};
+    std::vector<Retired> retired;
+
+    ~Shard() {
+      auto b = buckets.load(std::memory_order_relaxed);
+      for (size_t i = 0; i <= b->mask; i++) {
+        for (auto n = b->heads[i].load(std::memory_order_relaxed); n;) {
+          auto next = n->next.load(std::memory_order_relaxed);
+          release(n);
+          n = next;
+        }
+      }
+      delete b;
+      for (auto &r : retired)
+        free(r);
+      sink->release();
+    }
+
+    // Readers: inside a guard. Writers: under mut. A reader that grow()
+    // may have hidden an entry from looks again.
+    Node *lookup(size_t h, const K &key, const KeyEqual &eq) const {
+      for (;;) {
+        const auto seq = resizing.load(std::memory_order_acquire);
+        auto b = buckets.load(std::memory_order_acquire);
+        for (auto n = b->head(h).load(std::memory_order_acquire); n;
+             n = n->next.load(std::memory_order_acquire)) {
+          if (n->hash == h && eq(n->key, key))
+            return n;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!(seq & 1) && resizing.load(std::memory_order_relaxed) == seq)
+          return nullptr;
+      }
+    }
+
+    void put(size_t h, const K &key, T *obj, const KeyEqual &eq) {
+      if (sink->expired.load(std::memory_order_relaxed) >=
+          std::max<size_t>(count / 4, 1))
+        sweep();
+      remove(h, key, eq);
+      auto node = new Node{h, key, obj, obj->cnt()};
+      node->cnt->weak_ref();
+      if constexpr (refcnt_type::EXPIRY) {
+        if (node->cnt->watch_expiry(sink)) {
+          sink->retain();
+          node->watched = true;
+        }
+      }
+      auto b = buckets.load(std::memory_order_relaxed);
+      auto &head = b->head(h);
+      node->next.store(head.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+      head.store(node, std::memory_order_release);
+      if (++count > b->mask + 1) {
+        // Without expiry reports the dead entries go here. Growing unless a
+        // quarter came free leaves a sweep per size / 4 puts at most.
+        if constexpr (!refcnt_type::EXPIRY)
+          sweep();
+        if (count > (b->mask + 1) / 4 * 3)
+          grow();
+      }
+    }
+
+    bool remove(size_t h, const K &key, const KeyEqual &eq) {
+      auto b = buckets.load(std::memory_order_relaxed);
+      for (auto *link = &b->head(h);;) {
+        auto n = link->load(std::memory_order_relaxed);
+        if (!n)
+          return false;
+        if (n->hash == h && eq(n->key, key)) {
+          unlink(*link, n);
+          reclaim();
+          return true;
+        }
+        link = &n->next;
+      }
+    }
+
+    void sweep() {
+      sink->expired.store(0, std::memory_order_relaxed);
+      auto b = buckets.load(std::memory_order_relaxed);
+      for (size_t i = 0; i <= b->mask; i++) {
+        for (auto *link = &b->heads[i]; auto n = link->load();) {
+          if (n->cnt->ref_count() <= 0)
+            unlink(*link, n);
+          else
+            link = &n->next;
+        }
+      }
+      reclaim();
+    }
+
+    void unlink(std::atomic<Node *> &link, Node *n) {
+      link.store(n->next.load(std::memory_order_relaxed),
+                 std::memory_order_release);
+      count--;
+      retired.push_back({CacheEpochs::instance().retire_epoch(), n, nullptr});
+    }
+
+    // Doubles the bucket array. Nodes are relinked in place: a concurrent
+    // lookup never loops or reads freed memory, and as it may miss an entry
+    // it looks again when `resizing` moved.
+    void grow() {
+      resizing.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      auto old = buckets.load(std::memory_order_relaxed);
+      auto b = new Buckets((old->mask + 1) * 2);
+      for (size_t i = 0; i <= old->mask; i++) {
+        for (auto n = old->heads[i].load(std::memory_order_relaxed); n;) {
+          auto next = n->next.load(std::memory_order_relaxed);
+          auto &head = b->head(n->hash);
+          n->next.store(head.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+          head.store(n, std::memory_order_release);
+          n = next;
+        }
+      }
+      buckets.store(b, std::memory_order_release);
+      resizing.fetch_add(1, std::memory_order_release);
+      retired.push_back({CacheEpochs::instance().retire_epoch(), nullptr, old});
+      reclaim();
+    }
+
+    void reclaim() {
+      if (retired.size() < RECLAIM_BATCH)
+        return;
+      const auto safe = CacheEpochs::instance().safe_epoch();
+      auto keep =
+          std::partition(retired.begin(), retired.end(),
+                         [&](const Retired &r) { return r.epoch >= safe; });
+      for (auto it = keep; it != retired.end(); ++it)
+        free(*it);
+      retired.erase(keep, retired.end());
+    }
+
+    void free(const Retired &r) {
+      if (r.node)
+        release(r.node);
+      delete r.buckets;
+    }
+
+    void release(Node *n) {
+      if constexpr (refcnt_type::EXPIRY) {
+        if (n->watched && n->cnt->unwatch_expiry(sink))
+          sink->release();
+      }
+      n->cnt->weak_deref();
+      delete n;
+    }
+  };
+
+  size_t hash(const K &key) const {
+    // Spread the bits: std::hash is the identity for integers.
+    uint64_t h = _hash(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return size_t(h);
+  }
+
+  Shard &shard(size_t h) const { return _shards[(h >> 48) & _shard_mask]; }
+
+  mutable std::vector<Shard> _shards;
+  const size_t _shard_mask;
+  Hash _hash;
+  KeyEqual _eq;
+};
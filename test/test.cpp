@@ -1,9 +1,35 @@
 #include "../example/example.h"
+#include "../include/ref_ptr_batch.h"
+#include "../include/ref_ptr_cow.h"
+#include "../include/ref_ptr_deferred.h"
+#include "../include/ref_ptr_numa.h"
+#include "../include/ref_ptr_once.h"
+#include "../include/ref_ptr_parallel.h"
+#include "../include/ref_ptr_queue.h"
+#include "../include/ref_ptr_shared.h"
+#include "../include/ref_ptr_shm.h"
+#include "../include/ref_ptr_slab.h"
+#include "../include/ref_ptr_snapshot.h"
+#include "../include/ref_ptr_weak_cache.h"
 #include "../utils/task.h"
 #include "../utils/thread_pool.h"
 #include "../utils/timer.h"
 
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <optional>
 #include <random>
+#include <set>
+#include <string>
+#include <thread>
+
+#if REF_PTR_HAS_PROBES && defined(__linux__)
+#include <elf.h>
+#endif
+#include <sys/wait.h>
 
 #include <gtest/gtest.h>
 
@@ -341,3 +367,1312 @@ TEST(Test, multi_thread_memory_leak) {
   }
   ASSERT_EQ(alloc.allocCount.load(), 0);
 }
+
+TEST(Test, thread_pool_nested_tasks) {
+  thread_pool pool{4};
+  std::atomic<int> count{0};
+  for (int round = 0; round < 100; round++) {
+    for (int i = 0; i < 8; i++) {
+      pool.append_task([&] {
+        count++;
+        for (int j = 0; j < 8; j++)
+          pool.append_task([&](int n) { count += n; }, 1);
+      });
+    }
+    pool.wait();
+  }
+  ASSERT_EQ(count.load(), 100 * 8 * 9);
+
+  pool.append_task([] { throw std::runtime_error("task"); });
+  ASSERT_THROW(pool.wait(), std::runtime_error);
+  pool.wait();
+}
+
+TEST(Test, ref_ptr_queue_ownership) {
+  TestAlloc alloc;
+  int flag = 1;
+  {
+    ref_ptr_queue<TestObject> queue(3);
+    ASSERT_EQ(queue.capacity(), 4u);
+    auto p = make_ref_ptr<TestObject, IObject, TestAlloc>(&alloc, flag);
+    auto raw = p.get();
+    ASSERT_TRUE(queue.try_push(std::move(p)));
+    ASSERT_EQ(p, nullptr);
+    ASSERT_EQ(raw->ref_count(), 1);
+    // Neither full nor empty: empty batches return at once.
+    ASSERT_EQ(queue.try_push_bulk(nullptr, 0), 0u);
+    ASSERT_EQ(queue.try_pop_bulk(nullptr, 0), 0u);
+
+    ref_ptr<TestObject> batch[4];
+    for (auto &b : batch)
+      b = make_ref_ptr<TestObject, IObject, TestAlloc>(&alloc, flag);
+    ASSERT_EQ(queue.try_push_bulk(batch, 4), 3u);
+    ASSERT_EQ(batch[2], nullptr);
+    ASSERT_NE(batch[3], nullptr);
+    ASSERT_FALSE(queue.try_push(std::move(batch[3])));
+    ASSERT_NE(batch[3], nullptr);
+
+    ref_ptr<TestObject> out;
+    ASSERT_TRUE(queue.try_pop(out));
+    ASSERT_EQ(out.get(), raw);
+    ASSERT_EQ(out->ref_count(), 1);
+    ASSERT_EQ(queue.try_pop_bulk(batch, 4), 3u);
+    ASSERT_FALSE(queue.try_pop(out));
+    ASSERT_EQ(out.get(), raw);
+
+    // Leave some in the queue for the destructor.
+    ASSERT_EQ(queue.try_push_bulk(batch, 3), 3u);
+    ASSERT_EQ(alloc.allocCount.load(), 5);
+  }
+  ASSERT_EQ(alloc.allocCount.load(), 0);
+}
+
+TEST(Test, ref_ptr_queue_mpmc) {
+  constexpr int PRODUCERS = 4;
+  constexpr int MESSAGES = 20000;
+  TestAlloc alloc;
+  int flag = 1;
+  auto p = make_ref_ptr<TestObject, IObject, TestAlloc>(&alloc, flag);
+  ref_ptr_queue<TestObject> queue(64);
+  std::atomic<int> received{0};
+  {
+    thread_pool pool{PRODUCERS * 2};
+    for (int i = 0; i < PRODUCERS; i++) {
+      pool.append_task([&] {
+        ref_ptr<TestObject> batch[8];
+        for (int m = 0; m < MESSAGES; m += 8) {
+          for (auto &b : batch)
+            b = p;
+          for (size_t sent = 0; sent < 8;)
+            sent += queue.try_push_bulk(batch + sent, 8 - sent);
+        }
+      });
+      pool.append_task([&] {
+        ref_ptr<TestObject> batch[8];
+        for (int m = 0; m < MESSAGES;) {
+          const auto n = queue.try_pop_bulk(batch, 8 - m % 8);
+          for (size_t j = 0; j < n; j++)
+            ASSERT_EQ(batch[j], p);
+          m += int(n);
+          received += int(n);
+          if (n == 0)
+            std::this_thread::yield();
+        }
+      });
+    }
+    pool.wait();
+  }
+  ASSERT_EQ(received.load(), PRODUCERS * MESSAGES);
+  ASSERT_EQ(p->ref_count(), 1);
+}
+
+TEST(Test, weak_cache_expiry) {
+  TestAlloc alloc;
+  int flag = 1;
+  {
+    weak_cache<int, TestObject> cache(4);
+    auto a = make_ref_ptr<TestObject, IObject, TestAlloc>(&alloc, flag);
+    cache.insert(1, a);
+    ASSERT_EQ(a->weak_ref_count(), 1);
+    ASSERT_EQ(cache.find(1), a);
+    ASSERT_EQ(a->ref_count(), 1);
+    ASSERT_EQ(cache.find(2), nullptr);
+
+    a = nullptr;
+    ASSERT_EQ(cache.find(1), nullptr);
+    ASSERT_EQ(alloc.allocCount.load(), 0);
+
+    // Dead entries are swept by the writers once they pile up.
+    std::vector<ref_ptr<TestObject>> live;
+    for (int i = 0; i < 1000; i++) {
+      auto p = make_ref_ptr<TestObject, IObject, TestAlloc>(&alloc, flag);
+      cache.insert(i, p);
+      if (i % 10 == 0)
+        live.push_back(p);
+    }
+    ASSERT_LT(cache.size(), 400u);
+    cache.sweep();
+    ASSERT_EQ(cache.size(), live.size());
+    for (int i = 0; i < 1000; i++)
+      ASSERT_EQ(cache.find(i) != nullptr, i % 10 == 0);
+
+    auto interned =
+        cache.get_or_insert(10, [] { return ref_ptr<TestObject>(); });
+    ASSERT_EQ(interned, live[1]);
+    ASSERT_TRUE(cache.erase(10));
+    ASSERT_FALSE(cache.erase(10));
+    ASSERT_EQ(cache.find(10), nullptr);
+  }
+  ASSERT_EQ(alloc.allocCount.load(), 0);
+}
+
+class PackedEntry : public RefCountedObject<IObject, RefCntImpl<IObject, 1>> {
+public:
+  PackedEntry(refcnt_type *cnt) : RefCountedObject(cnt) {}
+  void foo() override {}
+};
+
+TEST(Test, weak_cache_without_expiry) {
+  // Packed blocks leave the watcher out; the cache sweeps before growing.
+  static_assert(!PackedEntry::refcnt_type::EXPIRY);
+  static_assert(sizeof(RefCntImpl<IObject, 1, true, true>) >
+                sizeof(RefCntImpl<IObject, 1>));
+  using PaddedCnt = RefCntImpl<IObject>;
+  static_assert(PaddedCnt::EXPIRY);
+  static_assert(sizeof(RefCntImpl<IObject, alignof(PaddedCnt), true, false>) ==
+                sizeof(PaddedCnt));
+
+  TestAlloc alloc;
+  {
+    weak_cache<int, PackedEntry> cache(4);
+    std::vector<ref_ptr<PackedEntry>> live;
+    for (int i = 0; i < 1000; i++) {
+      auto p = make_ref_ptr<PackedEntry, IObject, TestAlloc,
+                            RefCntImpl<IObject, 1>>(&alloc);
+      cache.insert(i, p);
+      if (i % 10 == 0)
+        live.push_back(p);
+    }
+    ASSERT_LT(cache.size(), 400u);
+    for (int i = 0; i < 1000; i++)
+      ASSERT_EQ(cache.find(i) != nullptr, i % 10 == 0);
+  }
+  ASSERT_EQ(alloc.allocCount.load(), 0);
+}
+
+TEST(Test, weak_cache_grow_under_lookups) {
+  // One shard grows from 16 to 64k buckets while readers look up keys that
+  // are always there.
+  constexpr int READERS = 3;
+  constexpr int PRESENT = 64;
+  constexpr int INSERTS = 50000;
+  TestAlloc alloc;
+  int flag = 1;
+  {
+    weak_cache<int, TestObject> cache(1);
+    std::vector<ref_ptr<TestObject>> objs;
+    for (int i = 0; i < PRESENT + INSERTS; i++)
+      objs.push_back(
+          make_ref_ptr<TestObject, IObject, TestAlloc>(&alloc, flag));
+    for (int i = 0; i < PRESENT; i++)
+      cache.insert(i, objs[i]);
+
+    std::atomic<bool> done{false};
+    std::atomic<int> misses{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < READERS; t++) {
+      readers.emplace_back([&, t] {
+        for (int i = t; !done.load(std::memory_order_relaxed); i++) {
+          if (cache.find(i % PRESENT) != objs[i % PRESENT])
+            misses++;
+          if (i % 64 == 0)
+            std::this_thread::yield();
+        }
+      });
+    }
+    for (int i = PRESENT; i < PRESENT + INSERTS; i++)
+      cache.insert(i, objs[i]);
+    done = true;
+    for (auto &r : readers)
+      r.join();
+    ASSERT_EQ(misses.load(), 0);
+    ASSERT_EQ(cache.size(), size_t(PRESENT + INSERTS));
+  }
+  ASSERT_EQ(alloc.allocCount.load(), 0);
+}
+
+TEST(Test, weak_cache_concurrent) {
+  constexpr int THREADS = 4;
+  constexpr int KEYS = 64;
+  TestAlloc alloc;
+  int flag = 1;
+  {
+    weak_cache<int, TestObject> cache;
+    thread_pool pool{THREADS};
+    std::atomic<int> made{0};
+    for (int t = 0; t < THREADS; t++) {
+      pool.append_task([&, t] {
+        std::default_random_engine rng(t);
+        for (int i = 0; i < 20000; i++) {
+          const int key = int(rng() % KEYS);
+          auto p = cache.get_or_insert(key, [&] {
+            made++;
+            return make_ref_ptr<TestObject, IObject, TestAlloc>(&alloc, flag);
+          });
+          ASSERT_NE(p, nullptr);
+          ASSERT_EQ(cache.find(key) == nullptr, false);
+        }
+      });
+    }
+    pool.wait();
+    ASSERT_GE(made.load(), KEYS / 2);
+  }
+  ASSERT_EQ(alloc.allocCount.load(), 0);
+}
+
+class CowValue : public CountedAbstractObject {
+public:
+  static inline int clones = 0;
+  CowValue(refcnt_type *cnt) : CountedAbstractObject(cnt) {}
+  CowValue(refcnt_type *cnt, const CowValue &o)
+      : CountedAbstractObject(cnt), a(o.a), b(o.b) {}
+  void foo() override {}
+  ref_ptr<CowValue> clone() const {
+    clones++;
+    return make_ref<CowValue>(*this);
+  }
+  int a{0};
+  int b{0};
+};
+
+TEST(Test, cow_ptr_clone_on_write) {
+  CowValue::clones = 0;
+  cow_ptr<CowValue> p(make_ref<CowValue>());
+  ASSERT_TRUE(p.unique());
+  p.mutate()->a = 1;
+  ASSERT_EQ(CowValue::clones, 0);
+
+  auto q = p;
+  ASSERT_EQ(q.get(), p.get());
+  ASSERT_FALSE(p.unique());
+  {
+    auto w = q.write();
+    w->a = 2;
+    w->b = 3;
+  }
+  ASSERT_EQ(CowValue::clones, 1);
+  ASSERT_NE(q.get(), p.get());
+  ASSERT_EQ(p->a, 1);
+  ASSERT_EQ(q->a, 2);
+  ASSERT_EQ(q->b, 3);
+  ASSERT_TRUE(p.unique());
+  ASSERT_TRUE(q.unique());
+
+  // Only strong references share: an observer sees the write in place.
+  obs_ptr<const CowValue> obs(p.share());
+  ASSERT_TRUE(p.unique());
+  p.mutate()->b = 4;
+  ASSERT_EQ(CowValue::clones, 1);
+  ASSERT_EQ(obs.lock()->b, 4);
+
+  ASSERT_EQ(cow_ptr<CowValue>().mutate(), nullptr);
+}
+
+class CountingObject : public CountedAbstractObject {
+public:
+  static inline int alive = 0;
+  int value;
+  CountingObject(refcnt_type *cnt, int value)
+      : CountedAbstractObject(cnt), value(value) {
+    alive++;
+  }
+  CountingObject(refcnt_type *cnt, int a, int b) : CountingObject(cnt, a + b) {}
+  ~CountingObject() { alive--; }
+  void foo() override {}
+};
+
+TEST(Test, ref_array_shared_block) {
+  TestAlloc alloc;
+  {
+    auto arr = make_ref_ptr_array<CountingObject, IObject>(
+        AllocSite<TestAlloc>(&alloc), 100, 7);
+    ASSERT_EQ(arr.size(), 100u);
+    ASSERT_EQ(alloc.allocCount.load(), 1);
+    ASSERT_EQ(CountingObject::alive, 100);
+    for (auto &o : arr) {
+      ASSERT_EQ(o.value, 7);
+      ASSERT_EQ(o.cnt(), arr[0].cnt());
+    }
+    ASSERT_EQ(&arr[99], arr.data() + 99);
+
+    auto last = arr.element(99);
+    ref_ptr<CountedAbstractObject> base = arr.element(50);
+    ASSERT_EQ(last.use_count(), 3);
+    arr.reset();
+    ASSERT_EQ(CountingObject::alive, 100);
+    last.reset();
+    ASSERT_EQ(CountingObject::alive, 100);
+    ASSERT_EQ(static_cast<CountingObject *>(base.get())->value, 7);
+  }
+  ASSERT_EQ(CountingObject::alive, 0);
+  ASSERT_EQ(alloc.allocCount.load(), 0);
+
+  auto arr = make_ref_array<CountingObject>(3, 1);
+  obs_ptr<CountingObject> obs(arr.element(0));
+  ASSERT_EQ(obs.lock().get(), arr.data());
+  ASSERT_DEATH(obs_ptr<CountingObject>(arr.element(2)), "first element");
+  arr.reset();
+  ASSERT_TRUE(obs.expired());
+  ASSERT_EQ(CountingObject::alive, 0);
+  ASSERT_TRUE(make_ref_array<CountingObject>(0, 1).empty());
+  ASSERT_EQ(make_ref_array<DerivedObject>(2).size(), 2u);
+  ASSERT_EQ(make_ref_array<CountingObject>(2, 3, 4)[1].value, 7);
+  ASSERT_EQ(make_ref<CountingObject>(3, 4)->value, 7);
+  ASSERT_EQ(make_ptr<CountingObject>(5)->deref(), 0);
+  ASSERT_EQ(CountingObject::alive, 0);
+}
+
+TEST(Test, slab_allocator_spans) {
+  // Blocks free through slab_allocator::free_type, not the allocator.
+  static_assert(RefCntImpl<IObject, 1>::block_size<slab_allocator>() ==
+                sizeof(RefCntImpl<IObject, 1>));
+  const auto baseline = slab_allocator::mapped_bytes();
+  int flag = 1, survivor_flag = 1;
+  obs_ptr<TestObject> observer;
+  ref_ptr<TestObject> survivor;
+  {
+    // On the heap, so that a free through the dead allocator is reported.
+    auto owned = std::make_unique<slab_allocator>();
+    auto &slab = *owned;
+    std::vector<ref_ptr<TestObject>> objs;
+    for (int i = 0; i < 10000; i++)
+      objs.push_back(make_ref_ptr<TestObject, IObject>(
+          AllocSite<slab_allocator>(&slab), flag));
+    survivor = make_ref_ptr<TestObject, IObject>(
+        AllocSite<slab_allocator>(&slab), survivor_flag);
+    ASSERT_GT(slab_allocator::mapped_bytes(), baseline);
+
+    // Each control block sits right before its object.
+    auto a = reinterpret_cast<uintptr_t>(objs[0].get());
+    auto b = reinterpret_cast<uintptr_t>(objs[1].get());
+    auto cnt = reinterpret_cast<uintptr_t>(objs[1]->cnt());
+    ASSERT_GT(cnt, a);
+    ASSERT_LT(cnt, b);
+    ASSERT_LT(b - a, 2 * sizeof(TestObject::refcnt_type));
+
+    void *large = slab.alloc(slab_allocator::SPAN_SIZE * 3);
+    std::memset(large, 1, slab_allocator::SPAN_SIZE * 3);
+    slab.dealloc(large);
+
+    observer = obs_ptr<TestObject>(objs.back());
+    objs.clear();
+    ASSERT_EQ(flag, 0);
+  }
+  // The survivor and the observed control block outlive the allocator and
+  // keep their spans mapped.
+  ASSERT_GT(slab_allocator::mapped_bytes(), baseline);
+  ASSERT_TRUE(observer.expired());
+  observer.reset();
+  ASSERT_GT(slab_allocator::mapped_bytes(), baseline);
+  survivor.reset();
+  ASSERT_EQ(survivor_flag, 0);
+  ASSERT_EQ(slab_allocator::mapped_bytes(), baseline);
+}
+
+// Records the size of every live allocation and checks it on the way back.
+// dealloc(ptr) remains for objects whose constructor throws.
+struct SizedAlloc {
+  std::map<void *, size_t> live;
+  void *alloc(size_t size) { return note(::malloc(size), size); }
+  void dealloc(void *ptr) { dealloc(ptr, live.at(ptr)); }
+  void dealloc(void *ptr, size_t size) {
+    ASSERT_EQ(live.at(ptr), size);
+    live.erase(ptr);
+    ::free(ptr);
+  }
+  void *alloc_block(size_t size, size_t align) {
+    return note(std::aligned_alloc(align, (size + align - 1) / align * align),
+                size);
+  }
+  void dealloc_block(void *ptr, size_t size) { dealloc(ptr, size); }
+  void *note(void *p, size_t size) {
+    live[p] = size;
+    return p;
+  }
+};
+
+struct StatelessAlloc {
+  static inline size_t freed = 0;
+  void *alloc(size_t size) { return ::malloc(size); }
+  void dealloc(void *ptr) { ::free(ptr); }
+  void dealloc(void *ptr, size_t size) {
+    freed += size;
+    ::free(ptr);
+  }
+};
+
+using PackedCnt = RefCntImpl<IObject, 1>;
+
+class PackedObject : public RefCountedObject<IObject, PackedCnt> {
+public:
+  PackedObject(PackedCnt *cnt) : RefCountedObject<IObject, PackedCnt>(cnt) {}
+  void foo() override {}
+  int64_t payload[3]{};
+};
+
+TEST(Test, control_block_manager) {
+  // Allocators with state cost a pointer in the packed block only.
+  static_assert(PackedCnt::block_size<StatelessAlloc>() == sizeof(PackedCnt));
+  static_assert(PackedCnt::block_size<SizedAlloc>() ==
+                sizeof(PackedCnt) + sizeof(void *));
+  static_assert(TestObject::refcnt_type::block_size<SizedAlloc>() ==
+                sizeof(TestObject::refcnt_type));
+
+  SizedAlloc sized;
+  {
+    auto p = make_ref_ptr<PackedObject, IObject, SizedAlloc, PackedCnt>(
+        &sized);
+    auto arr = make_ref_ptr_array<PackedObject, IObject, SizedAlloc,
+                                  PackedCnt>(&sized, 5);
+    ASSERT_EQ(sized.live.size(), 4u);
+    obs_ptr<PackedObject> weak(p);
+    p.reset();
+    ASSERT_EQ(sized.live.size(), 3u); // the observed block stays
+    ASSERT_FALSE(weak.lock());
+  }
+  ASSERT_TRUE(sized.live.empty());
+
+  TestAlloc counted;
+  make_ref_ptr<PackedObject, IObject, TestAlloc, PackedCnt>(&counted).reset();
+  ASSERT_EQ(counted.allocCount, 0u);
+
+  // Stateless allocators are not stored; sizes reach dealloc all the same.
+  StatelessAlloc stateless;
+  StatelessAlloc::freed = 0;
+  int flag = 1;
+  auto p = make_ref_ptr<TestObject, IObject>(
+      AllocSite<StatelessAlloc>(&stateless), flag);
+  obs_ptr<TestObject> weak(p);
+  ASSERT_EQ(weak.lock().get(), p.get());
+  p.reset();
+  ASSERT_EQ(flag, 0);
+  ASSERT_EQ(StatelessAlloc::freed, sizeof(TestObject));
+}
+
+class StrongOnlyObject
+    : public RefCountedObject<IObject, StrongRefCntImpl<IObject>> {
+public:
+  int &flag;
+  StrongOnlyObject(refcnt_type *cnt, int &flag)
+      : RefCountedObject(cnt), flag(flag) {}
+  void foo() override {}
+  ~StrongOnlyObject() { flag = 0; }
+};
+
+TEST(Test, strong_only_control_block) {
+  // No weak count, object state or expiry watcher; obs_ptr<StrongOnlyObject>
+  // does not compile.
+  static_assert(sizeof(StrongRefCntImpl<IObject>) <
+                sizeof(RefCntImpl<IObject>));
+  static_assert(sizeof(StrongRefCntImpl<IObject, 1>) <
+                sizeof(RefCntImpl<IObject, 1>));
+
+  int flag = 1;
+  TestAlloc alloc;
+  auto p = make_ref_ptr<StrongOnlyObject, IObject, TestAlloc,
+                        StrongRefCntImpl<IObject>>(&alloc, flag);
+  auto q = p;
+  ASSERT_EQ(p->ref_count(), 2);
+  ASSERT_EQ(p->weak_ref_count(), 0);
+  ASSERT_FALSE(p->cnt()->unique());
+  q.reset();
+  ASSERT_TRUE(p->cnt()->unique());
+  p.reset();
+  ASSERT_EQ(flag, 0);
+  ASSERT_EQ(alloc.allocCount, 0u);
+
+  auto arr = make_ref_ptr_array<StrongOnlyObject, IObject, AllocImpl,
+                                StrongRefCntImpl<IObject>>(nullptr, 3,
+                                                          std::ref(flag));
+  flag = 1;
+  auto last = arr.element(2);
+  arr.reset();
+  ASSERT_EQ(flag, 1);
+  last.reset();
+  ASSERT_EQ(flag, 0);
+}
+
+TEST(Test, deferred_ref_ptr_counts) {
+  auto &counts = deferred_counts::local();
+  int flag = 1;
+  auto p = make_ref<TestObject>(flag);
+  obs_ptr<TestObject> obs(p);
+  {
+    deferred_epoch epoch;
+    deferred_ref_ptr<TestObject> d(p);
+    const auto before = counts.atomics();
+    for (int i = 0; i < 1000; i++) {
+      deferred_ref_ptr<TestObject> copy(d);
+      ASSERT_EQ(copy.get(), p.get());
+    }
+    // The first copy increments, every later one takes over the pending
+    // decrement of the one before.
+    ASSERT_EQ(counts.atomics() - before, 1u);
+    ASSERT_EQ(p->ref_count(), 3);
+  }
+  ASSERT_EQ(p->ref_count(), 1);
+
+  // The last reference, dropped in an epoch: destroyed at the flush.
+  {
+    deferred_epoch epoch;
+    deferred_ref_ptr<TestObject> d(std::move(p));
+    d.reset();
+    ASSERT_EQ(flag, 1);
+    ASSERT_TRUE(obs.lock());
+  }
+  ASSERT_EQ(flag, 0);
+  ASSERT_FALSE(obs.lock());
+
+  // Increments logged too: no atomics while the thread holds a reference.
+  flag = 1;
+  p = make_ref<TestObject>(flag);
+  {
+    deferred_epoch epoch(true);
+    deferred_ref_ptr<TestObject> d(p);
+    const auto before = counts.atomics();
+    std::vector<deferred_ref_ptr<TestObject>> copies(100, d);
+    ASSERT_EQ(counts.atomics(), before);
+    ASSERT_EQ(p->ref_count(), 2);
+    // share() makes a real reference.
+    ref_ptr<TestObject> shared = copies.back().share();
+    ASSERT_EQ(p->ref_count(), 3);
+  }
+  ASSERT_EQ(p->ref_count(), 1);
+
+  // More objects than the table holds: flushed as it fills.
+  std::vector<int> flags(200, 1);
+  {
+    deferred_epoch epoch;
+    for (auto &f : flags)
+      deferred_ref_ptr<TestObject> d(make_ref<TestObject>(f));
+    ASSERT_LT(std::count(flags.begin(), flags.end(), 0), 200);
+    ASSERT_GT(std::count(flags.begin(), flags.end(), 0), 100);
+  }
+  ASSERT_EQ(std::count(flags.begin(), flags.end(), 0), 200);
+
+  // Threads copying and dropping the same object, each with its own table.
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      deferred_epoch epoch(t % 2 == 1);
+      deferred_ref_ptr<TestObject> d(p);
+      for (int i = 0; i < 10000; i++) {
+        deferred_ref_ptr<TestObject> copy(d);
+        if (i % 64 == 0)
+          deferred_counts::local().flush();
+      }
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  ASSERT_EQ(p->ref_count(), 1);
+  p.reset();
+  ASSERT_EQ(flag, 0);
+}
+
+TEST(Test, parallel_release_destroys) {
+  thread_pool pool(4);
+  constexpr size_t N = 100000;
+  std::vector<int> flags(N, 1);
+  std::vector<ref_ptr<TestObject>> objs, kept;
+  objs.reserve(N);
+  for (auto &f : flags)
+    objs.push_back(make_ref<TestObject>(f));
+  for (size_t i = 0; i < N; i += 10)
+    kept.push_back(objs[i]);
+  objs.push_back(nullptr);
+
+  ASSERT_EQ(parallel_release(objs, pool, 1000), N - kept.size());
+  for (auto &p : objs)
+    ASSERT_FALSE(p);
+  for (size_t i = 0; i < N; i++)
+    ASSERT_EQ(flags[i], i % 10 == 0 ? 1 : 0);
+
+  // From inside one of the pool's tasks, with a grain of 0 taken as 1.
+  std::vector<ref_ptr<TestObject>> inner(kept.begin(), kept.begin() + 100);
+  size_t inner_destroyed = 0;
+  pool.append_task(
+      [&] { inner_destroyed = parallel_release(inner, pool, 0); });
+  pool.wait();
+  ASSERT_EQ(inner_destroyed, 0u);
+  for (auto &p : inner)
+    ASSERT_FALSE(p);
+
+  // Below the grain: on the calling thread.
+  ASSERT_EQ(parallel_release(kept, pool), kept.size());
+  ASSERT_EQ(std::count(flags.begin(), flags.end(), 0), long(N));
+}
+
+TEST(Test, batch_lock_and_traversal) {
+  constexpr size_t N = 1000;
+  std::vector<int> flags(N, 1);
+  std::vector<ref_ptr<TestObject>> objs;
+  std::vector<obs_ptr<TestObject>> obs;
+  for (auto &f : flags) {
+    objs.push_back(make_ref<TestObject>(f));
+    obs.emplace_back(objs.back());
+  }
+  obs.emplace_back(); // null
+  for (size_t i = 0; i < N; i += 3)
+    objs[i].reset();
+
+  std::vector<ref_ptr<TestObject>> locked(obs.size());
+  const size_t live = N - (N + 2) / 3;
+  ASSERT_EQ(lock_all(std::span(obs), locked.data()), live);
+  for (size_t i = 0; i < N; i++) {
+    ASSERT_EQ(bool(locked[i]), i % 3 != 0);
+    if (locked[i]) {
+      ASSERT_EQ(locked[i].get(), objs[i].get());
+    }
+  }
+  ASSERT_FALSE(locked[N]);
+  ASSERT_EQ(objs[1]->ref_count(), 2);
+  locked.clear();
+
+  size_t calls = 0;
+  ASSERT_EQ(for_each_live(std::span(obs),
+                          [&](TestObject &o) {
+                            calls++;
+                            ASSERT_EQ(o.ref_count(), 2);
+                          }),
+            live);
+  ASSERT_EQ(calls, live);
+  ASSERT_EQ(objs[1]->ref_count(), 1);
+}
+
+TEST(Test, ref_ptr_casts) {
+  int flag = 1;
+  ref_ptr<CountedAbstractObject> base = make_ref<DerivedTestObject>(flag);
+  auto derived = static_ref_cast<DerivedTestObject>(base);
+  ASSERT_EQ(base->ref_count(), 2);
+  auto moved = static_ref_cast<DerivedTestObject>(std::move(derived));
+  ASSERT_FALSE(derived);
+  ASSERT_EQ(moved.get(), base.get());
+  ASSERT_EQ(base->ref_count(), 2);
+
+  // A failed rvalue cast keeps the reference.
+  ref_ptr<CountedAbstractObject> other = make_ref<DerivedObject>();
+  ASSERT_FALSE(dynamic_ref_cast<TestObject>(other));
+  ASSERT_FALSE(dynamic_ref_cast<TestObject>(std::move(other)));
+  ASSERT_TRUE(other);
+  ASSERT_EQ(other->ref_count(), 1);
+  auto test = dynamic_ref_cast<TestObject>(std::move(base));
+  ASSERT_FALSE(base);
+  ASSERT_EQ(test->ref_count(), 2);
+
+  ref_ptr<const TestObject> constant = std::move(test);
+  auto mutated = const_ref_cast<TestObject>(constant);
+  ASSERT_EQ(mutated->ref_count(), 3);
+  mutated = const_ref_cast<TestObject>(std::move(constant));
+  ASSERT_EQ(mutated->ref_count(), 2);
+  mutated.reset();
+  moved.reset();
+  ASSERT_EQ(flag, 0);
+}
+
+class AliasOwner : public CountedAbstractObject {
+public:
+  AliasOwner(refcnt_type *cnt, int &flag)
+      : CountedAbstractObject(cnt), flag(flag) {}
+  void foo() override {}
+  ~AliasOwner() { flag = 0; }
+  std::string name{"owner"};
+  std::pair<int, int> range{1, 2};
+  int &flag;
+};
+
+TEST(Test, ref_alias_owns_parent) {
+  int flag = 1;
+  auto owner = make_ref<AliasOwner>(flag);
+  ref_alias name(owner, &owner->name);
+  using refcnt_type = AliasOwner::refcnt_type;
+  static_assert(
+      std::is_same_v<decltype(name), ref_alias<std::string, refcnt_type>>);
+  ASSERT_EQ(owner->ref_count(), 2);
+  ref_alias second(name, &owner->range.second);
+  ASSERT_EQ(*second, 2);
+  ASSERT_EQ(owner->ref_count(), 3);
+  auto copy = name;
+  ASSERT_EQ(name.use_count(), 4);
+  copy.reset();
+  second.reset();
+
+  ref_alias range(std::move(owner), &owner->range);
+  ASSERT_FALSE(owner);
+  ASSERT_EQ(range.use_count(), 2);
+  name = nullptr;
+  ASSERT_EQ(range.use_count(), 1);
+  ref_alias first(std::move(range), &range->first);
+  ASSERT_FALSE(range);
+  ASSERT_EQ(*first, 1);
+  ASSERT_EQ(flag, 1);
+  first.reset();
+  ASSERT_EQ(flag, 0);
+
+  // A null owner gives a null alias: nothing is pointed at unowned.
+  std::string unowned;
+  ref_alias none(ref_ptr<AliasOwner>(), &unowned);
+  ASSERT_FALSE(none);
+  ASSERT_EQ(none.get(), nullptr);
+  ASSERT_EQ(none.use_count(), 0);
+  ASSERT_FALSE(ref_alias(none, &unowned));
+}
+
+TEST(Test, once_ref_publishes_once) {
+  std::atomic<int> made{0};
+  std::vector<int> flags(8, 1);
+  auto make = [&] {
+    auto p = make_ref<TestObject>(flags[made++]);
+    std::this_thread::yield();
+    return p;
+  };
+  {
+    once_ref<TestObject> once;
+    ASSERT_EQ(once.peek(), nullptr);
+    std::vector<TestObject *> seen(flags.size());
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < flags.size(); t++)
+      threads.emplace_back([&, t] { seen[t] = &once.get(make); });
+    for (auto &t : threads)
+      t.join();
+    for (auto p : seen)
+      ASSERT_EQ(p, once.peek());
+    // Only the published object is left, held by the once_ref alone.
+    ASSERT_EQ(std::count(flags.begin(), flags.begin() + made, 1), 1);
+    ASSERT_EQ(once.peek()->ref_count(), 1);
+    const int built = made;
+    auto shared = once.share(make);
+    ASSERT_EQ(made, built);
+    ASSERT_EQ(shared->ref_count(), 2);
+  }
+  ASSERT_EQ(std::count(flags.begin(), flags.end(), 0), made);
+
+  int flag = 1;
+  {
+    once_ref<TestObject> empty;
+    ASSERT_THROW(empty.get([] { return ref_ptr<TestObject>(); }),
+                 std::runtime_error);
+    ASSERT_EQ(empty.peek(), nullptr);
+    ASSERT_EQ(empty.get([&] { return make_ref<TestObject>(flag); }).ref_count(),
+              1);
+  }
+  ASSERT_EQ(flag, 0);
+  flag = 1;
+  TestObject *kept = nullptr;
+  {
+    once_ref<TestObject, true> immortal;
+    kept = &immortal.get([&] { return make_ref<TestObject>(flag); });
+  }
+  ASSERT_EQ(flag, 1);
+  ASSERT_EQ(kept->ref_count(), 1);
+  ref_ptr<TestObject> last(kept); // adopts the immortal reference
+}
+
+TEST(Test, numa_allocator_placement) {
+  const auto &nodes = numa_nodes();
+  int flag = 1;
+  // Local, on each allowed node, and on a node that does not exist, which
+  // falls back to the local one.
+  std::vector<int> requests = {-1, 4096};
+  requests.insert(requests.end(), nodes.begin(), nodes.end());
+  for (int request : requests) {
+    numa_allocator alloc(request);
+    ASSERT_EQ(alloc.numa(), nodes.size() > 1);
+    auto p = make_ref_ptr<TestObject, IObject>(
+        AllocSite<numa_allocator>(&alloc), flag);
+    if (nodes.empty())
+      continue;
+    const int obj = numa_node_of(p.get());
+    const int cnt = numa_node_of(p->cnt());
+    ASSERT_NE(std::find(nodes.begin(), nodes.end(), obj), nodes.end());
+    ASSERT_EQ(obj, cnt);
+    if (alloc.numa() && request >= 0 && request < 4096) {
+      ASSERT_EQ(obj, request);
+    }
+  }
+  ASSERT_EQ(flag, 0);
+}
+
+class SnapNode : public CountedAbstractObject {
+public:
+  static inline int alive = 0;
+  int value{0};
+  std::vector<ref_ptr<SnapNode>> children;
+  obs_ptr<SnapNode> parent;
+
+  SnapNode(refcnt_type *cnt, int value)
+      : CountedAbstractObject(cnt), value(value) {
+    alive++;
+  }
+  SnapNode(refcnt_type *cnt, snapshot_reader<refcnt_type> &r)
+      : CountedAbstractObject(cnt) {
+    alive++;
+    value = r.read<int>();
+    children.resize(r.read<uint32_t>());
+    for (auto &c : children)
+      c = r.read_ref<SnapNode>();
+    parent = r.read_obs<SnapNode>();
+  }
+  ~SnapNode() { alive--; }
+  void foo() override {}
+
+  void snapshot(snapshot_writer<refcnt_type> &w) const {
+    w.write(value);
+    w.write(uint32_t(children.size()));
+    for (auto &c : children)
+      w.write(c);
+    w.write(parent);
+  }
+};
+
+TEST(Test, snapshot_round_trip) {
+  snapshot_types<SnapNode::refcnt_type>::add<SnapNode>();
+  const auto path = ::testing::TempDir() + "ref_ptr_snapshot.bin";
+  SnapNode::alive = 0;
+  {
+    auto outside = make_ref<SnapNode>(-1);
+    auto root = make_ref<SnapNode>(0);
+    auto a = make_ref<SnapNode>(1);
+    auto b = make_ref<SnapNode>(2);
+    auto shared = make_ref<SnapNode>(3);
+    root->children = {a, b};
+    a->children = {shared};
+    b->children = {shared};
+    a->parent = obs_ptr<SnapNode>(root);
+    b->parent = obs_ptr<SnapNode>(outside);
+    shared->parent = obs_ptr<SnapNode>(a);
+    save_snapshot(path.c_str(), root);
+  }
+  ASSERT_EQ(SnapNode::alive, 0);
+
+  auto root = load_snapshot<SnapNode>(path.c_str());
+  ASSERT_EQ(SnapNode::alive, 4);
+  ASSERT_EQ(root->value, 0);
+  ASSERT_EQ(root.use_count(), 1);
+  ASSERT_EQ(root->children.size(), 2u);
+  auto a = root->children[0];
+  auto b = root->children[1];
+  ASSERT_EQ(a->value, 1);
+  ASSERT_EQ(b->value, 2);
+  ASSERT_EQ(a->children[0], b->children[0]);
+  auto shared = a->children[0];
+  ASSERT_EQ(shared->value, 3);
+  ASSERT_EQ(shared.use_count(), 3);
+  ASSERT_EQ(shared->parent.lock(), a);
+  ASSERT_EQ(a->parent.lock(), root);
+  ASSERT_EQ(root->cnt()->weak_ref_count(), 1);
+  ASSERT_TRUE(b->parent.expired());
+
+  obs_ptr<SnapNode> watch(shared);
+  a.reset();
+  b.reset();
+  shared.reset();
+  root.reset();
+  ASSERT_EQ(SnapNode::alive, 0);
+  ASSERT_TRUE(watch.expired());
+  std::remove(path.c_str());
+}
+
+TEST(Test, snapshot_truncated_payload) {
+  snapshot_types<SnapNode::refcnt_type>::add<SnapNode>();
+  const auto path = ::testing::TempDir() + "ref_ptr_snapshot_bad.bin";
+  SnapNode::alive = 0;
+  {
+    auto root = make_ref<SnapNode>(0);
+    auto a = make_ref<SnapNode>(1);
+    auto b = make_ref<SnapNode>(2);
+    auto shared = make_ref<SnapNode>(3);
+    root->children = {a, b};
+    a->children = {shared};
+    b->children = {shared};
+    b->parent = obs_ptr<SnapNode>(root);
+    save_snapshot(path.c_str(), root);
+  }
+  ASSERT_EQ(SnapNode::alive, 0);
+
+  // Nodes are saved breadth first: cut b's payload before its parent, after
+  // it has taken its edge to shared, which is not constructed yet.
+  namespace fmt = snapshot_format;
+  std::fstream f(path, std::ios::binary | std::ios::in | std::ios::out);
+  const auto at = sizeof(fmt::Header) + 2 * sizeof(fmt::Node) +
+                  offsetof(fmt::Node, payload_size);
+  uint64_t payload_size;
+  f.seekg(std::streamoff(at));
+  f.read(reinterpret_cast<char *>(&payload_size), sizeof(payload_size));
+  payload_size -= sizeof(uint32_t);
+  f.seekp(std::streamoff(at));
+  f.write(reinterpret_cast<const char *>(&payload_size),
+          sizeof(payload_size));
+  f.close();
+
+  ASSERT_THROW(load_snapshot<SnapNode>(path.c_str()), std::runtime_error);
+  ASSERT_EQ(SnapNode::alive, 0);
+  std::remove(path.c_str());
+}
+
+TEST(Test, snapshot_bad_offsets) {
+  snapshot_types<SnapNode::refcnt_type>::add<SnapNode>();
+  const auto path = ::testing::TempDir() + "ref_ptr_snapshot_offsets.bin";
+  SnapNode::alive = 0;
+  {
+    auto root = make_ref<SnapNode>(0);
+    root->children = {make_ref<SnapNode>(1), make_ref<SnapNode>(2)};
+    save_snapshot(path.c_str(), root);
+  }
+  std::vector<char> good;
+  {
+    std::ifstream in(path, std::ios::binary);
+    good.assign(std::istreambuf_iterator<char>(in), {});
+  }
+  ASSERT_EQ(load_snapshot<SnapNode>(path.c_str())->children.size(), 2u);
+  ASSERT_EQ(SnapNode::alive, 0);
+
+  // Each file has one field pointing outside its object or arena range.
+  namespace fmt = snapshot_format;
+  const auto node = [](size_t i, size_t field) {
+    return sizeof(fmt::Header) + i * sizeof(fmt::Node) + field;
+  };
+  fmt::Node root;
+  std::memcpy(&root, good.data() + node(0, 0), sizeof(root));
+  // The root's payload: value, child count, then index and offset of the
+  // first child.
+  const size_t first_delta =
+      root.payload + sizeof(int) + 2 * sizeof(uint32_t);
+  fmt::Node second;
+  std::memcpy(&second, good.data() + node(1, 0), sizeof(second));
+  const std::pair<size_t, uint64_t> patches[] = {
+      {offsetof(fmt::Header, root_delta), 1ull << 40},
+      {offsetof(fmt::Header, root_delta), uint64_t(-8)},
+      {first_delta, 1ull << 40},
+      {first_delta, sizeof(SnapNode)},
+      {node(1, offsetof(fmt::Node, block)), root.block},
+      {node(1, offsetof(fmt::Node, object)), root.object},
+      {node(2, offsetof(fmt::Node, block)), second.block},
+  };
+  for (auto [at, value] : patches) {
+    auto bad = good;
+    std::memcpy(bad.data() + at, &value, sizeof(value));
+    std::ofstream(path, std::ios::binary | std::ios::trunc)
+        .write(bad.data(), std::streamsize(bad.size()));
+    ASSERT_THROW(load_snapshot<SnapNode>(path.c_str()), std::runtime_error)
+        << "patch at " << at;
+    ASSERT_EQ(SnapNode::alive, 0);
+  }
+  std::remove(path.c_str());
+}
+
+struct ShmNode {
+  static inline int destroyed = 0;
+  int value;
+  shm_ref_ptr<ShmNode> next;
+  explicit ShmNode(int value) : value(value) {}
+  ~ShmNode() { destroyed++; }
+};
+
+TEST(Test, shm_ref_ptr_dead_process) {
+  const auto name = "/ref_ptr_test_" + std::to_string(getpid());
+  shm_segment::unlink(name.c_str());
+  {
+    shm_segment seg(name.c_str(), 1 << 20);
+    ShmNode::destroyed = 0;
+    {
+      auto a = shm_make<ShmNode>(seg, 1);
+      // Stored in the segment: not charged to this process.
+      a->next = shm_make<ShmNode>(seg, 2);
+      seg.set_root(a);
+    }
+    auto root = seg.root<ShmNode>();
+    ASSERT_EQ(root.use_count(), 2);
+    ASSERT_EQ(root->next.use_count(), 1);
+
+    // The child takes references and dies without releasing them.
+    const pid_t pid = fork();
+    if (pid == 0) {
+      shm_segment child(name.c_str());
+      auto r = child.root<ShmNode>();
+      auto next = r->next;
+      shm_obs_ptr<ShmNode> obs(next);
+      next->value = 42;
+      _exit(r->value == 1 && child.slot() != seg.slot() ? 0 : 1);
+    }
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+    ASSERT_EQ(root->next->value, 42);
+    ASSERT_EQ(root.use_count(), 3);
+    ASSERT_EQ(root->next.use_count(), 2);
+
+    ASSERT_EQ(seg.reap(), 1u);
+    ASSERT_EQ(root.use_count(), 2);
+    ASSERT_EQ(root->next.use_count(), 1);
+
+    shm_obs_ptr<ShmNode> weak(root->next);
+    seg.set_root(shm_ref_ptr<ShmNode>());
+    root.reset();
+    ASSERT_EQ(ShmNode::destroyed, 2);
+    ASSERT_TRUE(weak.expired());
+    ASSERT_FALSE(weak.lock());
+  }
+  shm_segment::unlink(name.c_str());
+
+  // A pointer that outlives its segment fails loudly when released.
+  ASSERT_DEATH(
+      {
+        std::optional<shm_segment> seg(std::in_place, name.c_str(), 1 << 20);
+        auto p = shm_make<ShmNode>(*seg, 1);
+        seg.reset();
+      },
+      "no attached shm_segment");
+  shm_segment::unlink(name.c_str());
+}
+
+TEST(Test, shm_ref_ptr_zombie_process) {
+  const auto name = "/ref_ptr_zombie_" + std::to_string(getpid());
+  shm_segment::unlink(name.c_str());
+  {
+    shm_segment seg(name.c_str(), 1 << 20);
+    seg.set_root(shm_make<ShmNode>(seg, 1));
+    auto root = seg.root<ShmNode>();
+
+    const pid_t pid = fork();
+    if (pid == 0) {
+      shm_segment child(name.c_str());
+      auto r = child.root<ShmNode>();
+      _exit(r ? 0 : 1);
+    }
+    // Not waited for yet: the child keeps its pid as a zombie, which holds
+    // nothing any more.
+    siginfo_t info{};
+    ASSERT_EQ(waitid(P_PID, pid, &info, WEXITED | WNOWAIT), 0);
+    ASSERT_EQ(root.use_count(), 3);
+    ASSERT_EQ(seg.reap(), 1u);
+    ASSERT_EQ(root.use_count(), 2);
+    ASSERT_EQ(seg.reap(), 0u);
+
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+    seg.set_root(shm_ref_ptr<ShmNode>());
+  }
+  shm_segment::unlink(name.c_str());
+}
+
+class SharedTestObject : public TestObject,
+                         public enable_shared_from_ref<SharedTestObject> {
+public:
+  using TestObject::TestObject;
+};
+
+TEST(Test, shared_ptr_interop) {
+  int flag = 1;
+  {
+    auto ptr = make_ref<TestObject>(flag);
+    auto shared = to_shared_ptr(ptr);
+    ASSERT_EQ(shared.get(), ptr.get());
+    ASSERT_EQ(ptr.use_count(), 2);
+    std::shared_ptr<CountedAbstractObject> base = shared;
+    auto back = from_shared_ptr(base);
+    ASSERT_EQ(back.get(), ptr.get());
+    ASSERT_EQ(ptr.use_count(), 3);
+    ptr.reset();
+    back.reset();
+    shared.reset();
+    ASSERT_EQ(flag, 1);
+    base.reset();
+  }
+  ASSERT_EQ(flag, 0);
+
+  // Only shared_ptrs holding an intrusive reference convert back.
+  ASSERT_EQ(from_shared_ptr(std::shared_ptr<TestObject>()), nullptr);
+  std::shared_ptr<TestObject> other(make_ptr<TestObject>(flag),
+                                    [](TestObject *p) { p->cnt()->deref(); });
+  ASSERT_EQ(from_shared_ptr(other), nullptr);
+  other.reset();
+
+  flag = 1;
+  {
+    auto ptr = make_ref<SharedTestObject>(flag);
+    auto a = to_shared_ptr(ptr);
+    auto b = to_shared_ptr(ref_ptr<SharedTestObject>(ptr));
+    ASSERT_EQ(a.use_count(), 2);
+    ASSERT_EQ(b.use_count(), 2);
+    ASSERT_EQ(ptr.use_count(), 2);
+    a.reset();
+    b.reset();
+    ASSERT_EQ(ptr.use_count(), 1);
+    // The cached control block expired; a new one is made.
+    a = to_shared_ptr(std::move(ptr));
+    ASSERT_EQ(ptr, nullptr);
+    ASSERT_EQ(a.use_count(), 1);
+  }
+  ASSERT_EQ(flag, 0);
+}
+
+#ifdef REF_PTR_ALLOC_SAMPLING
+TEST(Test, alloc_site_sampling) {
+  AllocSiteRegistry::set_sample_rate(1);
+  int flag = 1;
+  TestAlloc alloc;
+  const auto line = std::source_location::current().line() + 3;
+  std::vector<ref_ptr<TestObject>> objs;
+  for (int i = 0; i < 3; i++)
+    objs.push_back(make_ref_ptr<TestObject, IObject, TestAlloc>(&alloc, flag));
+
+  auto stats = AllocSiteRegistry::instance().snapshot();
+  ASSERT_EQ(stats.size(), 1);
+  ASSERT_EQ(stats[0].line, line);
+  ASSERT_NE(stats[0].file.find("test.cpp"), std::string::npos);
+  ASSERT_EQ(stats[0].live_count, 3);
+  ASSERT_GE(stats[0].live_bytes, 3 * sizeof(TestObject));
+  ASSERT_EQ(stats[0].age_histogram[0] + stats[0].age_histogram[1], 3);
+
+  objs.pop_back();
+  ASSERT_EQ(AllocSiteRegistry::instance().snapshot()[0].live_count, 2);
+  objs.clear();
+  ASSERT_TRUE(AllocSiteRegistry::instance().snapshot().empty());
+
+  // The allocator type deduced from a pointer or an AllocSite, and a site
+  // passed through a wrapper or an array count, still name this file.
+  const auto deduced = std::source_location::current().line() + 1;
+  auto d = make_ref_ptr<DerivedObject, IObject>(&alloc);
+  auto e = make_ref_ptr<TestObject, IObject>(AllocSite(&alloc), flag);
+  auto w = make_ref<TestObject>(flag);
+  auto arr = make_ref_array<CountingObject>(2, 1);
+  std::set<uint32_t> lines;
+  for (auto &s : AllocSiteRegistry::instance().snapshot()) {
+    ASSERT_NE(s.file.find("test.cpp"), std::string::npos);
+    lines.insert(s.line);
+  }
+  ASSERT_EQ(lines, (std::set<uint32_t>{deduced, deduced + 1, deduced + 2,
+                                       deduced + 3}));
+  // Deduced from a pointer with constructor arguments, the site is
+  // vm_make's own.
+  auto f = make_ref_ptr<TestObject, IObject>(&alloc, flag);
+  ASSERT_EQ(AllocSiteRegistry::instance().find(f.get()).find("test.cpp"),
+            std::string::npos);
+  f.reset();
+  d.reset();
+  e.reset();
+  w.reset();
+  arr.reset();
+  ASSERT_EQ(alloc.allocCount.load(), 0);
+  AllocSiteRegistry::set_sample_rate(0);
+}
+#endif
+
+#if defined(REF_PTR_ALLOC_SAMPLING) && defined(REF_PTR_CONTENTION_PROFILING)
+TEST(Test, contention_profiler) {
+  ContentionProfiler::instance().clear();
+  AllocSiteRegistry::set_sample_rate(1);
+  ContentionProfiler::set_sample_rate(1);
+  int flag = 1;
+  TestAlloc alloc;
+  auto hot = make_ref_ptr<TestObject, IObject, TestAlloc>(&alloc, flag);
+  auto cold = make_ref_ptr<TestObject, IObject, TestAlloc>(&alloc, flag);
+  constexpr int N = 1000;
+  {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([&] {
+        for (int i = 0; i < N; i++)
+          auto copy = hot;
+      });
+    }
+    for (auto &t : threads)
+      t.join();
+  }
+  { auto copy = cold; }
+  ContentionProfiler::set_sample_rate(0);
+
+  auto top = ContentionProfiler::instance().top(2);
+  ASSERT_EQ(top.size(), 2);
+  ASSERT_EQ(top[0].block, hot->cnt());
+  ASSERT_EQ(top[0].object, hot.get());
+  ASSERT_EQ(top[0].ops[ContentionProfiler::REF], 4 * N);
+  ASSERT_EQ(top[0].ops[ContentionProfiler::DEREF], 4 * N);
+  ASSERT_EQ(top[0].samples, 8 * N);
+  ASSERT_GE(top[0].threads(), 1);
+  ASSERT_STREQ(top[0].type_name, ref_type_name<TestObject>());
+  ASSERT_NE(top[0].site.find("test.cpp"), std::string::npos);
+  ASSERT_EQ(top[1].block, cold->cnt());
+  ASSERT_EQ(top[1].samples, 2);
+
+  hot.reset();
+  ASSERT_FALSE(ContentionProfiler::instance().top(1)[0].alive);
+  cold.reset();
+  AllocSiteRegistry::set_sample_rate(0);
+  ContentionProfiler::instance().clear();
+}
+#endif
+
+#ifdef REF_PTR_CONTENTION_PROFILING
+TEST(Test, contention_profiler_last_deref) {
+  // Two threads drop the last two references at once: the sample of the one
+  // that does not free the block is recorded after the other freed it.
+  ContentionProfiler::instance().clear();
+  ContentionProfiler::set_sample_rate(1);
+  for (int i = 0; i < 2000; i++) {
+    int flag = 1;
+    auto a = make_ref<TestObject>(flag);
+    auto b = a;
+    obs_ptr<TestObject> obs(a);
+    std::atomic<int> ready{0};
+    auto drop = [&](ref_ptr<TestObject> &p) {
+      ready++;
+      while (ready < 2)
+        std::this_thread::yield();
+      p.reset();
+    };
+    std::thread t([&] { drop(b); });
+    drop(a);
+    t.join();
+    obs.reset();
+    ASSERT_EQ(flag, 0);
+  }
+  ContentionProfiler::set_sample_rate(0);
+  // Every block is gone, none may be left in the table as alive.
+  for (const auto &s : ContentionProfiler::instance().top(
+           ContentionProfiler::TABLE_SIZE))
+    ASSERT_FALSE(s.alive);
+  ContentionProfiler::instance().clear();
+}
+#endif
+
+#if REF_PTR_HAS_PROBES && defined(__linux__)
+// Collects "provider:name" of every stapsdt note in our own executable.
+std::set<std::string> read_sdt_probes(const char *path) {
+  std::ifstream f(path, std::ios::binary);
+  std::string image((std::istreambuf_iterator<char>(f)),
+                    std::istreambuf_iterator<char>());
+  std::set<std::string> probes;
+  if (image.size() < sizeof(Elf64_Ehdr))
+    return probes;
+  auto ehdr = reinterpret_cast<const Elf64_Ehdr *>(image.data());
+  auto shdr = reinterpret_cast<const Elf64_Shdr *>(image.data() + ehdr->e_shoff);
+  const char *shstr = image.data() + shdr[ehdr->e_shstrndx].sh_offset;
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    if (std::string(shstr + shdr[i].sh_name) != ".note.stapsdt")
+      continue;
+    const char *p = image.data() + shdr[i].sh_offset;
+    const char *end = p + shdr[i].sh_size;
+    while (p + sizeof(Elf64_Nhdr) <= end) {
+      auto nhdr = reinterpret_cast<const Elf64_Nhdr *>(p);
+      const char *desc = p + sizeof(Elf64_Nhdr) + ((nhdr->n_namesz + 3) & ~3);
+      // desc: pc, base, semaphore, provider\0name\0args\0
+      const char *provider = desc + 3 * sizeof(uint64_t);
+      const char *name = provider + strlen(provider) + 1;
+      probes.insert(std::string(provider) + ":" + name);
+      p = desc + ((nhdr->n_descsz + 3) & ~3);
+    }
+  }
+  return probes;
+}
+
+TEST(Test, sdt_probes) {
+  int flag = 1;
+  {
+    auto ptr = make_ref<TestObject>(flag);
+    obs_ptr<TestObject> obs(ptr);
+    ptr.reset();
+    ASSERT_EQ(obs.lock(), nullptr);
+  }
+  ASSERT_EQ(flag, 0);
+
+  auto probes = read_sdt_probes("/proc/self/exe");
+  for (auto name : {"make", "zero", "destroy", "release", "lock_fail"}) {
+    ASSERT_TRUE(probes.count(std::string("ref_ptr:") + name)) << name;
+  }
+}
+#endif
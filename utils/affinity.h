@@ -0,0 +1,154 @@
+#pragma once
+#include <algorithm>
+#include <cstdlib>
+#include <optional>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <filesystem>
+#include <fstream>
+#include <sched.h>
+#endif
+
+// Thread placements used by the contention benchmarks.
+enum class Affinity {
+  NONE,         // not pinned, the scheduler decides
+  SAME_CPU,     // every thread on one logical CPU
+  SMT,          // alternating between the hyperthreads of one physical core
+  CORE,         // distinct physical cores of one socket
+  CROSS_SOCKET, // alternating between two sockets
+  CROSS_NODE    // alternating between two NUMA nodes
+};
+
+inline const char *affinity_name(Affinity a) {
+  switch (a) {
+  case Affinity::NONE:
+    return "none";
+  case Affinity::SAME_CPU:
+    return "same_cpu";
+  case Affinity::SMT:
+    return "smt";
+  case Affinity::CORE:
+    return "core";
+  case Affinity::CROSS_SOCKET:
+    return "cross_socket";
+  case Affinity::CROSS_NODE:
+    return "cross_node";
+  }
+  return "?";
+}
+
+struct CpuInfo {
+  int cpu;
+  int core;
+  int package;
+  int node;
+};
+
+// CPUs this process may run on, with their core, socket and NUMA node ids.
+inline std::vector<CpuInfo> cpu_topology() {
+  std::vector<CpuInfo> cpus;
+#if defined(__linux__)
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    return cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &set))
+      continue;
+    const auto dir =
+        "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+    CpuInfo info{cpu, cpu, 0, 0};
+    std::ifstream(dir + "core_id") >> info.core;
+    std::ifstream(dir + "physical_package_id") >> info.package;
+    // cpuN/nodeM links the CPU to its node
+    std::error_code ec;
+    for (const auto &e : std::filesystem::directory_iterator(
+             "/sys/devices/system/cpu/cpu" + std::to_string(cpu), ec)) {
+      const auto name = e.path().filename().string();
+      if (name.rfind("node", 0) == 0 && name.size() > 4)
+        info.node = std::atoi(name.c_str() + 4);
+    }
+    cpus.push_back(info);
+  }
+#endif
+  return cpus;
+}
+
+// CPU for each of `n` threads, -1 meaning unpinned. Empty when the machine
+// cannot provide the placement (no SMT, single socket, too few cores).
+inline std::optional<std::vector<int>> place_threads(Affinity a, int n) {
+  if (a == Affinity::NONE)
+    return std::vector<int>(n, -1);
+  const auto cpus = cpu_topology();
+  if (cpus.empty())
+    return std::nullopt;
+
+  std::vector<int> pool;
+  switch (a) {
+  case Affinity::SAME_CPU:
+    pool = {cpus[0].cpu};
+    break;
+  case Affinity::SMT:
+    for (const auto &c : cpus) {
+      if (c.package == cpus[0].package && c.core == cpus[0].core)
+        pool.push_back(c.cpu);
+    }
+    if (pool.size() < 2)
+      return std::nullopt;
+    break;
+  case Affinity::CORE: {
+    std::vector<int> cores;
+    for (const auto &c : cpus) {
+      if (c.package != cpus[0].package ||
+          std::find(cores.begin(), cores.end(), c.core) != cores.end())
+        continue;
+      cores.push_back(c.core);
+      pool.push_back(c.cpu);
+    }
+    if (int(pool.size()) < n)
+      return std::nullopt;
+  } break;
+  case Affinity::CROSS_SOCKET:
+    for (const auto &c : cpus) {
+      if (c.package != cpus[0].package) {
+        pool = {cpus[0].cpu, c.cpu};
+        break;
+      }
+    }
+    if (pool.empty())
+      return std::nullopt;
+    break;
+  case Affinity::CROSS_NODE:
+    for (const auto &c : cpus) {
+      if (c.node != cpus[0].node) {
+        pool = {cpus[0].cpu, c.cpu};
+        break;
+      }
+    }
+    if (pool.empty())
+      return std::nullopt;
+    break;
+  default:
+    break;
+  }
+
+  std::vector<int> placement(n);
+  for (int i = 0; i < n; i++)
+    placement[i] = pool[i % pool.size()];
+  return placement;
+}
+
+// Pins the calling thread, returns false when not supported.
+inline bool pin_thread(int cpu) {
+  if (cpu < 0)
+    return true;
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
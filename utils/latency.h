@@ -0,0 +1,33 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Collects per-operation latencies and reports percentiles of them.
+struct LatencyRecorder {
+  using clock = std::chrono::steady_clock;
+  std::vector<uint64_t> samples_ns;
+
+  static clock::time_point now() { return clock::now(); }
+
+  void record(clock::time_point start, clock::time_point end) {
+    samples_ns.push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count());
+  }
+
+  void merge(const LatencyRecorder &o) {
+    samples_ns.insert(samples_ns.end(), o.samples_ns.begin(),
+                      o.samples_ns.end());
+  }
+
+  // p in [0, 1]; sorts the samples.
+  uint64_t percentile(double p) {
+    if (samples_ns.empty())
+      return 0;
+    std::sort(samples_ns.begin(), samples_ns.end());
+    auto idx = size_t(p * double(samples_ns.size() - 1));
+    return samples_ns[idx];
+  }
+};
@@ -0,0 +1,207 @@
+#pragma once
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(__linux__)
+#include <fstream>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware event counts through perf_event_open, for the benchmarks.
+// Counts the constructing thread and every thread it (or its descendants)
+// start afterwards, user space only. Off unless REF_PTR_PERF_COUNTERS is set
+// in the environment. Events the kernel, the CPU or the sandbox refuses
+// (perf_event_paranoid, containers, VMs) are left out of the report.
+//
+// hitm counts loads served by a modified line in another core's cache. It
+// is model specific: MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM (raw 0x04d2) on Intel,
+// or the raw config in REF_PTR_PERF_HITM_EVENT, e.g. 0x20d2.
+class PerfCounters {
+public:
+  enum EEvent {
+    CYCLES,
+    INSTRUCTIONS,
+    L1D_MISSES,
+    LLC_MISSES,
+    DTLB_MISSES,
+    HITM,
+    EVENT_COUNT
+  };
+
+  static const char *event_name(EEvent e) {
+    const char *names[] = {"cycles",     "instructions", "l1d_misses",
+                           "llc_misses", "dtlb_misses",  "hitm"};
+    return names[e];
+  }
+
+  static bool enabled() {
+    static const bool on = std::getenv("REF_PTR_PERF_COUNTERS") != nullptr;
+    return on;
+  }
+
+  PerfCounters() {
+    for (auto &fd : _fds)
+      fd = -1;
+#if defined(__linux__)
+    if (!enabled())
+      return;
+    int err = 0;
+    for (int e = 0; e < EVENT_COUNT; e++) {
+      perf_event_attr attr;
+      if (!event_attr(EEvent(e), attr))
+        continue;
+      _fds[e] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+      if (_fds[e] < 0)
+        err = errno;
+    }
+    if (!available() && err) {
+      static bool warned = false;
+      if (!warned)
+        std::fprintf(stderr, "perf counters unavailable: %s%s\n",
+                     std::strerror(err),
+                     err == EACCES || err == EPERM
+                         ? " (see /proc/sys/kernel/perf_event_paranoid)"
+                         : "");
+      warned = true;
+    }
+#endif
+  }
+
+  ~PerfCounters() {
+#if defined(__linux__)
+    for (auto fd : _fds) {
+      if (fd >= 0)
+        close(fd);
+    }
+#endif
+  }
+
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  bool available() const {
+    for (auto fd : _fds) {
+      if (fd >= 0)
+        return true;
+    }
+    return false;
+  }
+
+  // Counting is cumulative across start/stop pairs until reset().
+  void start() { ioctl_all(PERF_EVENT_IOC_ENABLE); }
+  void stop() { ioctl_all(PERF_EVENT_IOC_DISABLE); }
+  void reset() { ioctl_all(PERF_EVENT_IOC_RESET); }
+
+  // Count scaled for multiplexing, negative when the event is not counted.
+  double value(EEvent e) const {
+#if defined(__linux__)
+    uint64_t v[3];
+    if (_fds[e] < 0 || read(_fds[e], v, sizeof(v)) != sizeof(v))
+      return -1;
+    if (v[2] == 0)
+      return 0;
+    return double(v[0]) * double(v[1]) / double(v[2]);
+#else
+    return -1;
+#endif
+  }
+
+  // Sets "<event>/op" counters for the available events, plus ipc.
+  template <typename State> void report(State &st, double ops) const {
+    if (ops <= 0)
+      return;
+    for (int e = 0; e < EVENT_COUNT; e++) {
+      const auto v = value(EEvent(e));
+      if (v >= 0)
+        st.counters[std::string(event_name(EEvent(e))) + "/op"] = v / ops;
+    }
+    const auto cycles = value(CYCLES);
+    const auto instructions = value(INSTRUCTIONS);
+    if (cycles > 0 && instructions >= 0)
+      st.counters["ipc"] = instructions / cycles;
+  }
+
+private:
+  void ioctl_all(unsigned long request) {
+#if defined(__linux__)
+    for (auto fd : _fds) {
+      if (fd >= 0)
+        ioctl(fd, request, 0);
+    }
+#else
+    (void)request;
+#endif
+  }
+
+#if defined(__linux__)
+  static bool event_attr(EEvent e, perf_event_attr &attr) {
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    switch (e) {
+    case CYCLES:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      return true;
+    case INSTRUCTIONS:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      return true;
+    case L1D_MISSES:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_L1D |
+                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      return true;
+    case LLC_MISSES:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      return true;
+    case DTLB_MISSES:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      return true;
+    case HITM:
+      attr.type = PERF_TYPE_RAW;
+      attr.config = hitm_config();
+      return attr.config != 0;
+    default:
+      return false;
+    }
+  }
+
+  static uint64_t hitm_config() {
+    if (auto raw = std::getenv("REF_PTR_PERF_HITM_EVENT"))
+      return std::strtoull(raw, nullptr, 0);
+#if defined(__x86_64__) || defined(__i386__)
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string key, sep, vendor;
+    while (cpuinfo >> key) {
+      if (key == "vendor_id") {
+        cpuinfo >> sep >> vendor;
+        break;
+      }
+    }
+    if (vendor == "GenuineIntel")
+      return 0x04d2;
+#endif
+    return 0;
+  }
+#endif
+
+  int _fds[EVENT_COUNT];
+};
@@ -1,92 +1,361 @@
+#include <atomic>
+#include <cstdint>
+#include <exception>
 #include <functional>
-#include <future>
-#include <queue>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 using namespace std;
+
+// Work-stealing executor used by the tests and benchmarks. Every worker owns
+// a Chase-Lev deque; tasks appended from outside the pool go to a shared
+// deque that the workers steal from, tasks appended by a worker go to its own.
+// Tasks are stored inline in recycled nodes, so appending a small callable
+// does not allocate once the pool is warm. Idle workers and wait() spin for a
+// while before sleeping on a futex (std::atomic::wait); with a single CPU
+// they sleep right away, spinning would only delay the thread they wait for.
+
+// Type-erased void() callable, stored inline when it fits.
+class small_task {
+public:
+  static constexpr size_t INLINE_SIZE = 48;
+
+  small_task() = default;
+  small_task(const small_task &) = delete;
+  small_task &operator=(const small_task &) = delete;
+  ~small_task() { reset(); }
+
+  template <typename F> void emplace(F &&f) {
+    using Fn = decay_t<F>;
+    reset();
+    if constexpr (sizeof(Fn) <= INLINE_SIZE &&
+                  alignof(Fn) <= alignof(max_align_t)) {
+      new (_buf) Fn(std::forward<F>(f));
+      _invoke = [](void *p) { (*static_cast<Fn *>(p))(); };
+      _destroy = [](void *p) { static_cast<Fn *>(p)->~Fn(); };
+    } else {
+      *reinterpret_cast<Fn **>(_buf) = new Fn(std::forward<F>(f));
+      _invoke = [](void *p) { (**static_cast<Fn **>(p))(); };
+      _destroy = [](void *p) { delete *static_cast<Fn **>(p); };
+    }
+  }
+
+  void operator()() { _invoke(_buf); }
+
+  void reset() {
+    if (_destroy)
+      _destroy(_buf);
+    _invoke = nullptr;
+    _destroy = nullptr;
+  }
+
+private:
+  alignas(max_align_t) unsigned char _buf[INLINE_SIZE];
+  void (*_invoke)(void *){nullptr};
+  void (*_destroy)(void *){nullptr};
+};
+
+struct task_node;
+
+// Recycles task nodes. Only the owner allocates; any thread may free, onto
+// an atomic stack that the owner takes over whole when it runs dry.
+struct task_node_cache {
+  task_node *local{nullptr};
+  atomic<task_node *> returned{nullptr};
+  vector<task_node *> all;
+
+  task_node *alloc();
+  void free(task_node *node);
+  ~task_node_cache();
+};
+
+struct task_node {
+  small_task task;
+  task_node *next{nullptr};
+  task_node_cache *cache{nullptr};
+};
+
+inline task_node *task_node_cache::alloc() {
+  if (!local)
+    local = returned.exchange(nullptr, memory_order_acquire);
+  if (auto node = local) {
+    local = node->next;
+    return node;
+  }
+  auto node = new task_node;
+  node->cache = this;
+  all.push_back(node);
+  return node;
+}
+
+inline void task_node_cache::free(task_node *node) {
+  node->task.reset();
+  node->next = returned.load(memory_order_relaxed);
+  while (!returned.compare_exchange_weak(node->next, node,
+                                         memory_order_release,
+                                         memory_order_relaxed))
+    ;
+}
+
+inline task_node_cache::~task_node_cache() {
+  for (auto node : all)
+    delete node;
+}
+
+// Chase-Lev deque (Le et al., "Correct and Efficient Work-Stealing for Weak
+// Memory Models"). push/take by the owner only, steal by anyone.
+class work_deque {
+public:
+  work_deque() : _ring(new ring(64)) { _rings.emplace_back(_ring.load()); }
+  ~work_deque() {
+    for (auto r : _rings)
+      delete r;
+  }
+
+  void push(task_node *node) {
+    const auto b = _bottom.load(memory_order_relaxed);
+    const auto t = _top.load(memory_order_acquire);
+    auto r = _ring.load(memory_order_relaxed);
+    if (b - t > r->mask) {
+      r = r->grow(t, b);
+      _rings.push_back(r);
+      _ring.store(r, memory_order_release);
+    }
+    r->put(b, node);
+    atomic_thread_fence(memory_order_release);
+    _bottom.store(b + 1, memory_order_relaxed);
+  }
+
+  task_node *take() {
+    const auto b = _bottom.load(memory_order_relaxed) - 1;
+    auto r = _ring.load(memory_order_relaxed);
+    _bottom.store(b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    auto t = _top.load(memory_order_relaxed);
+    task_node *node = nullptr;
+    if (t <= b) {
+      node = r->get(b);
+      if (t == b) {
+        if (!_top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                          memory_order_relaxed))
+          node = nullptr;
+        _bottom.store(b + 1, memory_order_relaxed);
+      }
+    } else {
+      _bottom.store(b + 1, memory_order_relaxed);
+    }
+    return node;
+  }
+
+  task_node *steal() {
+    auto t = _top.load(memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    const auto b = _bottom.load(memory_order_acquire);
+    if (t >= b)
+      return nullptr;
+    auto node = _ring.load(memory_order_acquire)->get(t);
+    if (!_top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                      memory_order_relaxed))
+      return nullptr;
+    return node;
+  }
+
+private:
+  struct ring {
+    int64_t mask;
+    atomic<task_node *> *slots;
+    explicit ring(int64_t size)
+        : mask(size - 1), slots(new atomic<task_node *>[size]) {}
+    ~ring() { delete[] slots; }
+    task_node *get(int64_t i) const {
+      return slots[i & mask].load(memory_order_relaxed);
+    }
+    void put(int64_t i, task_node *node) {
+      slots[i & mask].store(node, memory_order_relaxed);
+    }
+    ring *grow(int64_t t, int64_t b) const {
+      auto r = new ring((mask + 1) * 2);
+      for (auto i = t; i < b; i++)
+        r->put(i, get(i));
+      return r;
+    }
+  };
+
+  alignas(64) atomic<int64_t> _top{0};
+  alignas(64) atomic<int64_t> _bottom{0};
+  atomic<ring *> _ring;
+  // Stealers may still read a replaced ring, so rings live until the end.
+  vector<ring *> _rings;
+};
+
 struct thread_pool {
   thread_pool(const thread_pool &) = delete;
   thread_pool &operator=(const thread_pool &) = delete;
   thread_pool(size_t);
   ~thread_pool();
   template <typename F, typename... Args>
-  auto append_task(F &&f, Args &&...args);
+  void append_task(F &&f, Args &&...args);
+  // Blocks until every appended task has finished, rethrows the first
+  // exception a task threw.
   void wait();
 
 private:
-  vector<thread> workers;
-  queue<function<void()>> tasks;
-  mutex mut;
-  atomic<size_t> idle;
-  condition_variable cond;
-  condition_variable waitCond;
-  size_t nthreads;
-  bool stop;
+  static int spin_count() {
+    static const int n = thread::hardware_concurrency() > 1 ? 1 << 10 : 0;
+    return n;
+  }
+
+  static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  struct worker {
+    work_deque deque;
+    task_node_cache cache;
+  };
+
+  task_node *find_task(size_t self);
+  void run(task_node *node);
+  void work(size_t self);
+
+  static thread_local thread_pool *current_pool;
+  static thread_local size_t current_worker;
+
+  vector<unique_ptr<worker>> workers;
+  vector<thread> threads;
+  // Tasks appended from outside the pool.
+  work_deque external;
+  task_node_cache external_cache;
+  mutex external_mut;
+
+  atomic<uint32_t> pending{0};
+  atomic<uint32_t> waiters{0};
+  atomic<uint32_t> epoch{0};
+  atomic<uint32_t> sleepers{0};
+  atomic<bool> stop{false};
+  mutex error_mut;
+  exception_ptr error;
 };
-inline thread_pool::thread_pool(size_t threads)
-    : idle(threads), nthreads(threads), stop(false) {
-  for (size_t i = 0; i < threads; ++i)
-    workers.emplace_back([this] {
-      while (true) {
-        function<void()> task;
-        {
-          unique_lock<mutex> lock(this->mut);
-          this->cond.wait(
-              lock, [this] { return this->stop || !this->tasks.empty(); });
-          if (this->stop) {
-            return;
-          }
-          idle--;
-          task = std::move(this->tasks.front());
-          this->tasks.pop();
-        }
-        task();
-        idle++;
-        {
-          lock_guard<mutex> lk(this->mut);
-          if (idle.load() == this->nthreads && this->tasks.empty()) {
-            waitCond.notify_all();
-          }
-        }
-      }
-    });
+
+inline thread_local thread_pool *thread_pool::current_pool = nullptr;
+inline thread_local size_t thread_pool::current_worker = 0;
+
+inline thread_pool::thread_pool(size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    workers.push_back(make_unique<worker>());
+  for (size_t i = 0; i < n; ++i)
+    threads.emplace_back([this, i] { work(i); });
 }
 
 // add new work item to the pool
 template <class F, class... Args>
-auto thread_pool::append_task(F &&f, Args &&...args) {
-  using return_type = invoke_result_t<F, Args...>;
-
-  // perfect capture couble be used in C++20.
-  auto task = make_shared<packaged_task<return_type()>>(
-      std::bind(std::forward<F>(f), std::forward<Args>(args)...));
-  future<return_type> res = task->get_future();
-  {
-    unique_lock<mutex> lock(mut);
+void thread_pool::append_task(F &&f, Args &&...args) {
+  auto fn = [f = std::forward<F>(f),
+             ... args = std::forward<Args>(args)]() mutable {
+    std::invoke(f, args...);
+  };
+  pending.fetch_add(1);
+  if (current_pool == this) {
+    auto &w = *workers[current_worker];
+    auto node = w.cache.alloc();
+    node->task.emplace(std::move(fn));
+    w.deque.push(node);
+  } else {
+    lock_guard<mutex> lock(external_mut);
     // don't allow enqueueing after stopping the pool
-    if (stop) {
+    if (stop.load()) {
+      pending.fetch_sub(1);
       throw runtime_error("enqueue on stopped ThreadPool");
     }
-    tasks.emplace([task]() { (*task)(); });
+    auto node = external_cache.alloc();
+    node->task.emplace(std::move(fn));
+    external.push(node);
+  }
+  epoch.fetch_add(1);
+  if (sleepers.load())
+    epoch.notify_one();
+}
+
+inline task_node *thread_pool::find_task(size_t self) {
+  if (auto node = workers[self]->deque.take())
+    return node;
+  if (auto node = external.steal())
+    return node;
+  for (size_t i = 1; i < workers.size(); i++) {
+    if (auto node = workers[(self + i) % workers.size()]->deque.steal())
+      return node;
+  }
+  return nullptr;
+}
+
+inline void thread_pool::run(task_node *node) {
+  try {
+    node->task();
+  } catch (...) {
+    lock_guard<mutex> lock(error_mut);
+    if (!error)
+      error = current_exception();
+  }
+  node->cache->free(node);
+  if (pending.fetch_sub(1) == 1 && waiters.load())
+    pending.notify_all();
+}
+
+inline void thread_pool::work(size_t self) {
+  current_pool = this;
+  current_worker = self;
+  while (true) {
+    task_node *node = nullptr;
+    for (int i = 0;
+         i < spin_count() && !node && !stop.load(memory_order_relaxed); i++) {
+      cpu_relax();
+      node = find_task(self);
+    }
+    if (!node) {
+      sleepers.fetch_add(1);
+      const auto e = epoch.load();
+      node = find_task(self);
+      if (!node && !stop.load())
+        epoch.wait(e);
+      sleepers.fetch_sub(1);
+    }
+    if (node)
+      run(node);
+    else if (stop.load())
+      return;
   }
-  cond.notify_one();
-  return res;
 }
 
 inline void thread_pool::wait() {
-  mutex m;
-  unique_lock<mutex> l(m);
-  waitCond.wait(
-      l, [this]() { return this->idle.load() == nthreads && tasks.empty(); });
+  for (int i = 0; i < spin_count() && pending.load(); i++)
+    cpu_relax();
+  waiters.fetch_add(1);
+  for (auto n = pending.load(); n; n = pending.load())
+    pending.wait(n);
+  waiters.fetch_sub(1);
+  lock_guard<mutex> lock(error_mut);
+  if (error)
+    rethrow_exception(std::exchange(error, nullptr));
 }
 
 // the destructor joins all threads
 inline thread_pool::~thread_pool() {
   {
-    unique_lock<mutex> lock(mut);
+    lock_guard<mutex> lock(external_mut);
     stop = true;
   }
-  cond.notify_all();
-  for (thread &worker : workers) {
+  epoch.fetch_add(1);
+  epoch.notify_all();
+  for (thread &worker : threads) {
     if (worker.joinable())
       worker.join();
   }